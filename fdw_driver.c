@@ -12,37 +12,179 @@
 #include "funcapi.h"
 #include "utils/builtins.h"
 #include "optimizer/planmain.h"
+#include "optimizer/cost.h"
 #include "foreign/foreign.h"
 #include "catalog/pg_operator.h"
 #include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "access/tupmacs.h"
+#include "access/hash.h"
 #include "utils/syscache.h"
+#include "access/stratnum.h"
+#include "catalog/pg_am.h"
+#include "catalog/objectaccess.h"
+#include "catalog/pg_foreign_table.h"
+#include "optimizer/clauses.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "access/htup_details.h"
+#include "access/sysattr.h"
+#include "executor/executor.h"
 #include "utils/rel.h"
 #include "utils/lsyscache.h"
 #include "commands/defrem.h"
 #include "utils/jsonb.h"
+#include "utils/memutils.h"
+#include "lib/stringinfo.h"
+#include "storage/shm_toc.h"
+#include "storage/latch.h"
+#include "storage/ipc.h"
+#include "miscadmin.h"
+#include "access/xact.h"
+#include "commands/explain.h"
+#include "portability/instr_time.h"
+#include "storage/proc.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
 
 typedef struct HBaseFdwTableInfo {
+	Oid relid;
 	char *table_name;
 	int num_columns;
 	HBaseColumn *columns;
 
+	/* Changes whenever the table's mapping to HBase changes */
+	uint32 options_version;
+
+	/* The table's timeout option in milliseconds, 0 if there is none */
+	int timeout_ms;
+
+	/* Rows written to the worker per message */
+	int batch_size;
+
+	/* The table's bulk_load option, see hbase_fdw.bulk_load */
+	bool bulk_load;
+
 	List *remote_conds;
 	List *local_conds;
+
+	/* Also in local_conds, but narrow the range of row keys scanned */
+	List *key_conds;
 } HBaseFdwTableInfo;
 
+/*
+ * Parsed table and column options, cached per backend so planning and
+ * starting a scan don't walk the catalogs on every execution.
+ */
+typedef struct HBaseFdwTableCacheEntry {
+	Oid relid;						/* hash key, must be first */
+	bool valid;
+	uint32 foreign_table_hash;		/* syscache hash of our pg_foreign_table row */
+
+	char table_name[HBASE_FDW_MAX_TABLE_NAME_LEN + 1];
+	int num_columns;
+	HBaseColumn *columns;			/* allocated in CacheMemoryContext */
+	uint32 options_version;
+	int timeout_ms;
+	int batch_size;
+	bool bulk_load;
+} HBaseFdwTableCacheEntry;
+
+static HTAB *table_cache = NULL;
+
+static object_access_hook_type prev_object_access_hook = NULL;
+
+/* HBase tables dropped or altered by the current transaction */
+static List *changed_tables = NIL;
+
+/* Bumped by every invalidation, to detect ones arriving mid rebuild */
+static uint64 table_cache_inval_count = 0;
+
+/* How much of an expression the filters sent to HBase can evaluate */
+typedef enum HBasePushdown {
+	pushdown_none,
+	pushdown_lossy,				/* narrows the scan, Postgres rechecks it */
+	pushdown_exact
+} HBasePushdown;
+
 typedef struct HBaseFdwPrivateScanState {
 	HBaseFdwTableInfo *table_info;
-	List *filters;
+	HBaseFilter *filters;
+	int nr_filters;
 	bool worker_started;
 
-	FmgrInfo *param_flinfo;
+	/* How each parameter is serialized, decided when planning */
+	HBaseValueType *param_types;
 	List *param_exprs;
 
 	shm_mq_handle *mq_handle;
 	dsm_segment *seg;
+	Size mq_size;
+
+	/* Rows split over several messages are put back together here */
+	StringInfoData chunk_buf;
+
+	/* Reset for every row returned from the scan */
+	MemoryContext temp_cxt;
+
+	/* Points at the current row when the worker builds heap tuples */
+	HeapTupleData tuple;
+
+	/*
+	 * For an UPDATE or DELETE run by the worker, the parameter setting each
+	 * column, or -1, and whether the rows changed count towards the command.
+	 */
+	HBaseOperation operation;
+	HBaseMutationType mutation_type;
+	int *update_params;
+	bool set_processed;
+
+	/*
+	 * Collected when the scan runs under EXPLAIN ANALYZE.  The time to the
+	 * first row counts from asking for a worker, and the wait time is all
+	 * the time spent waiting for the worker to send something.
+	 */
+	bool collect_metrics;
+	int64 hbase_rows;
+	int64 mq_bytes;
+	instr_time start_time;
+	instr_time first_row_time;
+	instr_time wait_time;
+	bool have_first_row;
+	bool have_scan_metrics;
+	HBaseScanMetrics scan_metrics;
+	char *start_row;
+	char *stop_row;
 } HBaseFdwPrivateScanState;
 
+/* Rows written per message unless the table's batch_size option says otherwise */
+#define HBASE_FDW_DEFAULT_BATCH_SIZE 100
+
+typedef struct HBaseFdwModifyState {
+	HBaseFdwTableInfo *table_info;
+
+	/* Whether the statement sets each column */
+	bool *targets;
+
+	/* Junk attributes carrying the old row's key columns, for UPDATE and DELETE */
+	AttrNumber *key_attnos;
+
+	/* Write HFiles instead of sending the rows to the region servers */
+	bool bulk_load;
+
+	/* Mutations not yet sent, after room for the message header */
+	StringInfoData batch;
+	int batch_rows;
+
+	bool worker_started;
+	dsm_segment *seg;
+	shm_mq_handle *reply_mq;
+	shm_mq_handle *mutations_mq;
+
+	/* Reset for every row written */
+	MemoryContext temp_cxt;
+} HBaseFdwModifyState;
+
 static void
 hbaseGetForeignRelSize(PlannerInfo *root,
 					   RelOptInfo *baserel,
@@ -67,6 +209,50 @@ static void
 hbaseReScanForeignScan(ForeignScanState *node);
 static void
 hbaseEndForeignScan(ForeignScanState *node);
+static void
+hbaseExplainForeignScan(ForeignScanState *node, ExplainState *es);
+
+static void
+hbaseAddForeignUpdateTargets(Query *parsetree,
+							 RangeTblEntry *target_rte,
+							 Relation target_relation);
+static List *
+hbasePlanForeignModify(PlannerInfo *root,
+					   ModifyTable *plan,
+					   Index resultRelation,
+					   int subplan_index);
+static void
+hbaseBeginForeignModify(ModifyTableState *mtstate,
+						ResultRelInfo *rinfo,
+						List *fdw_private,
+						int subplan_index,
+						int eflags);
+static TupleTableSlot *
+hbaseExecForeignInsert(EState *estate, ResultRelInfo *rinfo,
+					   TupleTableSlot *slot, TupleTableSlot *planSlot);
+static TupleTableSlot *
+hbaseExecForeignUpdate(EState *estate, ResultRelInfo *rinfo,
+					   TupleTableSlot *slot, TupleTableSlot *planSlot);
+static TupleTableSlot *
+hbaseExecForeignDelete(EState *estate, ResultRelInfo *rinfo,
+					   TupleTableSlot *slot, TupleTableSlot *planSlot);
+static void
+hbaseEndForeignModify(EState *estate, ResultRelInfo *rinfo);
+static int
+hbaseIsForeignRelUpdatable(Relation rel);
+static bool
+hbasePlanDirectModify(PlannerInfo *root,
+					  ModifyTable *plan,
+					  Index resultRelation,
+					  int subplan_index);
+static void
+hbaseBeginDirectModify(ForeignScanState *node, int eflags);
+static TupleTableSlot *
+hbaseIterateDirectModify(ForeignScanState *node);
+static void
+hbaseEndDirectModify(ForeignScanState *node);
+static void
+hbaseExplainDirectModify(ForeignScanState *node, ExplainState *es);
 
 static HBaseColumn *
 find_hbase_columns(Relation rel);
@@ -77,17 +263,35 @@ is_row_key_var(Node *node, HBaseFdwTableInfo *table_info, Bitmapset* relids);
 static bool
 is_row_key_equals(Node *node, HBaseFdwTableInfo *table_info, Bitmapset *relids);
 
+static bool
+lookup_value_type(Oid typid, HBaseValueType *value_type);
+
 void
-setup_shared_memory(HBaseFdwPrivateScanState *pss);
+setup_shared_memory(HBaseFdwPrivateScanState *pss, StringInfo params);
+
+static Size
+choose_queue_size(ForeignScanState *node);
+
+static void
+release_queue_memory_callback(dsm_segment *seg, Datum arg);
+static void
+cancel_worker_callback(dsm_segment *seg, Datum arg);
+static int
+scan_timeout(HBaseFdwTableInfo *table_info);
+static void
+hand_to_worker(dsm_segment *seg);
 
-static HBasePreparedFilter*
-make_filter(Node *expr, HBaseFdwTableInfo *table_info, Bitmapset *relids);
+static void
+append_filter(List **filters, Node *expr, HBaseFdwTableInfo *table_info,
+			  Bitmapset *relids, List **params);
 
 static void
 prepare_query_params(ForeignScanState *node);
 
-static List*
-create_finalized_filters(ForeignScanState *node);
+static void
+serialize_params(ForeignScanState *node, StringInfo buf);
+static void
+serialize_update_values(ForeignScanState *node, StringInfo buf);
 
 /*
  * SQL functions
@@ -107,36 +311,60 @@ hbase_fdw_handler(PG_FUNCTION_ARGS)
 	routine->IterateForeignScan = hbaseIterateForeignScan;
 	routine->ReScanForeignScan = hbaseReScanForeignScan;
 	routine->EndForeignScan = hbaseEndForeignScan;
+	routine->ExplainForeignScan = hbaseExplainForeignScan;
+
+	routine->AddForeignUpdateTargets = hbaseAddForeignUpdateTargets;
+	routine->PlanForeignModify = hbasePlanForeignModify;
+	routine->BeginForeignModify = hbaseBeginForeignModify;
+	routine->ExecForeignInsert = hbaseExecForeignInsert;
+	routine->ExecForeignUpdate = hbaseExecForeignUpdate;
+	routine->ExecForeignDelete = hbaseExecForeignDelete;
+	routine->EndForeignModify = hbaseEndForeignModify;
+	routine->IsForeignRelUpdatable = hbaseIsForeignRelUpdatable;
+	routine->PlanDirectModify = hbasePlanDirectModify;
+	routine->BeginDirectModify = hbaseBeginDirectModify;
+	routine->IterateDirectModify = hbaseIterateDirectModify;
+	routine->EndDirectModify = hbaseEndDirectModify;
+	routine->ExplainDirectModify = hbaseExplainDirectModify;
 
 	PG_RETURN_POINTER(routine);
 }
 
-static bool
-is_row_key_var(Node *node, HBaseFdwTableInfo *table_info, Bitmapset* relids)
+/* The column a Var of the foreign table refers to, or NULL */
+static HBaseColumn *
+get_var_column(Node *node, HBaseFdwTableInfo *table_info, Bitmapset* relids)
 {
 	Var *var;
 
 	if (nodeTag(node) != T_Var)
-		return false;
+		return NULL;
 
 	var = (Var*)node;
 
 	// Check that we're not grabbing an outer variable
 	// from a subquery.
 	if (var->varlevelsup > 0)
-		return false;
+		return NULL;
 
 	// System columns are not part of what can be queried on.
 	if (var->varattno <= 0)
-		return false;
+		return NULL;
 
 	if (!bms_is_member(var->varno, relids))
-		return false;
+		return NULL;
 
 	if (var->varattno > table_info->num_columns)
-		return false;
+		return NULL;
+
+	return &table_info->columns[var->varattno - 1];
+}
+
+static bool
+is_row_key_var(Node *node, HBaseFdwTableInfo *table_info, Bitmapset* relids)
+{
+	HBaseColumn *col = get_var_column(node, table_info, relids);
 
-	return table_info->columns[var->varattno - 1].row_key;
+	return col != NULL && col->row_key;
 }
 
 static bool
@@ -181,24 +409,253 @@ is_row_key_equals(Node *node, HBaseFdwTableInfo *table_info, Bitmapset *relids)
 			nodeTag(expr) == T_Const);
 }
 
+/*
+ * Recognize row_key LIKE 'prefix%': a constant pattern whose only wildcards
+ * are the trailing %s, which matches exactly the keys starting with the
+ * pattern before them.  Sets *prefix to that, with escapes removed.
+ */
+static bool
+is_row_key_prefix(Node *node, HBaseFdwTableInfo *table_info, Bitmapset *relids,
+				  char **prefix)
+{
+	OpExpr *oe;
+	Const *pattern;
+	char *p;
+	StringInfoData buf;
+
+	if (nodeTag(node) != T_OpExpr)
+		return false;
+
+	oe = (OpExpr *) node;
+	if (oe->opno != OID_TEXT_LIKE_OP || list_length(oe->args) != 2)
+		return false;
+	if (!is_row_key_var(linitial(oe->args), table_info, relids))
+		return false;
+	if (nodeTag(lsecond(oe->args)) != T_Const)
+		return false;
+
+	pattern = lsecond(oe->args);
+	if (pattern->constisnull)
+		return false;
+
+	/* Backslash is LIKE's escape, and no server encoding uses it in a character */
+	initStringInfo(&buf);
+	for (p = TextDatumGetCString(pattern->constvalue); *p != '\0' && *p != '%'; p++)
+	{
+		if (*p == '_')
+			return false;
+		if (*p == '\\' && *++p == '\0')
+			return false;
+		appendStringInfoChar(&buf, *p);
+	}
+	if (*p != '%')
+		return false;
+	while (*p == '%')
+		p++;
+	if (*p != '\0')
+		return false;
+
+	if (prefix != NULL)
+		*prefix = buf.data;
+	return true;
+}
+
+/*
+ * Whether comparisons of a row key component can be turned into a range of
+ * row keys.  Equality only needs the value's encoding to be exact, ranges
+ * also need the encoded bytes to sort like the values: Phoenix encodings,
+ * bytea, and binary integers and timestamps, whose sign Java deals with.
+ */
+static bool
+row_key_part_supports(HBaseColumn *col, int strategy)
+{
+	if (col->value_type == value_type_text || col->value_type == value_type_bytea)
+		return strategy == BTEqualStrategyNumber || col->value_type == value_type_bytea;
+
+	if (col->encoding == encoding_string)
+		return false;
+	if (strategy == BTEqualStrategyNumber)
+		return true;
+
+	switch (col->value_type)
+	{
+		case value_type_int2:
+		case value_type_int4:
+		case value_type_int8:
+		case value_type_timestamptz:
+			return true;
+		case value_type_float4:
+		case value_type_float8:
+			return col->encoding == encoding_phoenix;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Recognize a comparison between a row key component and a parameter or
+ * constant.  Returns the btree strategy of the comparison, as seen from the
+ * component, or InvalidStrategy.
+ */
+static int
+row_key_part_strategy(Node *node, HBaseFdwTableInfo *table_info, Bitmapset *relids,
+					  HBaseColumn **col_out, Node **expr_out)
+{
+	OpExpr *oe;
+	Node *left;
+	Node *right;
+	Var *var;
+	Node *expr;
+	HBaseColumn *col;
+	HBaseValueType param_type;
+	Oid opclass;
+	int strategy;
+
+	if (nodeTag(node) != T_OpExpr)
+		return InvalidStrategy;
+
+	oe = (OpExpr *) node;
+	if (list_length(oe->args) != 2)
+		return InvalidStrategy;
+
+	left = linitial(oe->args);
+	right = lsecond(oe->args);
+
+	if ((col = get_var_column(left, table_info, relids)) != NULL && col->row_key_part)
+	{
+		var = (Var *) left;
+		expr = right;
+	}
+	else if ((col = get_var_column(right, table_info, relids)) != NULL && col->row_key_part)
+	{
+		var = (Var *) right;
+		expr = left;
+	}
+	else
+		return InvalidStrategy;
+
+	if (nodeTag(expr) != T_Param && nodeTag(expr) != T_Const)
+		return InvalidStrategy;
+
+	opclass = GetDefaultOpClass(var->vartype, BTREE_AM_OID);
+	if (!OidIsValid(opclass))
+		return InvalidStrategy;
+	strategy = get_op_opfamily_strategy(oe->opno, get_opclass_family(opclass));
+	if (strategy == InvalidStrategy)
+		return InvalidStrategy;
+
+	/* x < col is col > x */
+	if ((Node *) var == right)
+		strategy = BTMaxStrategyNumber + 1 - strategy;
+
+	if (!row_key_part_supports(col, strategy))
+		return InvalidStrategy;
+
+	/*
+	 * Java compares the raw values, which is right within the integer and
+	 * float families but not between timestamp and timestamptz.
+	 */
+	if (!lookup_value_type(exprType(expr), &param_type))
+		return InvalidStrategy;
+	if (col->value_type == value_type_timestamptz && exprType(expr) != var->vartype)
+		return InvalidStrategy;
+
+	if (col_out != NULL)
+		*col_out = col;
+	if (expr_out != NULL)
+		*expr_out = expr;
+	return strategy;
+}
+
+static bool
+contains_param_walker(Node *node, void *context)
+{
+	if (node == NULL)
+		return false;
+	if (IsA(node, Param))
+		return true;
+	return expression_tree_walker(node, contains_param_walker, context);
+}
+
+/*
+ * Whether some value in the expression is only known when the scan starts,
+ * and so may turn out to be NULL.
+ */
+static bool
+has_runtime_values(Node *node)
+{
+	return contains_param_walker(node, NULL) || contain_mutable_functions(node);
+}
+
+/*
+ * Row key equality is decided exactly from the key ranges the filters
+ * compile to, comparisons of key components only bound them.  Boolean
+ * expressions are exact when all their arguments are.  An OR needs every
+ * argument pushed down, an AND pushes down what it can, and a NOT can
+ * only invert an exact argument.
+ *
+ * A filter compared with NULL matches no rows, which is exact by itself but
+ * makes a NOT above it match every row, where SQL's NOT of NULL matches
+ * none.  Those rows are a superset, so a NOT over values that may be NULL
+ * is only lossy.
+ */
+static HBasePushdown
+get_pushdown(Node *node, HBaseFdwTableInfo *table_info, Bitmapset *relids)
+{
+	BoolExpr *b;
+	ListCell *lc;
+	HBasePushdown result = pushdown_exact;
+	bool any = false;
+
+	if (is_row_key_equals(node, table_info, relids) ||
+		is_row_key_prefix(node, table_info, relids, NULL))
+		return pushdown_exact;
+	if (row_key_part_strategy(node, table_info, relids, NULL, NULL) != InvalidStrategy)
+		return pushdown_lossy;
+	if (nodeTag(node) != T_BoolExpr)
+		return pushdown_none;
+
+	b = (BoolExpr *) node;
+	switch (b->boolop)
+	{
+		case NOT_EXPR:
+			if (get_pushdown(linitial(b->args), table_info, relids) != pushdown_exact)
+				return pushdown_none;
+			return has_runtime_values(linitial(b->args)) ? pushdown_lossy : pushdown_exact;
+		case AND_EXPR:
+		case OR_EXPR:
+			foreach (lc, b->args)
+			{
+				HBasePushdown arg = get_pushdown(lfirst(lc), table_info, relids);
+
+				if (arg == pushdown_none && b->boolop == OR_EXPR)
+					return pushdown_none;
+				if (arg != pushdown_none)
+					any = true;
+				if (arg != pushdown_exact)
+					result = pushdown_lossy;
+			}
+			return any ? result : pushdown_none;
+	}
+	return pushdown_none;
+}
+
 static bool
 is_hbase_expr(Node *node, RelOptInfo *foreign_rel)
 {
 	HBaseFdwTableInfo *table_info = foreign_rel->fdw_private;
 	Bitmapset *relids = foreign_rel->relids;
 
-	if (is_row_key_equals(node, table_info, relids))
-		return true;
-	return false;
+	return get_pushdown(node, table_info, relids) == pushdown_exact;
 }
 
-static char *get_table_name(ForeignTable *table)
+static char *get_table_option(ForeignTable *table, const char *name)
 {
 	ListCell *lc;
 	foreach (lc, table->options)
 	{
 		DefElem *elem = lfirst(lc);
-		if (strcmp(elem->defname, "hbase_table") == 0)
+		if (strcmp(elem->defname, name) == 0)
 		{
 			return defGetString(elem);
 		}
@@ -206,6 +663,67 @@ static char *get_table_name(ForeignTable *table)
 	return NULL;
 }
 
+static bool
+lookup_value_type(Oid typid, HBaseValueType *value_type)
+{
+	switch (typid)
+	{
+		case TEXTOID:
+		case VARCHAROID:
+			*value_type = value_type_text;
+			return true;
+		case BYTEAOID:
+			*value_type = value_type_bytea;
+			return true;
+		case INT2OID:
+			*value_type = value_type_int2;
+			return true;
+		case INT4OID:
+			*value_type = value_type_int4;
+			return true;
+		case INT8OID:
+			*value_type = value_type_int8;
+			return true;
+		case FLOAT4OID:
+			*value_type = value_type_float4;
+			return true;
+		case FLOAT8OID:
+			*value_type = value_type_float8;
+			return true;
+		case BOOLOID:
+			*value_type = value_type_bool;
+			return true;
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			*value_type = value_type_timestamptz;
+			return true;
+		default:
+			return false;
+	}
+}
+
+static HBaseValueType
+get_value_type(Form_pg_attribute attr, HBaseColumn *col)
+{
+	HBaseValueType value_type;
+
+	if (col->family)
+	{
+		if (attr->atttypid != JSONBOID)
+			elog(ERROR, "Column %s maps a family and must be of type jsonb",
+				 NameStr(attr->attname));
+		return value_type_jsonb;
+	}
+
+	if (lookup_value_type(attr->atttypid, &value_type))
+		return value_type;
+
+	if (col->row_key || col->column)
+		elog(ERROR, "Column %s has type %s, which hbase_fdw can not decode",
+			 NameStr(attr->attname), format_type_be(attr->atttypid));
+	return value_type_text;
+}
+
 static HBaseColumn *
 find_hbase_columns(Relation rel)
 {
@@ -215,8 +733,12 @@ find_hbase_columns(Relation rel)
 	for (AttrNumber attnum = 0; attnum < num_cols; attnum++)
 	{
 		HBaseColumn *col = cols + attnum;
+		Form_pg_attribute attr = rel->rd_att->attrs[attnum];
 		List *col_opts = GetForeignColumnOptions(rel->rd_id, attnum + 1);
 		ListCell *lc;
+
+		col->attlen = attr->attlen;
+		col->attalign = attr->attalign;
 		foreach (lc, col_opts)
 		{
 			DefElem *elem = lfirst(lc);
@@ -250,6 +772,18 @@ find_hbase_columns(Relation rel)
 				strncpy(col->qualifier, qualifier, HBASE_FDW_MAX_QUALIFIER_LEN);
 				col->qualifier[HBASE_FDW_MAX_QUALIFIER_LEN] = '\0';
 			}
+			else if (strcmp(elem->defname, "encoding") == 0)
+			{
+				char *encoding = defGetString(elem);
+				if (strcmp(encoding, "binary") == 0)
+					col->encoding = encoding_binary;
+				else if (strcmp(encoding, "string") == 0)
+					col->encoding = encoding_string;
+				else if (strcmp(encoding, "phoenix") == 0)
+					col->encoding = encoding_phoenix;
+				else
+					elog(ERROR, "Unknown encoding: %s", encoding);
+			}
 			else
 				elog(ERROR, "Unknown column option: %s", elem->defname);
 		}
@@ -261,498 +795,2076 @@ find_hbase_columns(Relation rel)
 		if (col->family &&
 			(col->column || col->qualifier[0] != '\0'))
 			elog(ERROR, "Type family can not have column or other hbase_type");
+
+		col->value_type = get_value_type(attr, col);
 	}
 	return cols;
 }
 
-static HBaseFdwTableInfo *
-get_table_info(Oid foreigntableid)
+/* Size a fixed width type takes in the row key, or -1 if it varies */
+static int
+row_key_part_width(HBaseColumn *col)
 {
-	ForeignTable *foreign_table = GetForeignTable(foreigntableid);
-	HBaseFdwTableInfo *table_info = palloc0(sizeof(HBaseFdwTableInfo));
-	char *table_name;
-	Relation rel = RelationIdGetRelation(foreigntableid);
-	HBaseColumn *cols;
-	int num_cols = RelationGetNumberOfAttributes(rel);
-
-	table_name = get_table_name(foreign_table);
-	if (table_name == NULL)
-		table_name = RelationGetRelationName(rel);
-
-	cols = find_hbase_columns(rel);
-
-	table_info->table_name = table_name;
-	table_info->num_columns = num_cols;
-	table_info->columns = cols;
-	table_info->remote_conds = NIL;
-	table_info->local_conds = NIL;
-	RelationClose(rel);
+	if (col->encoding == encoding_string)
+		return -1;
 
-	return table_info;
+	switch (col->value_type)
+	{
+		case value_type_int2:
+			return 2;
+		case value_type_int4:
+		case value_type_float4:
+			return 4;
+		case value_type_int8:
+		case value_type_float8:
+			return 8;
+		case value_type_bool:
+			return 1;
+		case value_type_timestamptz:
+			/* Phoenix TIMESTAMP adds 4 bytes of nanoseconds, checked below */
+			return 8;
+		default:
+			return -1;
+	}
 }
 
-#define DSM_SIZE 1048576
-
+/*
+ * Apply the row_key_layout table option, a comma separated list of
+ * column:width pairs naming the components of a composite row key in
+ * order.  The last component may have a width of * to take the rest of the
+ * key.
+ */
 static void
-hbaseGetForeignRelSize(PlannerInfo *root,
-					   RelOptInfo *baserel,
-					   Oid foreigntableid)
+apply_row_key_layout(Relation rel, HBaseColumn *cols, char *layout)
 {
-	List *remote_conds = NIL;
-	List *local_conds = NIL;
+	TupleDesc desc = RelationGetDescr(rel);
+	char *copy = pstrdup(layout);
+	List *parts;
 	ListCell *lc;
-	ForeignTable *foreign_table;
-	HBaseFdwTableInfo *table_info = get_table_info(foreigntableid);
+	int offset = 0;
 
-	baserel->fdw_private = table_info;
-	foreign_table = GetForeignTable(foreigntableid);
+	if (!SplitIdentifierString(copy, ',', &parts) || parts == NIL)
+		elog(ERROR, "Invalid row_key_layout: %s", layout);
 
-	foreach (lc, baserel->baserestrictinfo)
+	foreach (lc, parts)
 	{
-		RestrictInfo *ri = (RestrictInfo *) lfirst(lc);
-		if (is_hbase_expr((Node*)ri->clause, baserel))
+		char *part = lfirst(lc);
+		char *sep = strrchr(part, ':');
+		char *end;
+		long width;
+		HBaseColumn *col = NULL;
+		int expected;
+
+		if (sep == NULL)
+			elog(ERROR, "Invalid row_key_layout component \"%s\", expected column:width", part);
+		*sep = '\0';
+
+		if (strcmp(sep + 1, "*") == 0)
 		{
-			elog(LOG, "Was hbase expr");
-			table_info->remote_conds = lappend(table_info->remote_conds, ri);
+			if (lnext(lc) != NULL)
+				elog(ERROR, "Only the last row key component can take the rest of the key");
+			width = -1;
 		}
 		else
 		{
-			elog(LOG, "Was not hbase expr");
-			table_info->local_conds = lappend(table_info->local_conds, ri);
+			width = strtol(sep + 1, &end, 10);
+			if (*end != '\0' || width <= 0 || offset + width > PG_INT16_MAX)
+				elog(ERROR, "Invalid width for row key component %s: %s", part, sep + 1);
+		}
+
+		for (int i = 0; i < desc->natts; i++)
+		{
+			if (!desc->attrs[i]->attisdropped &&
+				strcmp(NameStr(desc->attrs[i]->attname), part) == 0)
+			{
+				col = &cols[i];
+				break;
+			}
 		}
+		if (col == NULL)
+			elog(ERROR, "row_key_layout names unknown column %s", part);
+		if (col->row_key || col->family || col->column || col->row_key_part)
+			elog(ERROR, "Column %s can not be a row key component and have another hbase_type", part);
+		if (!lookup_value_type(desc->attrs[col - cols]->atttypid, &col->value_type))
+			elog(ERROR, "Column %s has a type hbase_fdw can not decode", part);
+
+		expected = row_key_part_width(col);
+		if (expected > 0 && width != expected &&
+			!(col->value_type == value_type_timestamptz &&
+			  col->encoding == encoding_phoenix && width == 12))
+			elog(ERROR, "Row key component %s must be %d bytes wide", part, expected);
+
+		col->row_key_part = true;
+		col->key_offset = offset;
+		col->key_width = width;
+		offset += Max(width, 0);
 	}
 
-	baserel->rows = 5.0;
+	list_free(parts);
+	pfree(copy);
 }
 
+/*
+ * Relcache invalidation, which also covers column options since changing
+ * them updates pg_attribute. InvalidOid means everything.
+ */
 static void
-hbaseGetForeignPaths(PlannerInfo *root,
-					 RelOptInfo *baserel,
-					 Oid foreigntableid)
+table_cache_relcache_callback(Datum arg, Oid relid)
 {
-	ForeignPath *path;
+	HASH_SEQ_STATUS status;
+	HBaseFdwTableCacheEntry *entry;
 
-	path = create_foreignscan_path(
-		root,
-		baserel,
-		NULL,
-		baserel->rows,
-		1.0,
-		100.0,
-		NIL,
-		NULL,
-		NULL,
-		NIL);
-	add_path(baserel, (Path*) path);
+	table_cache_inval_count++;
+	if (OidIsValid(relid))
+	{
+		entry = hash_search(table_cache, &relid, HASH_FIND, NULL);
+		if (entry != NULL)
+			entry->valid = false;
+		return;
+	}
 
+	hash_seq_init(&status, table_cache);
+	while ((entry = hash_seq_search(&status)) != NULL)
+		entry->valid = false;
 }
 
-static HBasePreparedFilter*
-create_row_key_equals_filter(Node *node, HBaseFdwTableInfo *table_info, Bitmapset *relids)
+/*
+ * Table options live in pg_foreign_table, whose changes don't necessarily
+ * reach the relcache. A zero hash value means the whole cache was reset.
+ */
+static void
+table_cache_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
 {
-	OpExpr *op = (OpExpr*)node;
-	HBasePreparedFilter *filter = palloc0(sizeof(HBasePreparedFilter));
-	Node *left = linitial(op->args);
-	Node *right = lsecond(op->args);
-	Node *expr = is_row_key_var(left, table_info, relids) ? right : left;
+	HASH_SEQ_STATUS status;
+	HBaseFdwTableCacheEntry *entry;
 
-	filter->filter.filter_type = filter_type_row_key_equals;
-	filter->params = list_make1(expr);
-	filter->param_nums = NULL;
-	return filter;
+	table_cache_inval_count++;
+	hash_seq_init(&status, table_cache);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		if (hashvalue == 0 || entry->foreign_table_hash == hashvalue)
+			entry->valid = false;
+	}
 }
 
-static HBasePreparedFilter*
-make_filter(Node *expr,
-			HBaseFdwTableInfo *table_info,
-			Bitmapset *relids)
+/*
+ * Note HBase tables that are dropped or altered, so that the bgworker drops
+ * the JVM's template of them once the change commits.  Telling it any
+ * earlier, a scan could still build a new template from the old catalog.
+ */
+static void
+table_access_hook(ObjectAccessType access, Oid classId, Oid objectId,
+				  int subId, void *arg)
 {
-	if (is_row_key_equals(expr, table_info, relids))
-		return create_row_key_equals_filter(expr, table_info, relids);
-	elog(ERROR, "Failed to handle expression");
-}
+	MemoryContext oldcontext;
 
+	if (prev_object_access_hook)
+		prev_object_access_hook(access, classId, objectId, subId, arg);
 
-static ForeignScan *hbaseGetForeignPlan(PlannerInfo *root,
-										RelOptInfo *baserel,
-										Oid foreigntableid,
-										ForeignPath *best_path,
-										List *tlist,
-										List *scan_clauses,
-										Plan *outer_plan)
+	if ((access != OAT_DROP && access != OAT_POST_ALTER) ||
+		(classId != RelationRelationId && classId != ForeignTableRelationId) ||
+		get_rel_relkind(objectId) != RELKIND_FOREIGN_TABLE)
+		return;
+	if (GetFdwRoutineByRelId(objectId)->GetForeignRelSize != hbaseGetForeignRelSize)
+		return;
+
+	oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+	changed_tables = list_append_unique_oid(changed_tables, objectId);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Tables changed in a subtransaction that rolled back are still passed on,
+ * which only costs their templates being rebuilt.
+ */
+static void
+table_xact_callback(XactEvent event, void *arg)
+{
+	ListCell *lc;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+			foreach(lc, changed_tables)
+				forget_table(MyDatabaseId, lfirst_oid(lc));
+			changed_tables = NIL;
+			break;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+			changed_tables = NIL;
+			break;
+		default:
+			break;
+	}
+}
+
+void
+init_table_hooks(void)
+{
+	prev_object_access_hook = object_access_hook;
+	object_access_hook = table_access_hook;
+	RegisterXactCallback(table_xact_callback, NULL);
+}
+
+/*
+ * Hash of everything the JVM's template is built from.  The columns are
+ * hashed field by field, as their padding bytes aren't initialized.
+ */
+static uint32
+hash_table_options(char *table_name, HBaseColumn *cols, int num_cols)
+{
+	StringInfoData buf;
+	uint32 hash;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "%s", table_name);
+	for (int i = 0; i < num_cols; i++)
+	{
+		HBaseColumn *col = &cols[i];
+
+		appendStringInfo(&buf, "|%d %d%d%d%d %d %d %d %c %d %d %s %s",
+						 col->attnum, col->row_key, col->family, col->column,
+						 col->row_key_part, col->key_offset, col->key_width,
+						 col->attlen, col->attalign, (int) col->value_type,
+						 (int) col->encoding, col->family_name, col->qualifier);
+	}
+	hash = DatumGetUInt32(hash_any((unsigned char *) buf.data, buf.len));
+	pfree(buf.data);
+	return hash;
+}
+
+static void
+init_table_cache(void)
+{
+	HASHCTL ctl;
+
+	if (!CacheMemoryContext)
+		CreateCacheMemoryContext();
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(HBaseFdwTableCacheEntry);
+	ctl.hcxt = CacheMemoryContext;
+	table_cache = hash_create("hbase_fdw table cache", 64, &ctl,
+							  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	CacheRegisterRelcacheCallback(table_cache_relcache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(FOREIGNTABLEREL, table_cache_syscache_callback, (Datum) 0);
+}
+
+/*
+ * Parse the table's options into the cache entry. Errors leave the entry
+ * invalid, so a broken definition is reported again on the next use.
+ */
+static void
+fill_table_cache_entry(HBaseFdwTableCacheEntry *entry)
+{
+	Oid foreigntableid = entry->relid;
+	ForeignTable *foreign_table = GetForeignTable(foreigntableid);
+	char *table_name;
+	Relation rel = RelationIdGetRelation(foreigntableid);
+	HBaseColumn *cols;
+	HBaseColumn *cached_cols;
+	int num_cols = RelationGetNumberOfAttributes(rel);
+	uint64 inval_count = table_cache_inval_count;
+
+	char *layout;
+	char *timeout;
+	int timeout_ms = 0;
+	char *batch_size;
+	int batch_rows = HBASE_FDW_DEFAULT_BATCH_SIZE;
+	char *bulk_load;
+	bool bulk = false;
+
+	table_name = get_table_option(foreign_table, "hbase_table");
+	if (table_name == NULL)
+		table_name = RelationGetRelationName(rel);
+
+	cols = find_hbase_columns(rel);
+	layout = get_table_option(foreign_table, "row_key_layout");
+	if (layout != NULL)
+		apply_row_key_layout(rel, cols, layout);
+
+	timeout = get_table_option(foreign_table, "timeout");
+	if (timeout != NULL && (!parse_int(timeout, &timeout_ms, GUC_UNIT_MS, NULL) || timeout_ms < 0))
+		elog(ERROR, "Invalid timeout: %s", timeout);
+
+	batch_size = get_table_option(foreign_table, "batch_size");
+	if (batch_size != NULL && (!parse_int(batch_size, &batch_rows, 0, NULL) || batch_rows < 1))
+		elog(ERROR, "Invalid batch_size: %s", batch_size);
+
+	bulk_load = get_table_option(foreign_table, "bulk_load");
+	if (bulk_load != NULL && !parse_bool(bulk_load, &bulk))
+		elog(ERROR, "Invalid bulk_load: %s", bulk_load);
+
+	cached_cols = MemoryContextAlloc(CacheMemoryContext, sizeof(HBaseColumn) * num_cols);
+	memcpy(cached_cols, cols, sizeof(HBaseColumn) * num_cols);
+
+	/* Nothing below can fail, so the entry is never left half built. */
+	if (entry->columns != NULL)
+		pfree(entry->columns);
+	entry->columns = cached_cols;
+	entry->num_columns = num_cols;
+	entry->timeout_ms = timeout_ms;
+	entry->batch_size = batch_rows;
+	entry->bulk_load = bulk;
+	strncpy(entry->table_name, table_name, HBASE_FDW_MAX_TABLE_NAME_LEN);
+	entry->table_name[HBASE_FDW_MAX_TABLE_NAME_LEN] = '\0';
+	entry->foreign_table_hash =
+		GetSysCacheHashValue1(FOREIGNTABLEREL, ObjectIdGetDatum(foreigntableid));
+	entry->options_version = hash_table_options(entry->table_name, cols, num_cols);
+
+	/* Use what we read, but look again next time if it may be stale */
+	entry->valid = (inval_count == table_cache_inval_count);
+
+	pfree(cols);
+	RelationClose(rel);
+}
+
+static HBaseFdwTableInfo *
+get_table_info(Oid foreigntableid)
+{
+	HBaseFdwTableInfo *table_info = palloc0(sizeof(HBaseFdwTableInfo));
+	HBaseFdwTableCacheEntry *entry;
+	bool found;
+
+	if (table_cache == NULL)
+		init_table_cache();
+
+	entry = hash_search(table_cache, &foreigntableid, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->valid = false;
+		entry->columns = NULL;
+	}
+	if (!entry->valid)
+		fill_table_cache_entry(entry);
+
+	/*
+	 * Hand out copies: an invalidation arriving mid-query may rebuild the
+	 * entry while the caller still holds on to the old columns.
+	 */
+	table_info->relid = foreigntableid;
+	table_info->table_name = pstrdup(entry->table_name);
+	table_info->num_columns = entry->num_columns;
+	table_info->columns = palloc(sizeof(HBaseColumn) * entry->num_columns);
+	memcpy(table_info->columns, entry->columns, sizeof(HBaseColumn) * entry->num_columns);
+	table_info->options_version = entry->options_version;
+	table_info->timeout_ms = entry->timeout_ms;
+	table_info->batch_size = entry->batch_size;
+	table_info->bulk_load = entry->bulk_load;
+	table_info->remote_conds = NIL;
+	table_info->local_conds = NIL;
+	table_info->key_conds = NIL;
+
+	return table_info;
+}
+
+/*
+ * Row count assumed for scans that are not restricted to a single row key.
+ * We have no statistics for HBase tables, so this only needs to be large
+ * enough to keep the planner from treating full scans as nearly free.
+ */
+#define HBASE_FDW_DEFAULT_ROWS 1000.0
+
+/* Queue space a single tuple message costs on top of its column data */
+#define HBASE_FDW_TUPLE_OVERHEAD (MAXALIGN(sizeof(HBaseFdwMessage)) + sizeof(Size))
+
+static void
+hbaseGetForeignRelSize(PlannerInfo *root,
+					   RelOptInfo *baserel,
+					   Oid foreigntableid)
+{
+	List *remote_conds = NIL;
+	List *local_conds = NIL;
+	ListCell *lc;
+	ForeignTable *foreign_table;
+	HBaseFdwTableInfo *table_info = get_table_info(foreigntableid);
+
+	baserel->fdw_private = table_info;
+	foreign_table = GetForeignTable(foreigntableid);
+
+	foreach (lc, baserel->baserestrictinfo)
+	{
+		RestrictInfo *ri = (RestrictInfo *) lfirst(lc);
+		if (is_hbase_expr((Node*)ri->clause, baserel))
+			table_info->remote_conds = lappend(table_info->remote_conds, ri);
+		else
+		{
+			table_info->local_conds = lappend(table_info->local_conds, ri);
+
+			/*
+			 * Row key components are only compared as bytes, so the condition
+			 * is still checked on every row returned.
+			 */
+			if (get_pushdown((Node *) ri->clause, table_info, baserel->relids) == pushdown_lossy)
+				table_info->key_conds = lappend(table_info->key_conds, ri);
+		}
+	}
+
+	baserel->rows = HBASE_FDW_DEFAULT_ROWS;
+	foreach (lc, table_info->remote_conds)
+	{
+		RestrictInfo *ri = (RestrictInfo *) lfirst(lc);
+
+		/* Row key equality can only ever match a single row. */
+		if (is_row_key_equals((Node *) ri->clause, table_info, baserel->relids))
+			baserel->rows = 1.0;
+	}
+	if (baserel->rows > 1.0)
+		baserel->rows *= clauselist_selectivity(
+			root,
+			extract_actual_clauses(list_concat(list_copy(table_info->remote_conds),
+											   table_info->key_conds), false),
+			baserel->relid, JOIN_INNER, NULL);
+}
+
+static void
+hbaseGetForeignPaths(PlannerInfo *root,
+					 RelOptInfo *baserel,
+					 Oid foreigntableid)
+{
+	ForeignPath *path;
+
+	path = create_foreignscan_path(
+		root,
+		baserel,
+		NULL,
+		baserel->rows,
+		1.0,
+		100.0,
+		NIL,
+		NULL,
+		NULL,
+		NIL);
+	add_path(baserel, (Path*) path);
+
+}
+
+/*
+ * Position of expr among the scan's parameters, adding it if it isn't there
+ * yet so that repeated expressions are only evaluated once.
+ */
+static int
+add_param(List **params, Node *expr)
+{
+	ListCell *lc;
+	int index = 0;
+
+	foreach (lc, *params)
+	{
+		if (equal(lfirst(lc), expr))
+			return index;
+		index++;
+	}
+
+	*params = lappend(*params, expr);
+	return index;
+}
+
+/*
+ * Filters are kept in fdw_private as lists of Integers, the filter type
+ * followed by its parameter indexes, so the plan can be copied.
+ */
+static List *
+create_row_key_equals_filter(Node *node, HBaseFdwTableInfo *table_info, Bitmapset *relids,
+							 List **params)
+{
+	OpExpr *op = (OpExpr*)node;
+	Node *left = linitial(op->args);
+	Node *right = lsecond(op->args);
+	Node *expr = is_row_key_var(left, table_info, relids) ? right : left;
+
+	return list_make2(makeInteger(filter_type_row_key_equals),
+					  makeInteger(add_param(params, expr)));
+}
+
+static List *
+create_row_key_prefix_filter(Node *node, HBaseFdwTableInfo *table_info, Bitmapset *relids,
+							 List **params)
+{
+	Const *pattern = lsecond(((OpExpr *) node)->args);
+	Const *prefix_const;
+	char *prefix;
+
+	is_row_key_prefix(node, table_info, relids, &prefix);
+	prefix_const = makeConst(TEXTOID, -1, pattern->constcollid, -1,
+							 CStringGetTextDatum(prefix), false, false);
+	return list_make2(makeInteger(filter_type_row_key_prefix),
+					  makeInteger(add_param(params, (Node *) prefix_const)));
+}
+
+static List *
+create_row_key_part_filter(Node *node, HBaseFdwTableInfo *table_info, Bitmapset *relids,
+						   List **params)
+{
+	HBaseColumn *col;
+	Node *expr;
+	HBaseValueType param_type;
+	int strategy = row_key_part_strategy(node, table_info, relids, &col, &expr);
+
+	lookup_value_type(exprType(expr), &param_type);
+	return lappend(list_make4(makeInteger(filter_type_row_key_part),
+							  makeInteger(col - table_info->columns),
+							  makeInteger(strategy),
+							  makeInteger(add_param(params, expr))),
+				   makeInteger(param_type));
+}
+
+/*
+ * Append the preorder walk of expr's filter tree, leaving out arguments of
+ * an AND that can't be pushed down.
+ */
+static void
+append_filter(List **filters,
+			  Node *expr,
+			  HBaseFdwTableInfo *table_info,
+			  Bitmapset *relids,
+			  List **params)
+{
+	BoolExpr *b;
+	List *args = NIL;
+	ListCell *lc;
+	int type;
+
+	if (is_row_key_equals(expr, table_info, relids))
+	{
+		*filters = lappend(*filters, create_row_key_equals_filter(expr, table_info, relids, params));
+		return;
+	}
+	if (is_row_key_prefix(expr, table_info, relids, NULL))
+	{
+		*filters = lappend(*filters, create_row_key_prefix_filter(expr, table_info, relids, params));
+		return;
+	}
+	if (row_key_part_strategy(expr, table_info, relids, NULL, NULL) != InvalidStrategy)
+	{
+		*filters = lappend(*filters, create_row_key_part_filter(expr, table_info, relids, params));
+		return;
+	}
+	if (nodeTag(expr) != T_BoolExpr)
+		elog(ERROR, "Failed to handle expression");
+
+	b = (BoolExpr *) expr;
+	foreach (lc, b->args)
+	{
+		if (get_pushdown(lfirst(lc), table_info, relids) != pushdown_none)
+			args = lappend(args, lfirst(lc));
+	}
+
+	switch (b->boolop)
+	{
+		case AND_EXPR:
+			type = filter_type_and;
+			break;
+		case OR_EXPR:
+			type = filter_type_or;
+			break;
+		default:
+			type = filter_type_not;
+			break;
+	}
+
+	*filters = lappend(*filters, list_make2(makeInteger(type), makeInteger(list_length(args))));
+	foreach (lc, args)
+		append_filter(filters, lfirst(lc), table_info, relids, params);
+}
+
+
+static ForeignScan *hbaseGetForeignPlan(PlannerInfo *root,
+										RelOptInfo *baserel,
+										Oid foreigntableid,
+										ForeignPath *best_path,
+										List *tlist,
+										List *scan_clauses,
+										Plan *outer_plan)
+{
+	List *local_exprs = NIL;
+	List *remote_exprs = NIL;
+	List *key_exprs = NIL;
+	HBaseFdwTableInfo *table_info = baserel->fdw_private;
+	List *hbase_filters = NIL;
+	List *params = NIL;
+	List *param_types = NIL;
+	ListCell *lc;
+	foreach(lc, scan_clauses)
+	{
+		RestrictInfo *rinfo = (RestrictInfo*) lfirst(lc);
+
+		if (rinfo->pseudoconstant)
+			continue;
+
+		if (list_member_ptr(table_info->remote_conds, rinfo))
+			remote_exprs = lappend(remote_exprs, rinfo->clause);
+		else if (list_member_ptr(table_info->local_conds, rinfo))
+			local_exprs = lappend(local_exprs, rinfo->clause);
+
+		if (list_member_ptr(table_info->key_conds, rinfo))
+			key_exprs = lappend(key_exprs, rinfo->clause);
+	}
+
+	foreach (lc, list_concat(list_copy(remote_exprs), key_exprs))
+	{
+		append_filter(&hbase_filters, lfirst(lc), table_info, baserel->relids, &params);
+	}
+
+	/*
+	 * Settle how each parameter is sent to the worker now, so executing the
+	 * plan is just a copy of the evaluated datums.
+	 */
+	foreach (lc, params)
+	{
+		Oid typid = exprType(lfirst(lc));
+		HBaseValueType value_type;
+
+		if (!lookup_value_type(typid, &value_type))
+			elog(ERROR, "Can not send values of type %s to HBase",
+				 format_type_be(typid));
+		param_types = lappend(param_types, makeInteger(value_type));
+	}
+
+	return make_foreignscan(
+		tlist,
+		local_exprs,
+		baserel->relid,
+		params,
+		list_make2(hbase_filters, param_types),
+		NIL,
+		remote_exprs,
+		outer_plan);
+}
+
+void
+setup_shared_memory(HBaseFdwPrivateScanState *pss, StringInfo params)
+{
+	shm_toc *toc;
+	shm_mq *mq;
+	dsm_segment *seg;
+	shm_toc_estimator e;
+	Size dsm_size;
+	HBaseCommand *command;
+	HBaseColumn *columns;
+	HBaseFilter *out_filters;
+	char *out_params;
+	Size mq_size;
+	HBaseFdwTableInfo *table_info = pss->table_info;
+	int nr_filters = pss->nr_filters;
+
+	/*
+	 * pss->mq_size is the queue the scan would like, and it gets what the
+	 * shared budget allows.  Until the segment exists to give the memory
+	 * back on detach, an error has to do that itself.
+	 */
+	mq_size = reserve_queue_memory(pss->mq_size);
+	pss->mq_size = mq_size;
+	PG_TRY();
+	{
+		shm_toc_initialize_estimator(&e);
+		shm_toc_estimate_keys(&e, 1);
+		shm_toc_estimate_chunk(&e, sizeof(HBaseCommand));
+		shm_toc_estimate_keys(&e, 1);
+		shm_toc_estimate_chunk(&e, sizeof(HBaseColumn) * table_info->num_columns);
+		shm_toc_estimate_keys(&e, 1);
+		shm_toc_estimate_chunk(&e, sizeof(HBaseFilter) * nr_filters);
+		shm_toc_estimate_keys(&e, 1);
+		shm_toc_estimate_chunk(&e, mq_size);
+		shm_toc_estimate_keys(&e, 1);
+		shm_toc_estimate_chunk(&e, params->len);
+		dsm_size = shm_toc_estimate(&e);
+
+		seg = dsm_create(dsm_size, 0);
+	}
+	PG_CATCH();
+	{
+		release_queue_memory(mq_size);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	/* Hand the queue memory back to the shared budget however we detach. */
+	on_dsm_detach(seg, release_queue_memory_callback, UInt32GetDatum(mq_size));
+
+	toc = shm_toc_create(
+		HBASE_FDW_SHM_TOC_MAGIC,
+		dsm_segment_address(seg),
+		dsm_size);
+
+	command = shm_toc_allocate(toc, sizeof(HBaseCommand));
+	strncpy(command->table_name, table_info->table_name, HBASE_FDW_MAX_TABLE_NAME_LEN);
+	command->table_name[HBASE_FDW_MAX_TABLE_NAME_LEN] = '\0';
+	command->operation = pss->operation;
+	command->mutation_type = pss->mutation_type;
+	command->bulk_load = false;
+	command->dboid = MyDatabaseId;
+	command->relid = table_info->relid;
+	command->options_version = table_info->options_version;
+	command->nr_columns = table_info->num_columns;
+	command->nr_filters = nr_filters;
+	command->nr_params = list_length(pss->param_exprs);
+	command->timeout_ms = scan_timeout(table_info);
+	/* The JVM lays out tuple headers assuming 8 byte maximum alignment */
+	command->heap_tuples = hbase_fdw_worker_heap_tuples && MAXIMUM_ALIGNOF == 8;
+	command->collect_metrics = pss->collect_metrics;
+	shm_toc_insert(toc, 1, command);
+
+	columns = shm_toc_allocate(toc, sizeof(HBaseColumn) * table_info->num_columns);
+	memcpy(columns, table_info->columns, sizeof(*columns) * table_info->num_columns);
+	shm_toc_insert(toc, 2, columns);
+
+	out_filters = shm_toc_allocate(toc, sizeof(HBaseFilter) * nr_filters);
+	memcpy(out_filters, pss->filters, sizeof(HBaseFilter) * nr_filters);
+	shm_toc_insert(toc, 3, out_filters);
+
+	mq = shm_toc_allocate(toc, mq_size);
+	mq = shm_mq_create(mq, mq_size);
+	shm_mq_set_receiver(mq, MyProc);
+	shm_toc_insert(toc, 4, mq);
+
+	out_params = shm_toc_allocate(toc, params->len);
+	memcpy(out_params, params->data, params->len);
+	shm_toc_insert(toc, 5, out_params);
+
+	pss->seg = seg;
+	pss->mq_handle = shm_mq_attach(mq, pss->seg, NULL);
+}
+
+/*
+ * How long the worker may wait on HBase for each batch of rows, or each
+ * flush: the table's timeout option, capped by statement_timeout, as there is
+ * no point in HBase retrying for longer than any one statement may run.  The
+ * scan itself may outlive the statement, as a cursor's does, and waits for
+ * the backend don't count.  The backend's own statement_timeout cancels the
+ * scan as a whole.  0 means no limit.
+ */
+static int
+scan_timeout(HBaseFdwTableInfo *table_info)
+{
+	int timeout = table_info->timeout_ms;
+
+	if (StatementTimeout > 0 && (timeout == 0 || StatementTimeout < timeout))
+		timeout = StatementTimeout;
+	return timeout;
+}
+
+static void
+cancel_worker_callback(dsm_segment *seg, Datum arg)
+{
+	cancel_worker(DatumGetInt32(arg), dsm_segment_handle(seg));
+}
+
+static void
+release_queue_memory_callback(dsm_segment *seg, Datum arg)
+{
+	release_queue_memory(DatumGetUInt32(arg));
+}
+
+/*
+ * Size the tuple queue after the planner's estimate of how much data the scan
+ * returns, so point lookups don't pin a large queue and big exports get
+ * enough slack to ride out a briefly slow executor.  The memory is only
+ * taken from the shared budget by setup_shared_memory.
+ */
+static Size
+choose_queue_size(ForeignScanState *node)
+{
+	Plan *plan = node->ss.ps.plan;
+	int natts = RelationGetNumberOfAttributes(node->ss.ss_currentRelation);
+	Size min_size = (Size) hbase_fdw_min_queue_size * 1024;
+	Size max_size = (Size) hbase_fdw_max_queue_size * 1024;
+	double row_size;
+	double wanted;
+
+	row_size = MAXALIGN(plan->plan_width + natts * sizeof(int)) +
+		HBASE_FDW_TUPLE_OVERHEAD;
+	wanted = clamp_row_est(plan->plan_rows) * row_size;
+
+	if (max_size < min_size)
+		max_size = min_size;
+	if (wanted < min_size)
+		wanted = min_size;
+	if (wanted > max_size)
+		wanted = max_size;
+
+	return MAXALIGN((Size) wanted);
+}
+
+static void
+prepare_query_params(ForeignScanState *node)
+{
+	HBaseFdwPrivateScanState *pss = node->fdw_state;
+	ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
+	List *param_types = lsecond(fsplan->fdw_private);
+	ListCell *lc;
+	int i = 0;
+
+	pss->param_exprs = (List *) ExecInitExpr((Expr *) fsplan->fdw_exprs, &node->ss.ps);
+	pss->param_types = palloc0(sizeof(HBaseValueType) * (list_length(param_types) + 1));
+	foreach (lc, param_types)
+		pss->param_types[i++] = intVal(lfirst(lc));
+}
+
+static void
+append_param(StringInfo buf, const char *data, int32 len)
+{
+	int start = buf->len;
+	int size = HBASE_FDW_PARAM_SIZE(len);
+
+	enlargeStringInfo(buf, size);
+	memset(buf->data + start, 0, size);
+	((HBaseParamValue *) (buf->data + start))->len = len;
+	if (len > 0)
+		memcpy(buf->data + start + offsetof(HBaseParamValue, data), data, len);
+	buf->len += size;
+	buf->data[buf->len] = '\0';
+}
+
+/*
+ * Append a value in the form the worker expects: the data of a varlena, or
+ * the native bytes of a fixed width type.  jsonb, which only ever gets
+ * written, is sent as text.
+ */
+static void
+append_datum(StringInfo buf, Datum value, bool isnull, HBaseValueType type)
+{
+	if (isnull)
+	{
+		append_param(buf, NULL, -1);
+		return;
+	}
+
+	switch (type)
+	{
+		case value_type_text:
+		case value_type_bytea:
+		{
+			struct varlena *v = pg_detoast_datum_packed((struct varlena *) DatumGetPointer(value));
+			append_param(buf, VARDATA_ANY(v), VARSIZE_ANY_EXHDR(v));
+			break;
+		}
+		case value_type_int2:
+		{
+			int16 v = DatumGetInt16(value);
+			append_param(buf, (char *) &v, sizeof(v));
+			break;
+		}
+		case value_type_int4:
+		{
+			int32 v = DatumGetInt32(value);
+			append_param(buf, (char *) &v, sizeof(v));
+			break;
+		}
+		case value_type_int8:
+		case value_type_timestamptz:
+		{
+			int64 v = DatumGetInt64(value);
+			append_param(buf, (char *) &v, sizeof(v));
+			break;
+		}
+		case value_type_float4:
+		{
+			float4 v = DatumGetFloat4(value);
+			append_param(buf, (char *) &v, sizeof(v));
+			break;
+		}
+		case value_type_float8:
+		{
+			float8 v = DatumGetFloat8(value);
+			append_param(buf, (char *) &v, sizeof(v));
+			break;
+		}
+		case value_type_bool:
+		{
+			bool v = DatumGetBool(value);
+			append_param(buf, (char *) &v, sizeof(v));
+			break;
+		}
+		case value_type_jsonb:
+		{
+			Jsonb *v = DatumGetJsonb(value);
+			char *text = JsonbToCString(NULL, &v->root, VARSIZE(v));
+			append_param(buf, text, strlen(text));
+			break;
+		}
+		default:
+			elog(ERROR, "Unexpected parameter type: %d", type);
+	}
+}
+
+/*
+ * Evaluate the scan's parameters and lay them out for the worker: the data
+ * of varlenas and the native bytes of fixed width values, never their text
+ * form.
+ */
+static void
+serialize_params(ForeignScanState *node, StringInfo buf)
+{
+	HBaseFdwPrivateScanState *pss = node->fdw_state;
+	ExprContext *econtext = node->ss.ps.ps_ExprContext;
+	MemoryContext oldcontext;
+	ListCell *lc;
+	int i = 0;
+
+	oldcontext = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+
+	foreach(lc, pss->param_exprs)
+	{
+		ExprState  *expr_state = (ExprState *) lfirst(lc);
+		Datum		value;
+		bool		isNull;
+
+		value = ExecEvalExpr(expr_state, econtext, &isNull, NULL);
+
+		append_datum(buf, value, isNull, pss->param_types[i]);
+		i++;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * After the parameters, a direct UPDATE sends the row of values it sets, laid
+ * out like a mutation with the columns it leaves alone unset.
+ */
+static void
+serialize_update_values(ForeignScanState *node, StringInfo buf)
+{
+	HBaseFdwPrivateScanState *pss = node->fdw_state;
+	HBaseFdwTableInfo *table_info = pss->table_info;
+	ExprContext *econtext = node->ss.ps.ps_ExprContext;
+	MemoryContext oldcontext;
+
+	oldcontext = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+
+	for (int i = 0; i < table_info->num_columns; i++)
+	{
+		int param = pss->update_params[i];
+		Datum value;
+		bool isNull;
+
+		if (param < 0)
+		{
+			append_param(buf, NULL, HBASE_FDW_PARAM_UNSET);
+			continue;
+		}
+		value = ExecEvalExpr(list_nth(pss->param_exprs, param), econtext, &isNull, NULL);
+		append_datum(buf, value, isNull, table_info->columns[i].value_type);
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/* How often a scan that found every worker slot taken tries again */
+#define HBASE_FDW_ADMISSION_WAIT_MS 10L
+
+/*
+ * The shared memory segment is created here rather than when the scan
+ * begins, as its size depends on the parameter values.
+ */
+static void
+start_external_worker(ForeignScanState *node)
+{
+	HBaseFdwPrivateScanState *pss = node->fdw_state;
+	StringInfoData params;
+
+	initStringInfo(&params);
+	serialize_params(node, &params);
+	if (pss->operation == operation_direct_modify)
+		serialize_update_values(node, &params);
+
+	/* A direct modify only ever sends back a row count */
+	if (pss->operation == operation_direct_modify)
+		pss->mq_size = (Size) hbase_fdw_min_queue_size * 1024;
+	else
+		pss->mq_size = choose_queue_size(node);
+	pss->collect_metrics = node->ss.ps.instrument != NULL &&
+		pss->operation == operation_scan;
+	INSTR_TIME_SET_CURRENT(pss->start_time);
+	setup_shared_memory(pss, &params);
+	pfree(params.data);
+
+	hand_to_worker(pss->seg);
+	pss->worker_started = true;
+}
+
+/*
+ * Have a worker pick up the segment.  All slots may be taken, in which case
+ * wait for a scan to finish, and the bgworker may still be starting, in
+ * which case wait up to hbase_fdw.startup_timeout for it.
+ */
+static void
+hand_to_worker(dsm_segment *seg)
+{
+	TimestampTz requested = GetCurrentTimestamp();
+	int slot;
+
+	while ((slot = activate_worker(dsm_segment_handle(seg), requested)) < 0)
+	{
+		int rc;
+
+		if (slot == HBASE_FDW_WORKER_UNAVAILABLE)
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
+					 errmsg("hbase_fdw background worker is not running"),
+					 errhint("hbase_fdw_status() shows how far it got; the server log has the details.")));
+
+		report_wait_start(wait_event_admission);
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   HBASE_FDW_ADMISSION_WAIT_MS);
+		report_wait_end();
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	/*
+	 * However we stop reading, whether at the end of the scan, on a LIMIT or
+	 * when the query fails, tell the worker to stop asking HBase for rows.
+	 */
+	on_dsm_detach(seg, cancel_worker_callback, Int32GetDatum(slot));
+}
+
+static void
+hbaseBeginForeignScan(ForeignScanState *node, int eflags)
+{
+	HBaseFdwPrivateScanState *pss;
+	HBaseFdwTableInfo *table_info;
+	Oid rel_id;
+	ForeignScan *fsplan;
+	List *filters;
+	ListCell *lc;
+	int i = 0;
+
+	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
+
+	fsplan = (ForeignScan*)node->ss.ps.plan;
+	rel_id = RelationGetRelid(node->ss.ss_currentRelation);
+
+	pss = node->fdw_state = palloc0(sizeof(*pss));
+	pss->table_info = get_table_info(rel_id);
+	pss->mq_handle = NULL;
+	pss->seg = NULL;
+	pss->worker_started = false;
+	pss->param_exprs = NIL;
+	pss->param_types = NULL;
+	pss->operation = operation_scan;
+	pss->update_params = NULL;
+
+	filters = linitial(fsplan->fdw_private);
+	pss->nr_filters = list_length(filters);
+	pss->filters = palloc0(sizeof(HBaseFilter) * (pss->nr_filters + 1));
+	foreach (lc, filters)
+	{
+		List *filter = lfirst(lc);
+		HBaseFilter *out = &pss->filters[i++];
+
+		out->filter_type = intVal(linitial(filter));
+		switch (out->filter_type)
+		{
+			case filter_type_row_key_equals:
+				out->row_key_equals.param = intVal(lsecond(filter));
+				break;
+			case filter_type_row_key_prefix:
+				out->row_key_prefix.param = intVal(lsecond(filter));
+				break;
+			case filter_type_row_key_part:
+				out->row_key_part.column = intVal(lsecond(filter));
+				out->row_key_part.strategy = intVal(lthird(filter));
+				out->row_key_part.param = intVal(lfourth(filter));
+				out->row_key_part.param_type = intVal(list_nth(filter, 4));
+				break;
+			case filter_type_and:
+			case filter_type_or:
+			case filter_type_not:
+				out->bool_expr.nargs = intVal(lsecond(filter));
+				break;
+			default:
+				elog(ERROR, "Unknown filter type: %d", out->filter_type);
+		}
+	}
+
+	initStringInfo(&pss->chunk_buf);
+	ItemPointerSetInvalid(&pss->tuple.t_self);
+	pss->tuple.t_tableOid = InvalidOid;
+	pss->temp_cxt = AllocSetContextCreate(node->ss.ps.state->es_query_cxt,
+										  "hbase_fdw temporary data",
+										  ALLOCSET_SMALL_SIZES);
+
+	prepare_query_params(node);
+}
+
+/*
+ * Store a row received from the worker in the slot as a virtual tuple.  Each
+ * column is a length word followed by the datum, aligned as the attribute
+ * requires.  By-reference datums point straight into the message, which
+ * stays valid until the next call to hbaseIterateForeignScan.
+ */
+static void
+handle_tuple(char *tuple_data, TupleTableSlot *slot)
+{
+	TupleDesc desc = slot->tts_tupleDescriptor;
+	Form_pg_attribute *attrs = desc->attrs;
+	Datum *values = slot->tts_values;
+	bool *nulls = slot->tts_isnull;
+	size_t cur_tuple_offset = 0;
+	size_t datum_len = *(int*)(tuple_data + cur_tuple_offset);
+	int i = 0;
+
+	memset(nulls, true, sizeof(bool) * desc->natts);
+
+	while (datum_len != 0 && i < desc->natts) {
+		if (datum_len == 4)
+		{
+			nulls[i] = true;
+			values[i] = PointerGetDatum(NULL);
+		}
+		else
+		{
+			char *value = tuple_data + att_align_nominal(cur_tuple_offset + 4,
+														 attrs[i]->attalign);
+			nulls[i] = false;
+			values[i] = fetch_att(value, attrs[i]->attbyval, attrs[i]->attlen);
+		}
+		i++;
+		cur_tuple_offset += datum_len;
+		datum_len = *(int*)(tuple_data + cur_tuple_offset);
+	};
+
+	ExecStoreVirtualTuple(slot);
+}
+
+/*
+ * Wait for the next message from the worker.  Only receives that actually
+ * have to wait are timed and reported as a wait event.
+ */
+static HBaseFdwMessage *
+receive_message(HBaseFdwPrivateScanState *pss)
+{
+	HBaseFdwMessage *message;
+	Size len;
+	shm_mq_result res;
+
+	res = shm_mq_receive(pss->mq_handle, &len, (void **) &message, true);
+	if (res == SHM_MQ_WOULD_BLOCK)
+	{
+		instr_time start;
+		instr_time end;
+
+		INSTR_TIME_SET_CURRENT(start);
+		report_wait_start(pss->hbase_rows == 0 ? wait_event_first_row : wait_event_next_row);
+		res = shm_mq_receive(pss->mq_handle, &len, (void **) &message, false);
+		report_wait_end();
+		INSTR_TIME_SET_CURRENT(end);
+		INSTR_TIME_ACCUM_DIFF(pss->wait_time, end, start);
+	}
+	if (res == SHM_MQ_DETACHED)
+	{
+		elog(ERROR, "Subprocess lost connection");
+	}
+
+	pss->mq_bytes += len;
+	return message;
+}
+
+/* Note a row arriving from HBase, see HBaseFdwPrivateScanState */
+static void
+count_row(HBaseFdwPrivateScanState *pss)
+{
+	pss->hbase_rows++;
+	if (pss->collect_metrics && !pss->have_first_row)
+	{
+		INSTR_TIME_SET_CURRENT(pss->first_row_time);
+		INSTR_TIME_SUBTRACT(pss->first_row_time, pss->start_time);
+		pss->have_first_row = true;
+	}
+}
+
+/* Keep the metrics the worker sent at the end of the scan, if any */
+static void
+save_scan_metrics(HBaseFdwPrivateScanState *pss, HBaseFdwMessage *message, MemoryContext cxt)
+{
+	char *ptr = message->data + offsetof(HBaseScanMetrics, row_range);
+	char *end = message->data + message->data_len;
+	char **rows[2] = { &pss->start_row, &pss->stop_row };
+
+	if (!pss->collect_metrics || message->data_len < offsetof(HBaseScanMetrics, row_range))
+		return;
+
+	memcpy(&pss->scan_metrics, message->data, offsetof(HBaseScanMetrics, row_range));
+	for (int i = 0; i < 2; i++)
+	{
+		int32 len;
+
+		if (end - ptr < (ptrdiff_t) sizeof(len))
+			return;
+		memcpy(&len, ptr, sizeof(len));
+		ptr += sizeof(len);
+		if (len < 0 || end - ptr < len)
+			return;
+		*rows[i] = MemoryContextAlloc(cxt, len + 1);
+		memcpy(*rows[i], ptr, len);
+		(*rows[i])[len] = '\0';
+		ptr += len;
+	}
+	pss->have_scan_metrics = true;
+}
+
+static TupleTableSlot *
+hbaseIterateForeignScan(ForeignScanState *node)
+{
+	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+	HBaseFdwPrivateScanState *pss = node->fdw_state;
+	HBaseFdwMessage *message;
+	MemoryContext oldcontext;
+
+	if (!pss->worker_started)
+		start_external_worker(node);
+
+	/* The previous row is no longer referenced once we get here. */
+	ExecClearTuple(slot);
+	resetStringInfo(&pss->chunk_buf);
+	MemoryContextReset(pss->temp_cxt);
+	oldcontext = MemoryContextSwitchTo(pss->temp_cxt);
+
+	for (;;)
+	{
+		message = receive_message(pss);
+
+		switch (message->msg_type)
+		{
+			case msg_type_end_of_stream:
+				save_scan_metrics(pss, message, node->ss.ps.state->es_query_cxt);
+				MemoryContextSwitchTo(oldcontext);
+				return slot;
+			case msg_type_tuple_chunk:
+				appendBinaryStringInfo(&pss->chunk_buf, message->data, message->data_len);
+				continue;
+			case msg_type_tuple:
+			{
+				char *data = message->data;
+
+				if (pss->chunk_buf.len > 0)
+				{
+					appendBinaryStringInfo(&pss->chunk_buf, message->data, message->data_len);
+					data = pss->chunk_buf.data;
+				}
+
+				handle_tuple(data, slot);
+				count_row(pss);
+				MemoryContextSwitchTo(oldcontext);
+				return slot;
+			}
+			case msg_type_heap_tuple:
+			{
+				HeapTuple tuple = &pss->tuple;
+
+				if (pss->chunk_buf.len > 0)
+				{
+					appendBinaryStringInfo(&pss->chunk_buf, message->data, message->data_len);
+					tuple->t_data = (HeapTupleHeader) pss->chunk_buf.data;
+					tuple->t_len = pss->chunk_buf.len;
+				}
+				else
+				{
+					tuple->t_data = (HeapTupleHeader) message->data;
+					tuple->t_len = message->data_len;
+				}
+
+				ExecStoreTuple(tuple, slot, InvalidBuffer, false);
+				count_row(pss);
+				MemoryContextSwitchTo(oldcontext);
+				return slot;
+			}
+			case msg_type_error:
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_ERROR),
+						 errmsg("HBase scan failed: %.*s",
+								(int) message->data_len, message->data)));
+			default:
+				elog(ERROR, "Unknown message");
+		}
+	}
+}
+
+static void
+hbaseReScanForeignScan(ForeignScanState *node)
+{
+}
+
+static void
+hbaseEndForeignScan(ForeignScanState *node)
+{
+	HBaseFdwPrivateScanState *pss = node->fdw_state;
+	/* if fsstate is NULL, we are in EXPLAIN; nothing to do */
+	if (pss == NULL)
+		return;
+
+	if (pss->seg != NULL)
+		dsm_detach(pss->seg);
+}
+
+static char *
+explain_param(ForeignScan *fsplan, int param, ExplainState *es)
+{
+	return deparse_expression(list_nth(fsplan->fdw_exprs, param), es->deparse_cxt,
+							  false, false);
+}
+
+/*
+ * Append one filter tree from fdw_private, in the preorder layout described
+ * at create_row_key_equals_filter, and advance *lc past it.
+ */
+static void
+explain_filter(StringInfo buf, ListCell **lc, ForeignScanState *node,
+			   HBaseFdwTableInfo *table_info, ExplainState *es)
+{
+	static const char *strategy_ops[] = { NULL, "<", "<=", "=", ">=", ">" };
+	ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
+	List *filter = lfirst(*lc);
+	int type = intVal(linitial(filter));
+
+	*lc = lnext(*lc);
+	switch (type)
+	{
+		case filter_type_row_key_equals:
+			appendStringInfo(buf, "row key = %s",
+							 explain_param(fsplan, intVal(lsecond(filter)), es));
+			break;
+		case filter_type_row_key_prefix:
+			appendStringInfo(buf, "row key starts with %s",
+							 explain_param(fsplan, intVal(lsecond(filter)), es));
+			break;
+		case filter_type_row_key_part:
+		{
+			HBaseColumn *col = &table_info->columns[intVal(lsecond(filter))];
+			TupleDesc desc = RelationGetDescr(node->ss.ss_currentRelation);
+
+			appendStringInfo(buf, "%s %s %s",
+							 quote_identifier(NameStr(desc->attrs[col->attnum - 1]->attname)),
+							 strategy_ops[intVal(lthird(filter))],
+							 explain_param(fsplan, intVal(lfourth(filter)), es));
+			break;
+		}
+		case filter_type_not:
+			appendStringInfoString(buf, "NOT ");
+			explain_filter(buf, lc, node, table_info, es);
+			break;
+		default:
+		{
+			int nargs = intVal(lsecond(filter));
+
+			appendStringInfoChar(buf, '(');
+			for (int i = 0; i < nargs; i++)
+			{
+				if (i > 0)
+					appendStringInfoString(buf, type == filter_type_and ? " AND " : " OR ");
+				explain_filter(buf, lc, node, table_info, es);
+			}
+			appendStringInfoChar(buf, ')');
+			break;
+		}
+	}
+}
+
+/*
+ * The worker works out the row key range from the filters, and only reports
+ * it at the end of a scan, so otherwise the filters shown are all there is.
+ */
+static void
+explain_key_range(ExplainState *es)
+{
+	ExplainPropertyText("HBase Key Range", "determined at runtime", es);
+}
+
+/*
+ * With VERBOSE, show the HBase table, the columns the scan asks HBase for and
+ * the filters it sends, all of which must hold.
+ */
+static void
+explain_hbase_request(ForeignScanState *node, ExplainState *es)
+{
+	ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
+	HBaseFdwTableInfo *table_info = get_table_info(RelationGetRelid(node->ss.ss_currentRelation));
+	List *filters = linitial(fsplan->fdw_private);
+	List *columns = NIL;
+	ListCell *lc;
+
+	ExplainPropertyText("HBase Table", table_info->table_name, es);
+
+	for (int i = 0; i < table_info->num_columns; i++)
+	{
+		HBaseColumn *col = &table_info->columns[i];
+
+		if (col->family)
+			columns = lappend(columns, psprintf("%s:*", col->family_name));
+		else if (col->column)
+			columns = lappend(columns, psprintf("%s:%s", col->family_name, col->qualifier));
+	}
+	ExplainPropertyList("HBase Columns", columns, es);
+
+	if (filters != NIL)
+	{
+		StringInfoData buf;
+
+		initStringInfo(&buf);
+		lc = list_head(filters);
+		while (lc != NULL)
+		{
+			if (buf.len > 0)
+				appendStringInfoString(&buf, " AND ");
+			explain_filter(&buf, &lc, node, table_info, es);
+		}
+		ExplainPropertyText("HBase Filter", buf.data, es);
+	}
+}
+
+static double
+instr_time_ms(instr_time t)
+{
+	return INSTR_TIME_GET_MILLISEC(t);
+}
+
+static void
+hbaseExplainForeignScan(ForeignScanState *node, ExplainState *es)
+{
+	HBaseFdwPrivateScanState *pss = node->fdw_state;
+
+	if (es->verbose)
+		explain_hbase_request(node, es);
+
+	/* Nothing to show if the scan never ran */
+	if (!es->analyze || pss == NULL || !pss->collect_metrics)
+	{
+		if (es->verbose)
+			explain_key_range(es);
+		return;
+	}
+
+	ExplainPropertyLong("HBase Rows", pss->hbase_rows, es);
+	ExplainPropertyLong("Worker Bytes", pss->mq_bytes, es);
+	if (pss->have_first_row)
+		ExplainPropertyFloat("Time To First Row", instr_time_ms(pss->first_row_time), 3, es);
+	ExplainPropertyFloat("Worker Wait Time", instr_time_ms(pss->wait_time), 3, es);
+
+	/* Only sent once the scan runs to the end, not when a LIMIT stops it */
+	if (pss->have_scan_metrics)
+	{
+		ExplainPropertyLong("HBase RPCs", pss->scan_metrics.rpcs, es);
+		ExplainPropertyLong("HBase Remote RPCs", pss->scan_metrics.remote_rpcs, es);
+		ExplainPropertyLong("HBase RPC Retries", pss->scan_metrics.rpc_retries, es);
+		ExplainPropertyLong("HBase Regions", pss->scan_metrics.regions, es);
+		ExplainPropertyLong("HBase Result Bytes", pss->scan_metrics.result_bytes, es);
+		if (es->verbose)
+		{
+			ExplainPropertyText("HBase Start Row", pss->start_row, es);
+			ExplainPropertyText("HBase Stop Row", pss->stop_row, es);
+		}
+	}
+	else if (es->verbose)
+		explain_key_range(es);
+}
+
+/*
+ * Writes go through a worker too.  Rows are collected into batches of the
+ * table's batch_size, each sent as one msg_type_mutations message, which the
+ * worker queues on an HBase BufferedMutator.  At the end of the statement a
+ * msg_type_flush waits until everything has been written.
+ */
+
+static bool
+is_key_column(HBaseColumn *col)
+{
+	return col->row_key || col->row_key_part;
+}
+
+/* Columns that aren't mapped to HBase can't be stored, so are never sent */
+static bool
+is_mapped_column(HBaseColumn *col)
+{
+	return is_key_column(col) || col->family || col->column;
+}
+
+static char *
+key_junk_name(AttrNumber attnum)
+{
+	return psprintf("hbase_key_%d", attnum);
+}
+
+/*
+ * The row key plays the part of ctid: UPDATE and DELETE fetch the key columns
+ * of the rows they change as junk attributes.
+ */
+static void
+hbaseAddForeignUpdateTargets(Query *parsetree,
+							 RangeTblEntry *target_rte,
+							 Relation target_relation)
 {
-	List *local_exprs = NIL;
-	List *remote_exprs = NIL;
-	List *params_list = NIL;
-	HBaseFdwTableInfo *table_info = baserel->fdw_private;
-	List *hbase_filters = NIL;
-	List *params = NIL;
-	ListCell *lc;
-	foreach(lc, scan_clauses)
+	HBaseFdwTableInfo *table_info = get_table_info(RelationGetRelid(target_relation));
+
+	for (int i = 0; i < table_info->num_columns; i++)
 	{
-		RestrictInfo *rinfo = (RestrictInfo*) lfirst(lc);
+		Form_pg_attribute attr = target_relation->rd_att->attrs[i];
+		Var *var;
+		TargetEntry *tle;
 
-		if (rinfo->pseudoconstant)
+		if (!is_key_column(&table_info->columns[i]))
 			continue;
 
-		if (list_member_ptr(table_info->remote_conds, rinfo))
-			remote_exprs = lappend(remote_exprs, rinfo->clause);
-		else if (list_member_ptr(table_info->local_conds, rinfo))
-			local_exprs = lappend(local_exprs, rinfo->clause);
-	}
-
-	foreach (lc, remote_exprs)
-	{
-		Node *node = lfirst(lc);
-		HBasePreparedFilter *filter = make_filter(node, table_info, baserel->relids);
-		hbase_filters = lappend(hbase_filters, filter);
+		var = makeVar(parsetree->resultRelation, i + 1, attr->atttypid,
+					  attr->atttypmod, attr->attcollation, 0);
+		tle = makeTargetEntry((Expr *) var,
+							  list_length(parsetree->targetList) + 1,
+							  key_junk_name(i + 1),
+							  true);
+		parsetree->targetList = lappend(parsetree->targetList, tle);
 	}
+}
 
-	foreach (lc, hbase_filters)
+static List *
+hbasePlanForeignModify(PlannerInfo *root,
+					   ModifyTable *plan,
+					   Index resultRelation,
+					   int subplan_index)
+{
+	RangeTblEntry *rte = planner_rt_fetch(resultRelation, root);
+	HBaseFdwTableInfo *table_info = get_table_info(rte->relid);
+	List *targets = NIL;
+
+	if (plan->returningLists != NIL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("RETURNING is not supported for HBase tables")));
+	if (plan->onConflictAction != ONCONFLICT_NONE)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("ON CONFLICT is not supported for HBase tables")));
+
+	switch (plan->operation)
 	{
-		HBasePreparedFilter *filter = lfirst(lc);
-		ListCell *filter_param;
-		int num = 0;
-
-		filter->param_nums = palloc0(sizeof(int) * list_length(filter->params));
-		foreach (filter_param, filter->params)
+		case CMD_INSERT:
+			for (int i = 0; i < table_info->num_columns; i++)
+				targets = lappend_int(targets, i + 1);
+			break;
+		case CMD_UPDATE:
 		{
-			Node *filter_param_node = lfirst(filter_param);
-			ListCell *global_param;
-			int pindex = 0;
+			int col = -1;
 
-			foreach (global_param, params)
+			while ((col = bms_next_member(rte->updatedCols, col)) >= 0)
 			{
-				Node *global_param_node = lfirst(global_param);
-				pindex++;
-				if (equal(global_param_node, filter_param_node))
-					break;
+				AttrNumber attnum = col + FirstLowInvalidHeapAttributeNumber;
+
+				if (attnum <= InvalidAttrNumber)
+					continue;
+				/* That would move the row, which HBase can't do atomically */
+				if (is_key_column(&table_info->columns[attnum - 1]))
+					ereport(ERROR,
+							(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							 errmsg("Can not update row key column %s",
+									get_attname(rte->relid, attnum))));
+				targets = lappend_int(targets, attnum);
 			}
+			break;
+		}
+		case CMD_DELETE:
+			break;
+		default:
+			elog(ERROR, "Unexpected operation: %d", (int) plan->operation);
+	}
 
-			if (global_param == NULL)
-			{
-				pindex++;
-				params = lappend(params, filter_param_node);
-			}
-			filter->param_nums[num] = pindex;
+	return list_make1(targets);
+}
+
+static void
+reset_batch(HBaseFdwModifyState *fms)
+{
+	resetStringInfo(&fms->batch);
+	appendStringInfoSpaces(&fms->batch, offsetof(HBaseFdwMessage, data));
+	fms->batch_rows = 0;
+}
+
+static void
+hbaseBeginForeignModify(ModifyTableState *mtstate,
+						ResultRelInfo *rinfo,
+						List *fdw_private,
+						int subplan_index,
+						int eflags)
+{
+	HBaseFdwModifyState *fms;
+	HBaseFdwTableInfo *table_info;
+	ListCell *lc;
+
+	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
+
+	fms = palloc0(sizeof(*fms));
+	fms->table_info = table_info = get_table_info(RelationGetRelid(rinfo->ri_RelationDesc));
+	fms->worker_started = false;
+	fms->seg = NULL;
+
+	/* Only rows that are new can be loaded as HFiles */
+	fms->bulk_load = mtstate->operation == CMD_INSERT &&
+		(table_info->bulk_load || hbase_fdw_bulk_load);
+
+	fms->targets = palloc0(sizeof(bool) * table_info->num_columns);
+	foreach (lc, (List *) linitial(fdw_private))
+		fms->targets[lfirst_int(lc) - 1] = true;
+
+	fms->key_attnos = palloc0(sizeof(AttrNumber) * table_info->num_columns);
+	if (mtstate->operation != CMD_INSERT)
+	{
+		Plan *subplan = mtstate->mt_plans[subplan_index]->plan;
+
+		for (int i = 0; i < table_info->num_columns; i++)
+		{
+			if (!is_key_column(&table_info->columns[i]))
+				continue;
+			fms->key_attnos[i] = ExecFindJunkAttributeInTlist(subplan->targetlist,
+															  key_junk_name(i + 1));
+			if (!AttributeNumberIsValid(fms->key_attnos[i]))
+				elog(ERROR, "Could not find junk row key column %d", i + 1);
 		}
 	}
 
-	return make_foreignscan(
-		tlist,
-		local_exprs,
-		baserel->relid,
-		params,
-		list_make1(hbase_filters),
-		NIL,
-		remote_exprs,
-		outer_plan);
+	initStringInfo(&fms->batch);
+	reset_batch(fms);
+	fms->temp_cxt = AllocSetContextCreate(mtstate->ps.state->es_query_cxt,
+										  "hbase_fdw temporary data",
+										  ALLOCSET_SMALL_SIZES);
+
+	rinfo->ri_FdwState = fms;
 }
 
-void
-setup_shared_memory(HBaseFdwPrivateScanState *pss)
+/*
+ * Lay out a segment like a scan's, with no filters or parameters, plus a
+ * second queue on which the backend sends the mutations.
+ */
+static void
+start_modify_worker(HBaseFdwModifyState *fms)
 {
+	HBaseFdwTableInfo *table_info = fms->table_info;
+	shm_toc_estimator e;
 	shm_toc *toc;
-	shm_mq *mq;
 	dsm_segment *seg;
-	shm_toc_estimator e;
 	Size dsm_size;
 	HBaseCommand *command;
 	HBaseColumn *columns;
-	HBaseFilter *out_filters;
-	Size mq_size;
-	ListCell *lc;
-	size_t offset;
-	HBaseFdwTableInfo *table_info = pss->table_info;
-	List *filters = pss->filters;
-	uint32 nr_filters = list_length(filters);
-
-	shm_toc_initialize_estimator(&e);
-	shm_toc_estimate_keys(&e, 1);
-	shm_toc_estimate_chunk(&e, sizeof(HBaseCommand));
-	shm_toc_estimate_keys(&e, 1);
-	shm_toc_estimate_chunk(&e, sizeof(HBaseColumn) * table_info->num_columns);
-	shm_toc_estimate_keys(&e, 1);
-	shm_toc_estimate_chunk(&e, sizeof(HBaseFilter) * nr_filters);
-	shm_toc_estimate_keys(&e, 1);
-	shm_toc_estimate_chunk(&e, DSM_SIZE);
-	dsm_size = shm_toc_estimate(&e);
-
-	seg = dsm_create(dsm_size, 0);
+	shm_mq *reply_mq;
+	shm_mq *mutations_mq;
+	Size reply_size;
+	Size mutations_size;
+
+	/* As in setup_shared_memory, give the memory back if this fails */
+	reply_size = reserve_queue_memory((Size) hbase_fdw_min_queue_size * 1024);
+	mutations_size = reserve_queue_memory((Size) hbase_fdw_max_queue_size * 1024);
+	PG_TRY();
+	{
+		shm_toc_initialize_estimator(&e);
+		shm_toc_estimate_keys(&e, 6);
+		shm_toc_estimate_chunk(&e, sizeof(HBaseCommand));
+		shm_toc_estimate_chunk(&e, sizeof(HBaseColumn) * table_info->num_columns);
+		shm_toc_estimate_chunk(&e, reply_size);
+		shm_toc_estimate_chunk(&e, mutations_size);
+		dsm_size = shm_toc_estimate(&e);
+
+		seg = dsm_create(dsm_size, 0);
+	}
+	PG_CATCH();
+	{
+		release_queue_memory(reply_size + mutations_size);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	on_dsm_detach(seg, release_queue_memory_callback,
+				  UInt32GetDatum(reply_size + mutations_size));
+
 	toc = shm_toc_create(
 		HBASE_FDW_SHM_TOC_MAGIC,
 		dsm_segment_address(seg),
 		dsm_size);
 
 	command = shm_toc_allocate(toc, sizeof(HBaseCommand));
+	memset(command, 0, sizeof(HBaseCommand));
 	strncpy(command->table_name, table_info->table_name, HBASE_FDW_MAX_TABLE_NAME_LEN);
 	command->table_name[HBASE_FDW_MAX_TABLE_NAME_LEN] = '\0';
+	command->operation = operation_modify;
+	command->bulk_load = fms->bulk_load;
+	command->dboid = MyDatabaseId;
+	command->relid = table_info->relid;
+	command->options_version = table_info->options_version;
 	command->nr_columns = table_info->num_columns;
-	command->nr_filters = nr_filters;
+	command->nr_filters = 0;
+	command->nr_params = 0;
+	command->timeout_ms = scan_timeout(table_info);
+	command->heap_tuples = false;
+	command->collect_metrics = false;
 	shm_toc_insert(toc, 1, command);
 
 	columns = shm_toc_allocate(toc, sizeof(HBaseColumn) * table_info->num_columns);
 	memcpy(columns, table_info->columns, sizeof(*columns) * table_info->num_columns);
 	shm_toc_insert(toc, 2, columns);
 
-	out_filters = shm_toc_allocate(toc, sizeof(HBaseFilter) * nr_filters);
-	shm_toc_insert(toc, 3, out_filters);
+	shm_toc_insert(toc, 3, shm_toc_allocate(toc, 0));
 
-	mq_size = DSM_SIZE;
-	mq = shm_toc_allocate(toc, mq_size);
-	mq = shm_mq_create(mq, mq_size);
-	shm_mq_set_receiver(mq, MyProc);
-	shm_toc_insert(toc, 4, mq);
+	reply_mq = shm_toc_allocate(toc, reply_size);
+	reply_mq = shm_mq_create(reply_mq, reply_size);
+	shm_mq_set_receiver(reply_mq, MyProc);
+	shm_toc_insert(toc, 4, reply_mq);
 
-	pss->mq_handle = shm_mq_attach(mq, pss->seg, NULL);
-	pss->seg = seg;
+	shm_toc_insert(toc, 5, shm_toc_allocate(toc, 0));
+
+	mutations_mq = shm_toc_allocate(toc, mutations_size);
+	mutations_mq = shm_mq_create(mutations_mq, mutations_size);
+	shm_mq_set_sender(mutations_mq, MyProc);
+	shm_toc_insert(toc, 6, mutations_mq);
+
+	fms->seg = seg;
+	fms->reply_mq = shm_mq_attach(reply_mq, seg, NULL);
+	fms->mutations_mq = shm_mq_attach(mutations_mq, seg, NULL);
+
+	hand_to_worker(seg);
+	fms->worker_started = true;
 }
 
-static void
-prepare_query_params(ForeignScanState *node)
+/*
+ * Look for the worker's answer: an error, which is raised here, or the
+ * end_of_stream acknowledging a flush, in which case return true.  Without
+ * waiting, returns false if there is nothing to read yet.
+ */
+static bool
+receive_reply(HBaseFdwModifyState *fms, bool nowait)
 {
-	HBaseFdwPrivateScanState *pss = node->fdw_state;
-	ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
-	List *exprs = fsplan->fdw_exprs;
-	ListCell *lc;
-	int num_params = list_length(exprs);
-	int i;
-	if (num_params == 0)
-	{
-		pss->param_flinfo = NULL;
-		pss->param_exprs = NIL;
-	}
+	HBaseFdwMessage *message;
+	Size len;
+	shm_mq_result res;
 
-	pss->param_flinfo = palloc0(sizeof(FmgrInfo) * num_params);
-	pss->param_exprs  = (List*)ExecInitExpr((Expr*) exprs, &node->ss.ps);
+	if (!nowait)
+		report_wait_start(wait_event_modify_reply);
+	res = shm_mq_receive(fms->reply_mq, &len, (void **) &message, nowait);
+	if (!nowait)
+		report_wait_end();
+	if (res == SHM_MQ_WOULD_BLOCK)
+		return false;
+	if (res == SHM_MQ_DETACHED)
+		elog(ERROR, "Subprocess lost connection");
 
-	i = 0;
-	foreach (lc, exprs)
+	switch (message->msg_type)
 	{
-		Node *param_expr = (Node*) lfirst(lc);
-		Oid typefnoid;
-		bool isvarlena;
-
-		getTypeOutputInfo(exprType(param_expr), &typefnoid, &isvarlena);
-		fmgr_info(typefnoid, &pss->param_flinfo[i]);
-		i++;
+		case msg_type_end_of_stream:
+			return true;
+		case msg_type_error:
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_ERROR),
+					 errmsg("HBase write failed: %.*s",
+							(int) message->data_len, message->data)));
+		default:
+			elog(ERROR, "Unknown message");
 	}
+	return false;
 }
 
-static List*
-create_finalized_filters(ForeignScanState *node)
+static void
+send_to_worker(HBaseFdwModifyState *fms, HBaseFdwMessage *msg, Size len)
 {
-	HBaseFdwPrivateScanState *pss = node->fdw_state;
-	ExprContext *econtext = node->ss.ps.ps_ExprContext;
-	ListCell *lc;
-	int i = 0;
-	MemoryContext oldcontext;
-	List *ret = NIL;
-	char **param_values = NULL;
-	int len = list_length(pss->param_exprs);
-
-	elog(LOG, "RUNNING HERE");
+	shm_mq_result res;
 
-	if (len == 0)
-		return NIL;
+	report_wait_start(wait_event_send_mutations);
+	res = shm_mq_send(fms->mutations_mq, len, msg, false);
+	report_wait_end();
+	if (res == SHM_MQ_DETACHED)
+	{
+		/* The worker gives up after an error, so report that if we can */
+		receive_reply(fms, false);
+		elog(ERROR, "Subprocess lost connection");
+	}
+}
 
-	param_values = palloc0(len * sizeof(char*));
+static void
+send_batch(HBaseFdwModifyState *fms)
+{
+	HBaseFdwMessage *msg;
 
-	oldcontext = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+	if (fms->batch_rows == 0)
+		return;
+	if (!fms->worker_started)
+		start_modify_worker(fms);
 
-	foreach(lc, pss->param_exprs)
-	{
-		ExprState  *expr_state = (ExprState *) lfirst(lc);
-		Datum		expr_value;
-		bool		isNull;
+	msg = (HBaseFdwMessage *) fms->batch.data;
+	msg->msg_type = msg_type_mutations;
+	msg->data_len = fms->batch.len - offsetof(HBaseFdwMessage, data);
+	send_to_worker(fms, msg, fms->batch.len);
+	reset_batch(fms);
 
-		/* Evaluate the parameter expression */
-		expr_value = ExecEvalExpr(expr_state, econtext, &isNull, NULL);
+	/* Fail the statement early if an earlier batch was rejected */
+	receive_reply(fms, true);
+}
 
-		/*
-		 * Get string representation of each parameter value by invoking
-		 * type-specific output function, unless the value is null.
-		 */
-		if (isNull)
-			param_values[i] = NULL;
-		else
-			param_values[i] = OutputFunctionCall(&pss->param_flinfo[i], expr_value);
+/*
+ * Add a row to the batch: its key, from the junk attributes for UPDATE and
+ * DELETE, and the columns the statement sets.  The rest are marked unset so
+ * the worker leaves their cells alone.
+ */
+static void
+append_mutation(HBaseFdwModifyState *fms, HBaseMutationType type,
+				TupleTableSlot *slot, TupleTableSlot *planSlot)
+{
+	HBaseFdwTableInfo *table_info = fms->table_info;
+	int32 mutation_type = type;
+	MemoryContext oldcontext;
 
-		i++;
-	}
-	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(fms->temp_cxt);
+	oldcontext = MemoryContextSwitchTo(fms->temp_cxt);
 
-	foreach (lc, pss->filters)
+	appendBinaryStringInfo(&fms->batch, (char *) &mutation_type, sizeof(mutation_type));
+	for (int i = 0; i < table_info->num_columns; i++)
 	{
-		HBasePreparedFilter *prepared_filter = (HBasePreparedFilter *)lfirst(lc);
-		HBaseFilter *filter = &prepared_filter->filter;
-
-		switch(filter->filter_type)
+		HBaseColumn *col = &table_info->columns[i];
+		Datum value;
+		bool isnull;
+
+		if (fms->key_attnos[i] != InvalidAttrNumber)
+			value = ExecGetJunkAttribute(planSlot, fms->key_attnos[i], &isnull);
+		else if (fms->targets[i] && is_mapped_column(col))
+			value = slot_getattr(slot, i + 1, &isnull);
+		else
 		{
-			case filter_type_row_key_equals:
-			{
-				if (prepared_filter->param_nums != NULL)
-				{
-					elog(LOG, "Params num: %d", prepared_filter->param_nums[0]);
-					strncpy(filter->row_key_equals.row_key,
-							param_values[prepared_filter->param_nums[0] - 1],
-							HBASE_FDW_MAX_ROW_KEY_FILTER_LEN);
-					filter->row_key_equals.row_key[HBASE_FDW_MAX_ROW_KEY_FILTER_LEN] = '\0';
-				}
-				break;
-			}
-			default:
-				elog(ERROR, "Unknown filter type: %d", filter->filter_type);
+			append_param(&fms->batch, NULL, HBASE_FDW_PARAM_UNSET);
+			continue;
 		}
-		ret = lappend(ret, filter);
+		append_datum(&fms->batch, value, isnull, col->value_type);
 	}
 
-	pfree(param_values);
-	return ret;
+	MemoryContextSwitchTo(oldcontext);
+
+	if (++fms->batch_rows >= table_info->batch_size)
+		send_batch(fms);
 }
 
-static void
-start_external_worker(ForeignScanState *node)
+static TupleTableSlot *
+hbaseExecForeignInsert(EState *estate, ResultRelInfo *rinfo,
+					   TupleTableSlot *slot, TupleTableSlot *planSlot)
 {
+	append_mutation(rinfo->ri_FdwState, mutation_type_insert, slot, planSlot);
+	return slot;
+}
 
-	HBaseFdwPrivateScanState *pss = node->fdw_state;
-	HBaseFdwTableInfo *table_info = pss->table_info;
+static TupleTableSlot *
+hbaseExecForeignUpdate(EState *estate, ResultRelInfo *rinfo,
+					   TupleTableSlot *slot, TupleTableSlot *planSlot)
+{
+	append_mutation(rinfo->ri_FdwState, mutation_type_update, slot, planSlot);
+	return slot;
+}
 
-	List *filters = create_finalized_filters(node);
-	ListCell *lc;
-	size_t offset = 0;
-	shm_toc *toc;
-	HBaseFilter *output_filters;
-	toc = shm_toc_attach(HBASE_FDW_SHM_TOC_MAGIC, dsm_segment_address(pss->seg));
+static TupleTableSlot *
+hbaseExecForeignDelete(EState *estate, ResultRelInfo *rinfo,
+					   TupleTableSlot *slot, TupleTableSlot *planSlot)
+{
+	append_mutation(rinfo->ri_FdwState, mutation_type_delete, slot, planSlot);
+	return slot;
+}
 
-	if (toc == NULL)
-		elog(ERROR, "Failed to reach TOC");
+static void
+hbaseEndForeignModify(EState *estate, ResultRelInfo *rinfo)
+{
+	HBaseFdwModifyState *fms = rinfo->ri_FdwState;
 
-	output_filters = shm_toc_lookup(toc, 3);
+	/* if fms is NULL, we are in EXPLAIN; nothing to do */
+	if (fms == NULL)
+		return;
 
-	foreach (lc, filters)
+	send_batch(fms);
+	if (fms->worker_started)
 	{
-		HBaseFilter *filter = lfirst(lc);
-		memcpy(output_filters + offset, filter, sizeof(HBaseFilter));
-		offset += sizeof(HBaseFilter);
+		HBaseFdwMessage flush;
+
+		flush.msg_type = msg_type_flush;
+		flush.data_len = 0;
+		send_to_worker(fms, &flush, offsetof(HBaseFdwMessage, data));
+
+		/* Blocks until the worker acknowledges or reports an error */
+		receive_reply(fms, false);
 	}
 
-	activate_worker(dsm_segment_handle(pss->seg));
-	pss->worker_started = true;
+	if (fms->seg != NULL)
+		dsm_detach(fms->seg);
 }
 
-static void
-hbaseBeginForeignScan(ForeignScanState *node, int eflags)
+/* Rows can only be written to tables with a row key */
+static int
+hbaseIsForeignRelUpdatable(Relation rel)
 {
-	HBaseFdwPrivateScanState *pss;
-	HBaseFdwTableInfo *table_info;
-	Oid rel_id;
-	ForeignScan *fsplan;
-	List *filters;
+	HBaseFdwTableInfo *table_info = get_table_info(RelationGetRelid(rel));
 
-	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
-		return;
+	for (int i = 0; i < table_info->num_columns; i++)
+	{
+		if (is_key_column(&table_info->columns[i]))
+			return (1 << CMD_INSERT) | (1 << CMD_UPDATE) | (1 << CMD_DELETE);
+	}
+	return 0;
+}
 
-	fsplan = (ForeignScan*)node->ss.ps.plan;
-	rel_id = RelationGetRelid(node->ss.ss_currentRelation);
+/*
+ * Run an UPDATE or DELETE entirely in the worker when HBase finds the rows by
+ * itself: the scan must leave no condition for Postgres to check, and an
+ * UPDATE may only set qualifier columns to constants or parameters.  The
+ * worker then scans just the matching row keys and mutates each row, and
+ * only the count of rows changed comes back.
+ */
+static bool
+hbasePlanDirectModify(PlannerInfo *root,
+					  ModifyTable *plan,
+					  Index resultRelation,
+					  int subplan_index)
+{
+	Plan *subplan = (Plan *) list_nth(plan->plans, subplan_index);
+	RangeTblEntry *rte = planner_rt_fetch(resultRelation, root);
+	HBaseFdwTableInfo *table_info;
+	ForeignScan *fscan;
+	List *params;
+	List *param_types;
+	List *update_params = NIL;
+	int *update_param;
 
-	pss = node->fdw_state = palloc0(sizeof(*pss));
-	pss->table_info = get_table_info(rel_id);
-	pss->filters = linitial(fsplan->fdw_private);
-	pss->mq_handle = NULL;
-	pss->seg = NULL;
-	pss->worker_started = false;
-	pss->param_exprs = NIL;
-	pss->param_flinfo = NULL;
+	if (plan->operation != CMD_UPDATE && plan->operation != CMD_DELETE)
+		return false;
+	if (plan->returningLists != NIL)
+		return false;
+	if (!IsA(subplan, ForeignScan) || subplan->qual != NIL)
+		return false;
 
-	prepare_query_params(node);
-	setup_shared_memory(pss);
-}
+	fscan = (ForeignScan *) subplan;
+	if (fscan->scan.scanrelid != resultRelation)
+		return false;
 
-static HeapTuple
-handle_tuple(char *tuple_data, HBaseFdwTableInfo *table_info, TupleDesc desc)
-{
-	Datum *values = palloc0(sizeof(*values) * desc->natts);
-	bool *nulls = palloc0(sizeof(bool) * desc->natts);
-	size_t cur_tuple_offset = 0;
-	size_t datum_len = *(int*)(tuple_data + cur_tuple_offset);
-	HeapTuple tuple;
-	int i = 0;
+	table_info = get_table_info(rte->relid);
+	params = list_copy(fscan->fdw_exprs);
+	param_types = list_copy(lsecond(fscan->fdw_private));
+	update_param = palloc(sizeof(int) * table_info->num_columns);
+	for (int i = 0; i < table_info->num_columns; i++)
+		update_param[i] = -1;
 
-	memset(nulls, true, desc->natts);
+	if (plan->operation == CMD_UPDATE)
+	{
+		int col = -1;
 
-	while (datum_len != 0) {
-		if (datum_len == 4)
-		{
-			nulls[i] = true;
-			values[i] = PointerGetDatum(NULL);
-		}
-		else
+		while ((col = bms_next_member(rte->updatedCols, col)) >= 0)
 		{
-			nulls[i] = false;
-			values[i] = PointerGetDatum(tuple_data + cur_tuple_offset + 4);
+			AttrNumber attnum = col + FirstLowInvalidHeapAttributeNumber;
+			HBaseColumn *hcol;
+			TargetEntry *tle;
+			int index;
+
+			if (attnum <= InvalidAttrNumber)
+				return false;
+			hcol = &table_info->columns[attnum - 1];
+			if (!hcol->column)
+				return false;
+
+			tle = get_tle_by_resno(subplan->targetlist, attnum);
+			if (tle == NULL)
+				return false;
+			if (!IsA(tle->expr, Const) &&
+				!(IsA(tle->expr, Param) && ((Param *) tle->expr)->paramkind == PARAM_EXTERN))
+				return false;
+
+			index = add_param(&params, (Node *) tle->expr);
+			if (index == list_length(param_types))
+				param_types = lappend(param_types, makeInteger(hcol->value_type));
+			update_param[attnum - 1] = index;
 		}
-		i++;
-		cur_tuple_offset += datum_len;
-		datum_len = *(int*)(tuple_data + cur_tuple_offset);
-	};
+	}
+
+	for (int i = 0; i < table_info->num_columns; i++)
+		update_params = lappend(update_params, makeInteger(update_param[i]));
+
+	fscan->operation = plan->operation;
+	fscan->fdw_exprs = params;
+	fscan->fdw_private = list_make4(linitial(fscan->fdw_private),
+									param_types,
+									update_params,
+									makeInteger(plan->canSetTag));
+	return true;
+}
 
-	tuple = heap_form_tuple(desc, values, nulls);
+static void
+hbaseBeginDirectModify(ForeignScanState *node, int eflags)
+{
+	ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
+	HBaseFdwPrivateScanState *pss;
+	List *update_params = lthird(fsplan->fdw_private);
+	ListCell *lc;
+	int i = 0;
 
-	HeapTupleHeaderSetXmax(tuple->t_data, InvalidTransactionId);
-	HeapTupleHeaderSetXmin(tuple->t_data, InvalidTransactionId);
-	HeapTupleHeaderSetCmin(tuple->t_data, InvalidTransactionId);
+	hbaseBeginForeignScan(node, eflags);
+	pss = node->fdw_state;
+	if (pss == NULL)
+		return;
 
-	return tuple;
+	pss->operation = operation_direct_modify;
+	pss->mutation_type = fsplan->operation == CMD_UPDATE ?
+		mutation_type_update : mutation_type_delete;
+	pss->update_params = palloc(sizeof(int) * list_length(update_params));
+	foreach (lc, update_params)
+		pss->update_params[i++] = intVal(lfirst(lc));
+	pss->set_processed = intVal(lfourth(fsplan->fdw_private));
 }
 
+/* Does all the work on the first call, and never returns a row */
 static TupleTableSlot *
-hbaseIterateForeignScan(ForeignScanState *node)
+hbaseIterateDirectModify(ForeignScanState *node)
 {
-	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
 	HBaseFdwPrivateScanState *pss = node->fdw_state;
-	Size len;
+	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
 	HBaseFdwMessage *message;
+	Size len;
 	shm_mq_result res;
-	TupleDesc desc;
+	int64 rows;
 
-	if (!pss->worker_started)
-		start_external_worker(node);
+	if (pss->worker_started)
+		return ExecClearTuple(slot);
+
+	start_external_worker(node);
 
-	desc = RelationGetDescr(node->ss.ss_currentRelation);
-	res = shm_mq_receive(pss->mq_handle, &len, (void**)&message, false);
+	report_wait_start(wait_event_modify_reply);
+	res = shm_mq_receive(pss->mq_handle, &len, (void **) &message, false);
+	report_wait_end();
 	if (res == SHM_MQ_DETACHED)
-	{
 		elog(ERROR, "Subprocess lost connection");
-	}
 
 	switch (message->msg_type)
 	{
 		case msg_type_end_of_stream:
-			return ExecClearTuple(slot);
-		case msg_type_tuple:
-			{
-				HeapTuple tuple = handle_tuple(message->data, pss->table_info, desc);
-				ExecStoreTuple(tuple, slot, InvalidBuffer, false);
-				return slot;
-			}
+			memcpy(&rows, message->data, sizeof(rows));
+			if (pss->set_processed)
+				node->ss.ps.state->es_processed += rows;
+			break;
+		case msg_type_error:
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_ERROR),
+					 errmsg("HBase %s failed: %.*s",
+							pss->mutation_type == mutation_type_update ? "update" : "delete",
+							(int) message->data_len, message->data)));
 		default:
 			elog(ERROR, "Unknown message");
 	}
+
+	return ExecClearTuple(slot);
 }
 
 static void
-hbaseReScanForeignScan(ForeignScanState *node)
+hbaseEndDirectModify(ForeignScanState *node)
 {
+	hbaseEndForeignScan(node);
 }
 
 static void
-hbaseEndForeignScan(ForeignScanState *node)
+hbaseExplainDirectModify(ForeignScanState *node, ExplainState *es)
 {
-	HBaseFdwPrivateScanState *pss = node->fdw_state;
-	/* if fsstate is NULL, we are in EXPLAIN; nothing to do */
-	if (pss == NULL)
-		return;
-
-	dsm_detach(pss->seg);
+	if (es->verbose)
+	{
+		explain_hbase_request(node, es);
+		explain_key_range(es);
+	}
 }
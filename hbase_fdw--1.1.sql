@@ -0,0 +1,73 @@
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION hbase_fdw" to load this file. \quit
+
+CREATE FUNCTION hbase_fdw_handler()
+RETURNS fdw_handler
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FOREIGN DATA WRAPPER hbase_fdw
+  HANDLER hbase_fdw_handler;
+
+CREATE FUNCTION hbase_fdw_status(
+  OUT connector_state text,
+  OUT prewarmed_tables integer,
+  OUT prewarm_failures integer,
+  OUT prewarmed_regions bigint)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION hbase_fdw_stat_activity(
+  OUT slot integer,
+  OUT backend_pid integer,
+  OUT relid oid,
+  OUT hbase_table text,
+  OUT operation text,
+  OUT state text,
+  OUT started timestamptz,
+  OUT rows bigint,
+  OUT bytes bigint,
+  OUT hbase_time float8,
+  OUT blocked_time float8,
+  OUT queue_wait float8,
+  OUT thread integer)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE VIEW hbase_fdw_stat_activity AS
+  SELECT * FROM hbase_fdw_stat_activity();
+
+CREATE FUNCTION hbase_fdw_stat_workers(
+  OUT slots integer,
+  OUT slots_in_use integer,
+  OUT scans bigint,
+  OUT modifies bigint,
+  OUT cancelled bigint,
+  OUT failed bigint,
+  OUT rows bigint,
+  OUT bytes bigint,
+  OUT hbase_time float8,
+  OUT blocked_time float8,
+  OUT queue_wait float8,
+  OUT duration_histogram bigint[],
+  OUT queue_wait_histogram bigint[])
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE VIEW hbase_fdw_stat_workers AS
+  SELECT * FROM hbase_fdw_stat_workers();
+
+CREATE FUNCTION hbase_fdw_stat_threads(
+  OUT thread integer,
+  OUT state text,
+  OUT scans integer)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE VIEW hbase_fdw_stat_threads AS
+  SELECT * FROM hbase_fdw_stat_threads();
@@ -10,11 +10,13 @@
 #include "storage/lwlock.h"
 #include "storage/proc.h"
 #include "storage/dsm.h"
+#include "storage/fd.h"
 #include "fmgr.h"
 #include "utils/guc.h"
 #include "utils/resowner.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 PG_MODULE_MAGIC;
@@ -34,6 +36,18 @@ static volatile sig_atomic_t got_sigterm = false;
 
 static char *java_home;
 static char *java_classpath;
+static char *prewarm_tables;
+static char *jvm_options;
+static char *jvm_cds_archive;
+
+int hbase_fdw_min_queue_size;
+int hbase_fdw_max_queue_size;
+int hbase_fdw_total_queue_size;
+
+bool hbase_fdw_worker_heap_tuples;
+bool hbase_fdw_bulk_load;
+
+int hbase_fdw_startup_timeout;
 
 // static dsm_segment_handle hbase_fdw_segment_handle;
 
@@ -43,6 +57,12 @@ char *candidate_paths[] = {
 	NULL
 };
 
+char *java_bin_paths[] = {
+	"bin/java",
+	"jre/bin/java",
+	NULL
+};
+
 void
 _PG_init(void)
 {
@@ -71,6 +91,127 @@ _PG_init(void)
 		NULL,
 		NULL);
 
+	DefineCustomStringVariable(
+		"hbase_fdw.jvm_options",
+		"Extra options for the worker's JVM",
+		"Separated by whitespace, and applied after the defaults, so -Xmx overrides the default heap size.",
+		&jvm_options,
+		NULL,
+		PGC_POSTMASTER,
+		0,
+		NULL,
+		NULL,
+		NULL);
+
+	DefineCustomStringVariable(
+		"hbase_fdw.jvm_cds_archive",
+		"Class data sharing archive for the worker's JVM",
+		"If the archive doesn't exist, the JVM records the classes it loads next to it, "
+		"and the archive is built from that list on the next start.  Needs a JVM with "
+		"application class data sharing; on Java 8 add -XX:+UnlockCommercialFeatures -XX:+UseAppCDS to hbase_fdw.jvm_options.",
+		&jvm_cds_archive,
+		NULL,
+		PGC_POSTMASTER,
+		0,
+		NULL,
+		NULL,
+		NULL);
+
+	DefineCustomStringVariable(
+		"hbase_fdw.prewarm_tables",
+		"HBase tables whose region locations are looked up at startup",
+		"Comma separated list.  Scans wait until the worker has connected to HBase and looked these up, for up to hbase_fdw.startup_timeout.",
+		&prewarm_tables,
+		NULL,
+		PGC_POSTMASTER,
+		0,
+		NULL,
+		NULL,
+		NULL);
+
+	DefineCustomIntVariable(
+		"hbase_fdw.startup_timeout",
+		"How long scans wait for the worker to connect to HBase",
+		"Prewarming stops at this point, and scans fail if the worker hasn't got that far.",
+		&hbase_fdw_startup_timeout,
+		60000,
+		1000,
+		INT_MAX,
+		PGC_POSTMASTER,
+		GUC_UNIT_MS,
+		NULL,
+		NULL,
+		NULL);
+
+	DefineCustomIntVariable(
+		"hbase_fdw.min_queue_size",
+		"Smallest tuple queue allocated for a scan",
+		NULL,
+		&hbase_fdw_min_queue_size,
+		64,
+		16,
+		1048576,
+		PGC_USERSET,
+		GUC_UNIT_KB,
+		NULL,
+		NULL,
+		NULL);
+
+	DefineCustomIntVariable(
+		"hbase_fdw.max_queue_size",
+		"Largest tuple queue allocated for a scan",
+		NULL,
+		&hbase_fdw_max_queue_size,
+		16384,
+		16,
+		1048576,
+		PGC_USERSET,
+		GUC_UNIT_KB,
+		NULL,
+		NULL,
+		NULL);
+
+	DefineCustomIntVariable(
+		"hbase_fdw.total_queue_size",
+		"Tuple queue memory shared by all active scans",
+		"Scans that find the budget exhausted fall back to hbase_fdw.min_queue_size.",
+		&hbase_fdw_total_queue_size,
+		262144,
+		16,
+		INT_MAX,
+		PGC_SIGHUP,
+		GUC_UNIT_KB,
+		NULL,
+		NULL,
+		NULL);
+
+	DefineCustomBoolVariable(
+		"hbase_fdw.worker_heap_tuples",
+		"Have the worker send rows as ready-made heap tuples",
+		NULL,
+		&hbase_fdw_worker_heap_tuples,
+		false,
+		PGC_USERSET,
+		0,
+		NULL,
+		NULL,
+		NULL);
+
+	DefineCustomBoolVariable(
+		"hbase_fdw.bulk_load",
+		"Have INSERTs into HBase tables write HFiles and bulk load them",
+		"Rows only become visible once the statement completes.  "
+		"Tables can also enable this with their bulk_load option.",
+		&hbase_fdw_bulk_load,
+		false,
+		PGC_USERSET,
+		0,
+		NULL,
+		NULL,
+		NULL);
+
+	init_table_hooks();
+
 	if (!process_shared_preload_libraries_in_progress)
 		return;
 
@@ -79,6 +220,9 @@ _PG_init(void)
 	startup_background_worker();
 }
 
+/* Seconds before the postmaster starts a bgworker that exited again */
+#define HBASE_FDW_RESTART_INTERVAL 10
+
 static void
 startup_background_worker()
 {
@@ -87,7 +231,7 @@ startup_background_worker()
 
 	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
 	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
-	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	worker.bgw_restart_time = HBASE_FDW_RESTART_INTERVAL;
 	worker.bgw_main = NULL;
 	sprintf(worker.bgw_library_name, "hbase_fdw");
 	sprintf(worker.bgw_function_name, "hbase_fdw_main");
@@ -98,6 +242,122 @@ startup_background_worker()
 	RegisterBackgroundWorker(&worker);
 }
 
+/* Returns the first of the candidates that exists under java_home, or NULL */
+static char *
+find_in_java_home(char **candidates)
+{
+	size_t len = strlen(java_home);
+	const char *sep = len > 0 && java_home[len - 1] == '/' ? "" : "/";
+
+	for (int i = 0; candidates[i] != NULL; i++)
+	{
+		char *path = psprintf("%s%s%s", java_home, sep, candidates[i]);
+
+		if (file_exists(path))
+			return path;
+		pfree(path);
+	}
+	return NULL;
+}
+
+/*
+ * Build a class data sharing archive from the class list recorded by an
+ * earlier run, using the java launcher's -Xshare:dump.  Failures only cost
+ * us the faster startup, so they are logged and otherwise ignored.
+ */
+static void
+dump_cds_archive(char *class_list, List *options)
+{
+	char *java_bin = find_in_java_home(java_bin_paths);
+	char **argv;
+	ListCell *lc;
+	pid_t pid;
+	int status;
+	int n = 0;
+
+	if (java_bin == NULL)
+	{
+		elog(WARNING, "Failed to find the java launcher, not creating %s", jvm_cds_archive);
+		return;
+	}
+
+	argv = palloc0(sizeof(char *) * (list_length(options) + 7));
+	argv[n++] = java_bin;
+	foreach(lc, options)
+		argv[n++] = lfirst(lc);
+	argv[n++] = "-Xshare:dump";
+	argv[n++] = psprintf("-XX:SharedClassListFile=%s", class_list);
+	argv[n++] = psprintf("-XX:SharedArchiveFile=%s", jvm_cds_archive);
+	argv[n++] = "-cp";
+	argv[n++] = java_classpath;
+
+	elog(LOG, "Creating class data sharing archive %s", jvm_cds_archive);
+	pid = fork();
+	if (pid == 0)
+	{
+		execv(java_bin, argv);
+		_exit(127);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) < 0)
+		elog(WARNING, "Failed to run %s: %m", java_bin);
+	else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		elog(WARNING, "Creating class data sharing archive %s failed with status %d",
+			 jvm_cds_archive, status);
+	pfree(argv);
+}
+
+/*
+ * The built in defaults come first, so hbase_fdw.jvm_options can override
+ * them, including the spill directory and limit.  With
+ * hbase_fdw.jvm_cds_archive set, a missing archive is built from the classes
+ * the previous run recorded, or if there is no record yet, this run records
+ * them.
+ */
+static List *
+jvm_option_list(void)
+{
+	List *options = list_make3("-Xrs", "-Xusealtsigs", "-Xmx1024M");
+	char *class_list;
+
+	/* Scans spill where the server keeps temp files, and so cleans them up */
+	options = lappend(options, psprintf("-Dhbase.fdw.spill.dir=%s/base/%s",
+										DataDir, PG_TEMP_FILES_DIR));
+	/* temp_file_limit is per process, so all scans' spill files share it */
+	if (temp_file_limit >= 0)
+		options = lappend(options, psprintf("-Dhbase.fdw.spill.limit=" INT64_FORMAT,
+											(int64) temp_file_limit * 1024));
+
+	if (jvm_options != NULL)
+	{
+		char *opts = pstrdup(jvm_options);
+		char *saveptr;
+
+		for (char *opt = strtok_r(opts, " \t\n", &saveptr);
+			 opt != NULL;
+			 opt = strtok_r(NULL, " \t\n", &saveptr))
+			options = lappend(options, opt);
+	}
+
+	if (jvm_cds_archive == NULL || jvm_cds_archive[0] == '\0')
+		return options;
+
+	class_list = psprintf("%s.classlist", jvm_cds_archive);
+	if (!file_exists(jvm_cds_archive) && file_exists(class_list))
+		dump_cds_archive(class_list, options);
+
+	if (file_exists(jvm_cds_archive))
+	{
+		options = lappend(options, "-Xshare:auto");
+		options = lappend(options, psprintf("-XX:SharedArchiveFile=%s", jvm_cds_archive));
+	}
+	else
+	{
+		elog(LOG, "Recording loaded classes in %s", class_list);
+		options = lappend(options, psprintf("-XX:DumpLoadedClassList=%s", class_list));
+	}
+	return options;
+}
+
 static void
 initialize_jvm(void)
 {
@@ -109,33 +369,13 @@ initialize_jvm(void)
 	if (!directory_exists(java_home))
 		elog(FATAL, "Directory %s does not exist", java_home);
 
-	for (int i = 0; candidate_paths[i] != NULL; i++)
-	{
-		char *path = end_path = palloc(strlen(java_home) + strlen(candidate_paths[i]) + 2);
-		if (path == NULL) {
-			elog(FATAL, "Failed to allocate memory for path");
-		}
-		strcpy(path, java_home);
-		path += strlen(java_home);
-		if (path[strlen(path) - 1] != '/')
-		{
-			strcpy(path, "/");
-			path += 1;
-		}
-		strcpy(path, candidate_paths[i]);
-		if (file_exists(end_path))
-			break;
-		pfree(end_path);
-
-		end_path = NULL;
-	}
-
+	end_path = find_in_java_home(candidate_paths);
 	if (end_path == NULL)
 		elog(FATAL, "Failed to find path to libjvm.so");
 
 	elog(INFO, "Found libjvm.so: %s", end_path);
 	open_jvm_lib(end_path);
-	create_java_vm(java_classpath);
+	create_java_vm(java_classpath, jvm_option_list());
 
 	pfree(end_path);
 }
@@ -181,6 +421,7 @@ hbase_fdw_main(Datum main_arg)
 {
 	int worker_num = DatumGetInt32(main_arg);
 	bool foundPtr;
+	TimestampTz deadline;
 	/* Establish signal handlers before unblocking signals. */
 	pqsignal(SIGHUP, hbase_fdw_sighup);
 	pqsignal(SIGTERM, hbase_fdw_sigterm);
@@ -193,18 +434,23 @@ hbase_fdw_main(Datum main_arg)
 
 	CurrentResourceOwner = ResourceOwnerCreate(NULL, "test_shm_mq worker");
 
-	setup_bgworker();
+	deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+										   hbase_fdw_startup_timeout);
+	setup_bgworker(deadline);
 	initialize_jvm();
 	initialize_hbase_connector();
+	prewarm_hbase_connector(prewarm_tables, deadline);
 	allocate_threads();
 
 	while (!got_sigterm) {
 		int rc;
 
+		report_wait_start(wait_event_bgworker_main);
 		rc = WaitLatch(
 			MyLatch,
 			WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
 			10000L);
+		report_wait_end();
 		ResetLatch(MyLatch);
 
 		if (rc & WL_POSTMASTER_DEATH)
@@ -213,7 +459,9 @@ hbase_fdw_main(Datum main_arg)
 			shutdown_jvm();
 			proc_exit(1);
 		}
+		wake_threads();
 		maintain_workers();
+		forget_dropped_tables();
 	}
 
 	shutdown_threads();
@@ -4,10 +4,15 @@
 #include <pthread.h>
 #include "storage/shm_mq.h"
 #include "storage/dsm.h"
+#include "port/atomics.h"
+#include "utils/timestamp.h"
 #include "nodes/pg_list.h"
 
+/* Worker threads, each of which serves any number of scans */
 #define HBASE_FDW_NUM_WORKERS 8
-#define HBASE_FDW_WORKMEM_PER_WORKER 1048576
+
+/* Scans that can be running at once, across all backends */
+#define HBASE_FDW_MAX_SCANS 64
 
 #define HBASE_FDW_MAX_FAMILY_LEN 31
 #define HBASE_FDW_MAX_QUALIFIER_LEN 255
@@ -15,32 +20,79 @@
 #define HBASE_FDW_MAX_HBASE_COLUMNS 64
 #define HBASE_FDW_MAX_TABLE_NAME_LEN 64
 
-#define HBASE_FDW_MAX_ROW_KEY_FILTER_LEN 128
-#define HBASE_FDW_MAX_FILTERS 16
-
 #define HBASE_FDW_SHM_TOC_MAGIC 0x4193cf19
 
+/*
+ * Size of the buffer the JVM serializes into.  Rows that don't fit are sent
+ * as several msg_type_tuple_chunk messages followed by a final
+ * msg_type_tuple, and are put back together by the backend.
+ */
+#define HBASE_FDW_CHUNK_SIZE 65536
+
 extern pthread_mutex_t postgres_mutex;
 extern void *hbase_connector;
 
+/* Queue sizing GUCs, all in kilobytes */
+extern int hbase_fdw_min_queue_size;
+extern int hbase_fdw_max_queue_size;
+extern int hbase_fdw_total_queue_size;
+
+extern bool hbase_fdw_worker_heap_tuples;
+extern bool hbase_fdw_bulk_load;
+
+/* Milliseconds scans wait for the bgworker to connect and prewarm */
+extern int hbase_fdw_startup_timeout;
+
+/* Per-thread cache of JNI classes and method IDs, private to jvm.c */
+typedef struct JniContext JniContext;
+
 typedef struct ScannerData
 {
-	void *scan;
 	void *scanner;
-	void *byte_array;
+	void *buffer;
 	char *ptr;
 } ScannerData;
 
+/* Must be kept in sync with the MSG_TYPE_* constants in HBaseToPgScanner */
 typedef enum HBaseFdwMsgType {
 	msg_type_tuple,
-	msg_type_end_of_stream
+	msg_type_end_of_stream,
+	msg_type_tuple_chunk,
+	msg_type_error,
+	msg_type_heap_tuple,
+
+	/* Sent by the backend to a modify worker */
+	msg_type_mutations,
+	msg_type_flush
 } HBaseFdwMsgType;
 
 typedef struct HBaseFdwMessage {
 	HBaseFdwMsgType msg_type;
+	uint32 data_len;
 	char data[FLEXIBLE_ARRAY_MEMBER];
 } HBaseFdwMessage;
 
+/* Must be kept in sync with the TYPE_* constants in PgValueCodec */
+typedef enum HBaseValueType {
+	value_type_text,
+	value_type_bytea,
+	value_type_int2,
+	value_type_int4,
+	value_type_int8,
+	value_type_float4,
+	value_type_float8,
+	value_type_bool,
+	value_type_timestamptz,
+	value_type_jsonb
+} HBaseValueType;
+
+/* How cell values are encoded in HBase, see PgValueCodec */
+typedef enum HBaseEncoding {
+	encoding_binary,
+	encoding_string,
+	encoding_phoenix
+} HBaseEncoding;
+
 typedef struct HBaseColumn {
 	int attnum;
 
@@ -48,34 +100,148 @@ typedef struct HBaseColumn {
 	bool family;
 	bool column;
 
+	/*
+	 * A component of a composite row key, found key_width bytes into the key
+	 * at key_offset.  A key_width of -1 takes the rest of the key.
+	 */
+	bool row_key_part;
+	int16 key_offset;
+	int16 key_width;
+
+	/* Physical layout of the attribute, for tuples built by the worker */
+	int16 attlen;
+	char attalign;
+
+	HBaseValueType value_type;
+	HBaseEncoding encoding;
+
 	char family_name[HBASE_FDW_MAX_FAMILY_LEN + 1];
 	char qualifier[HBASE_FDW_MAX_QUALIFIER_LEN + 1];
 } HBaseColumn;
 
 typedef struct HBaseFilter {
 	enum {
-		filter_type_row_key_equals
+		filter_type_row_key_equals,
+		filter_type_row_key_part,
+		filter_type_and,
+		filter_type_or,
+		filter_type_not,
+		filter_type_row_key_prefix
 	} filter_type;
 
+	/*
+	 * Boolean filters are followed by their nargs arguments, so a scan's
+	 * filters are the preorder walk of a list of trees, all of which must
+	 * hold.
+	 */
 	union {
 		struct {
-			char row_key[HBASE_FDW_MAX_ROW_KEY_FILTER_LEN + 1];
+			int nargs;
+		} bool_expr;
+		struct {
+			int param;			/* index into the scan's parameter values */
 		} row_key_equals;
+		struct {
+			int param;
+		} row_key_prefix;
+		struct {
+			int column;			/* index of the key component's column */
+			int strategy;		/* btree strategy of the comparison */
+			int param;
+			HBaseValueType param_type;
+		} row_key_part;
 	};
 } HBaseFilter;
 
-typedef struct HBasePreparedFilter {
-	List *params;
-	int *param_nums;
-	HBaseFilter filter;
-} HBasePreparedFilter;
+/*
+ * Parameter values are sent to the worker back to back, each one a length
+ * word followed by the value's bytes: the data of a varlena, or the native
+ * representation of a fixed width type.  A length of -1 means NULL.
+ */
+typedef struct HBaseParamValue {
+	int32 len;
+	char data[FLEXIBLE_ARRAY_MEMBER];
+} HBaseParamValue;
+
+#define HBASE_FDW_PARAM_SIZE(len) \
+	INTALIGN(offsetof(HBaseParamValue, data) + Max((len), 0))
+
+/* Length of a column value that a mutation leaves alone */
+#define HBASE_FDW_PARAM_UNSET -2
+
+/*
+ * A msg_type_mutations message holds a batch of mutations, each an int32
+ * HBaseMutationType followed by one HBaseParamValue per column.  Must be kept
+ * in sync with the MUTATION_* constants in PgToHBaseMutator.
+ */
+typedef enum HBaseMutationType {
+	mutation_type_insert,
+	mutation_type_update,
+	mutation_type_delete
+} HBaseMutationType;
+
+typedef enum HBaseOperation {
+	operation_scan,
+	operation_modify,
+	operation_direct_modify
+} HBaseOperation;
 
 typedef struct HBaseCommand {
 	char table_name[HBASE_FDW_MAX_TABLE_NAME_LEN + 1];
+
+	/*
+	 * A modify worker receives msg_type_mutations batches on a second queue,
+	 * and answers a msg_type_flush with msg_type_end_of_stream once they have
+	 * all been written, or with an error.
+	 *
+	 * A direct modify worker applies mutation_type to every row the filters
+	 * match, without sending the rows, and ends with a msg_type_end_of_stream
+	 * holding the int64 count of rows changed.  The values an update sets
+	 * follow the filters' parameters, one HBaseParamValue per column.
+	 */
+	HBaseOperation operation;
+	HBaseMutationType mutation_type;
+
+	/*
+	 * Have a modify worker write HFiles and load them into the table when
+	 * flushed, rather than sending the rows to the region servers.
+	 */
+	bool bulk_load;
+
+	/* Key of the JVM's cached column descriptors for this table */
+	Oid dboid;
+	Oid relid;
+	uint32 options_version;
+
 	int nr_filters;
 	int nr_columns;
+	int nr_params;
+
+	/* Milliseconds the worker may wait on each HBase request, 0 for no limit */
+	int timeout_ms;
+
+	/* Send complete heap tuples instead of a list of datums */
+	bool heap_tuples;
+
+	/* End a scan with its HBaseScanMetrics, for EXPLAIN ANALYZE */
+	bool collect_metrics;
 } HBaseCommand;
 
+/*
+ * The msg_type_end_of_stream of a scan with collect_metrics holds the HBase
+ * client's ScanMetrics, followed by the scan's start and stop rows in
+ * printable form, each an int32 length and that many bytes.  Must be kept in
+ * sync with HBaseToPgScanner.writeMetrics.
+ */
+typedef struct HBaseScanMetrics {
+	int64 rpcs;
+	int64 remote_rpcs;
+	int64 rpc_retries;
+	int64 regions;
+	int64 result_bytes;
+	char row_range[FLEXIBLE_ARRAY_MEMBER];
+} HBaseScanMetrics;
+
 #define with_pg_lock(ARG) \
    do { \
       pthread_mutex_lock(&postgres_mutex);  \
@@ -92,32 +258,43 @@ typedef struct HBaseCommand {
 	with_pg_lock(pfree(VAR))
 
 
-void *jvm_attach_thread(void);
-void jvm_detach_thread(void);
+JniContext *jvm_attach_thread(int thread);
+void jvm_detach_thread(JniContext *ctx);
 
 ScannerData
 setup_scanner(
-	void *env_,
-	char *table,
+	JniContext *ctx,
+	HBaseCommand *command,
 	HBaseColumn *columns,
-	int nr_columns,
 	HBaseFilter *filters,
-	int nr_filters);
+	char *params);
 void
-destroy_scanner(void *env_, ScannerData *scanner_data);
-bool
-scan_row(void *env, ScannerData *data);
+destroy_scanner(JniContext *ctx, ScannerData *scanner_data);
+ScannerData
+setup_mutator(JniContext *ctx, HBaseCommand *command, HBaseColumn *columns);
+int
+apply_mutations(JniContext *ctx, ScannerData *data, char *batch, Size len);
+int
+start_flush(JniContext *ctx, ScannerData *data);
+int
+poll_mutator(JniContext *ctx, ScannerData *data, bool *busy);
+int
+poll_row(JniContext *ctx, ScannerData *data);
+
+/* From poll_row: the scanner got something done, but has no message yet */
+#define HBASE_FDW_POLL_AGAIN (-2)
 
 void *
-create_pg_hbase_columns(void *env_,
+create_pg_hbase_columns(JniContext *ctx,
 						HBaseColumn *columns,
 						size_t n_columns);
-void
-free_local_jvm_obj(void *env_, void *object);
 
 void pg_jsonb(void *env_, char *s);
 
 void initialize_hbase_connector(void);
+void prewarm_hbase_connector(char *tables, TimestampTz deadline);
+void forget_table_template(Oid dboid, Oid relid);
+void init_table_hooks(void);
 void destroy_hbase_connector(void);
 
 void allocate_threads(void);
@@ -126,25 +303,107 @@ void shutdown_threads(void);
 void
 thread_start_worker(int n,
 					shm_mq_handle *tuples_mq,
+					shm_mq_handle *mutations_mq,
 					HBaseCommand *command,
 					HBaseColumn *columns,
-					HBaseFilter *filters);
+					HBaseFilter *filters,
+					char *params);
 void thread_reset_worker(int n);
-bool thread_is_working(int n);
+void wake_thread(int n);
+void wake_threads(void);
 
-void setup_bgworker(void);
+void setup_bgworker(TimestampTz deadline);
 void maintain_workers(void);
 void initialize_shared_memory(void);
 void open_jvm_lib(char *libjvm_path) ;
-void create_java_vm(char *classpath);
+void create_java_vm(char *classpath, List *jvm_options);
 void do_jvm_op(void);
 void destroy_java_vm(void);
 void close_jvm_lib(void);
 
 void pg_datum(void *env, char *s);
 
+Size reserve_queue_memory(Size wanted);
+void release_queue_memory(Size size);
+
+/* How far the bgworker got in setting up its HBase connection */
+typedef enum HBaseConnectorState {
+	connector_state_starting,
+	connector_state_connected,
+	connector_state_unavailable,	/* scans will retry connecting */
+	connector_state_stopped			/* the bgworker exited, scans fail */
+} HBaseConnectorState;
+
+void set_connector_state(HBaseConnectorState state);
+void record_prewarmed_table(bool success, int regions);
+
+/* What the scan in a slot is doing, as shown by hbase_fdw_stat_activity */
+typedef enum HBaseScanState {
+	scan_state_idle,
+	scan_state_queued,		/* waiting for the bgworker to pick it up */
+	scan_state_hbase,		/* waiting for HBase */
+	scan_state_blocked,		/* waiting for the backend to read or write its queue */
+	scan_state_running
+} HBaseScanState;
+
+/*
+ * Counters of the scan in a slot.  Only the worker thread serving the scan
+ * writes them, anyone may read them.
+ */
+typedef struct HBaseScanStats {
+	pg_atomic_uint32 state;
+	int thread;						/* serving the scan, -1 while queued */
+	pg_atomic_uint64 rows;
+	pg_atomic_uint64 bytes;
+	pg_atomic_uint64 hbase_us;		/* time spent waiting for HBase */
+	pg_atomic_uint64 blocked_us;	/* and for the backend */
+} HBaseScanStats;
+
+/* Latency histograms have power of two buckets: <1ms, <2ms, <4ms, ... */
+#define HBASE_FDW_HISTOGRAM_BUCKETS 20
+
+HBaseScanStats *
+scan_stats(int n);
+void
+record_scan_finished(int n, uint64 duration_us, bool cancelled, bool failed);
+
+/* What each worker thread is doing, as shown by hbase_fdw_stat_threads */
+void
+set_thread_state(int thread, HBaseScanState state);
+
+/*
+ * What a backend, or the bgworker, is waiting for.  Postgres 9.6 has no wait
+ * events for extensions, so each is reported as an LWLock tranche wait
+ * under the tranche names in process_communication.c.
+ */
+typedef enum HBaseWaitEvent {
+	wait_event_admission,		/* for a free slot */
+	wait_event_first_row,
+	wait_event_next_row,
+	wait_event_send_mutations,	/* for room in the mutations queue */
+	wait_event_modify_reply,	/* for a flush or a direct modify to finish */
+	wait_event_bgworker_main,	/* the bgworker, for something to do */
+	num_wait_events
+} HBaseWaitEvent;
+
+void
+report_wait_start(HBaseWaitEvent event);
+void
+report_wait_end(void);
+
+/* Returned by activate_worker when waiting for a slot is pointless */
+#define HBASE_FDW_WORKER_UNAVAILABLE (-2)
+
+int
+activate_worker(dsm_handle handle, TimestampTz requested);
+void
+forget_table(Oid dboid, Oid relid);
+void
+forget_dropped_tables(void);
+void
+cancel_worker(int n, dsm_handle handle);
 bool
-activate_worker(dsm_handle handle);
+worker_cancelled(int n);
 void
 reset_worker(int n);
 
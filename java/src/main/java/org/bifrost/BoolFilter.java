@@ -0,0 +1,60 @@
+package org.bifrost;
+
+import java.util.ArrayList;
+import java.util.List;
+
+/**
+ * AND, OR or NOT of other filters.  Comparisons on row key components are
+ * only meaningful together, so those directly under an AND are combined
+ * into one range.
+ */
+public class BoolFilter implements HBaseFilter {
+    // Must be kept in sync with the filter types in hbase_fdw.h
+    static final int FILTER_TYPE_AND = 2;
+    static final int FILTER_TYPE_OR = 3;
+    static final int FILTER_TYPE_NOT = 4;
+
+    final int type;
+    final int nargs;
+    final List<HBaseFilter> args = new ArrayList<>();
+
+    /** An nargs of -1 takes any number of arguments. */
+    BoolFilter(int type, int nargs) {
+        this.type = type;
+        this.nargs = nargs;
+    }
+
+    boolean isComplete() {
+        return nargs >= 0 && args.size() >= nargs;
+    }
+
+    @Override
+    public KeyRanges keyRanges(TableTemplate table) {
+        switch (type) {
+            case FILTER_TYPE_AND: {
+                KeyRanges result = KeyRanges.ALL;
+                RowKeyPartsFilter parts = null;
+                for (HBaseFilter arg : args) {
+                    if (arg instanceof RowKeyPartsFilter) {
+                        if (parts == null)
+                            parts = new RowKeyPartsFilter();
+                        parts.addAll((RowKeyPartsFilter) arg);
+                    } else {
+                        result = result.intersect(arg.keyRanges(table));
+                    }
+                }
+                return parts == null ? result : result.intersect(parts.keyRanges(table));
+            }
+            case FILTER_TYPE_OR: {
+                KeyRanges result = KeyRanges.NONE;
+                for (HBaseFilter arg : args)
+                    result = result.union(arg.keyRanges(table));
+                return result;
+            }
+            case FILTER_TYPE_NOT:
+                return args.get(0).keyRanges(table).complement();
+            default:
+                throw new IllegalArgumentException("Unknown filter type " + type);
+        }
+    }
+}
@@ -1,80 +1,317 @@
 package org.bifrost;
 
 import org.apache.hadoop.conf.Configuration;
+import org.apache.hadoop.fs.Path;
 import org.apache.hadoop.hbase.Cell;
 import org.apache.hadoop.hbase.CellUtil;
 import org.apache.hadoop.hbase.HBaseConfiguration;
 import org.apache.hadoop.hbase.KeyValue;
 import org.apache.hadoop.hbase.TableName;
+import org.apache.hadoop.hbase.client.BufferedMutator;
 import org.apache.hadoop.hbase.client.Connection;
 import org.apache.hadoop.hbase.client.ConnectionFactory;
+import org.apache.hadoop.hbase.client.HTable;
+import org.apache.hadoop.hbase.client.RegionLocator;
 import org.apache.hadoop.hbase.client.Result;
 import org.apache.hadoop.hbase.client.ResultScanner;
 import org.apache.hadoop.hbase.client.Scan;
 import org.apache.hadoop.hbase.client.Table;
 import org.apache.hadoop.hbase.filter.Filter;
+import org.apache.hadoop.hbase.filter.FilterList;
+import org.apache.hadoop.hbase.filter.FirstKeyOnlyFilter;
+import org.apache.hadoop.hbase.filter.KeyOnlyFilter;
 
+import java.io.File;
 import java.io.IOException;
+import java.io.InterruptedIOException;
 import java.nio.ByteBuffer;
 import java.nio.ByteOrder;
 import java.util.Arrays;
 import java.util.Map;
 import java.util.NavigableSet;
+import java.util.concurrent.Callable;
+import java.util.concurrent.ConcurrentHashMap;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.FutureTask;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.TimeoutException;
 
 public class HBaseConnector {
+    /** Maximum number of cells per result, so wide rows arrive in pieces. */
+    public static final String SCAN_BATCH_KEY = "hbase.fdw.scan.batch";
+    public static final int DEFAULT_SCAN_BATCH = 1000;
+
+    /** Bytes of results each scan reads ahead of the worker into memory. */
+    public static final String PREFETCH_BYTES_KEY = "hbase.fdw.prefetch.bytes";
+    public static final long DEFAULT_PREFETCH_BYTES = 8L << 20;
+
+    /** Bytes each scan may read ahead into temp files once memory is full. */
+    public static final String SPILL_BYTES_KEY = "hbase.fdw.spill.bytes";
+    public static final long DEFAULT_SPILL_BYTES = 1L << 30;
+
+    /** Bytes all scans together may spill. */
+    public static final String SPILL_TOTAL_BYTES_KEY = "hbase.fdw.spill.total.bytes";
+    public static final long DEFAULT_SPILL_TOTAL_BYTES = 16L << 30;
+
+    /** System property naming the directory for spill files, set by the bgworker. */
+    public static final String SPILL_DIR_PROPERTY = "hbase.fdw.spill.dir";
+
+    /** System property with the bgworker's temp_file_limit in bytes, which also caps spilling. */
+    public static final String SPILL_LIMIT_PROPERTY = "hbase.fdw.spill.limit";
+
+    /** Directory in which bulk loads write their HFiles, on HBase's file system. */
+    public static final String BULK_LOAD_DIR_KEY = "hbase.fdw.bulkload.dir";
+    public static final String DEFAULT_BULK_LOAD_DIR = "/tmp/hbase-fdw-bulkload";
+
+    /** Bytes of cells each bulk load sorts in memory before writing HFiles. */
+    public static final String BULK_LOAD_BUFFER_BYTES_KEY = "hbase.fdw.bulkload.buffer.bytes";
+    public static final long DEFAULT_BULK_LOAD_BUFFER_BYTES = 64L << 20;
+
+    /** Threads shared by all scans for talking to region servers. */
+    public static final String FETCH_THREADS_KEY = "hbase.fdw.fetch.threads";
+    public static final int DEFAULT_FETCH_THREADS = 8;
+
+    /** Threads shared by all writes for calls into their BufferedMutators. */
+    public static final String WRITE_THREADS_KEY = "hbase.fdw.write.threads";
+    public static final int DEFAULT_WRITE_THREADS = 8;
+
     private final Configuration conf;
     private Connection conn;
 
+    // Prepared column descriptors and scans, keyed by database and foreign table OID
+    private final ConcurrentHashMap<Long, TableTemplate> tables = new ConcurrentHashMap<>();
+
+    // Runs the fetches of every active scan
+    private final ExecutorService fetchers;
+
+    // Run the BufferedMutator calls of every active write
+    private final ExecutorService writers;
+
+    // Shared by the spill files of every scan
+    private final SpillQueue.Budget spillBudget;
+
     public HBaseConnector() {
         conf = HBaseConfiguration.create();
+        fetchers = Executors.newFixedThreadPool(
+            Math.max(1, conf.getInt(FETCH_THREADS_KEY, DEFAULT_FETCH_THREADS)), r -> {
+                Thread t = new Thread(r, "hbase-fdw-fetch");
+                t.setDaemon(true);
+                return t;
+            });
+        writers = Executors.newFixedThreadPool(
+            Math.max(1, conf.getInt(WRITE_THREADS_KEY, DEFAULT_WRITE_THREADS)), r -> {
+                Thread t = new Thread(r, "hbase-fdw-write");
+                t.setDaemon(true);
+                return t;
+            });
+
+        long spillTotal = conf.getLong(SPILL_TOTAL_BYTES_KEY, DEFAULT_SPILL_TOTAL_BYTES);
+        final String tempFileLimit = System.getProperty(SPILL_LIMIT_PROPERTY);
+        if (tempFileLimit != null && (spillTotal < 0 || Long.parseLong(tempFileLimit) < spillTotal))
+            spillTotal = Long.parseLong(tempFileLimit);
+        spillBudget = new SpillQueue.Budget(spillTotal);
     }
 
-    private boolean fetchData(final Scan scan,  final HBaseFilterCreator creator, final PgHbaseColumn[] columns) {
-        for (PgHbaseColumn column: columns) {
-            if (column.row) continue;
-            if (column.family) {
-                scan.addFamily(column.familyName);
-            }
-            if (column.qualifier) {
-                Map<byte[], NavigableSet<byte[]>> familyMap = scan.getFamilyMap();
-                if (!familyMap.containsKey(column.familyName) ||
-                    familyMap.get(column.familyName) != null)
-                    scan.addColumn(column.familyName, column.qualifierName);
-            }
+    /**
+     * Returns the cached template for a foreign table, or null if there is
+     * none or the table's options changed since it was built.
+     */
+    public TableTemplate getTable(final int dboid, final int relid, final int version) {
+        TableTemplate table = tables.get(tableKey(dboid, relid));
+        if (table == null || table.version != version) {
+            return null;
         }
+        return table;
+    }
+
+    public TableTemplate registerTable(final int dboid, final int relid, final int version,
+                                       final byte[] tableName, final PgHbaseColumn[] columns) {
+        final Scan scan = new Scan();
+        scan.setBatch(conf.getInt(SCAN_BATCH_KEY, DEFAULT_SCAN_BATCH));
+        scan.setAllowPartialResults(true);
+
+        TableTemplate table = new TableTemplate(version, tableName, columns, scan);
+        tables.put(tableKey(dboid, relid), table);
+        return table;
+    }
 
-        if (!creator.applyFilters(scan)) {
-            return false;
+    /**
+     * Drops the template of a table that was dropped or altered.  A dboid of
+     * 0 drops every template, for when the bgworker lost track.
+     */
+    public void forgetTable(final int dboid, final int relid) {
+        if (dboid == 0) {
+            tables.clear();
+        } else {
+            tables.remove(tableKey(dboid, relid));
         }
-        return true;
     }
 
-    public Scanner makeScanner(final byte[] tableName, final PgHbaseColumn[] columns, final HBaseFilterCreator filterCreator) throws IOException {
-        final Scan scan = new Scan();
-        boolean anyResults = fetchData(scan, filterCreator, columns);
-        if (!anyResults) {
-            return new HBaseToPgScanner(null, null, columns);
+    // OIDs are unsigned
+    private static long tableKey(final int dboid, final int relid) {
+        return ((dboid & 0xffffffffL) << 32) | (relid & 0xffffffffL);
+    }
+
+    /**
+     * Starts a scan.  With a positive timeoutMs, the scan fails once a fetch
+     * from HBase has taken that long, which stops HBase retries from holding
+     * on to the worker long after the query has given up.  With collectMetrics, the
+     * end of the scan reports its ScanMetrics, for EXPLAIN ANALYZE.
+     */
+    public Scanner makeScanner(final TableTemplate tableTemplate, final HBaseFilterCreator filterCreator,
+                               final boolean heapTuples, final int timeoutMs,
+                               final boolean collectMetrics) throws IOException {
+        final Scan scan = tableTemplate.newScan();
+        final PgHbaseColumn[] columns = tableTemplate.columns;
+        if (!filterCreator.applyFilters(scan, tableTemplate)) {
+            return new HBaseToPgScanner(null, null, columns, heapTuples, null);
+        }
+        scan.setScanMetricsEnabled(collectMetrics);
+
+        connect();
+
+        final Table table = conn.getTable(tableTemplate.tableName);
+        try {
+            if (timeoutMs > 0 && table instanceof HTable) {
+                ((HTable) table).setOperationTimeout(timeoutMs);
+            }
+            final ResultScanner scanner = table.getScanner(scan);
+            final PrefetchingScanner prefetcher = new PrefetchingScanner(scanner, newBuffer(), fetchers, timeoutMs);
+            return new HBaseToPgScanner(table, prefetcher, columns, heapTuples, collectMetrics ? scan : null);
+        } catch (Throwable t) {
+            table.close();
+            throw t;
         }
 
+    }
+
+    /**
+     * Starts a batch of writes to a table, see PgToHBaseMutator.  A bulk load
+     * writes HFiles that are handed to the region servers when flushed, see
+     * HFileBulkLoader.  With a positive timeoutMs, a write or flush fails
+     * once it has taken that long, except for the flush of a bulk load, which
+     * loads everything written and may take as long as it needs.
+     */
+    public PgToHBaseMutator makeMutator(final TableTemplate tableTemplate, final boolean bulkLoad,
+                                       final int timeoutMs) throws IOException {
         connect();
+        final BufferedMutator mutator = bulkLoad
+            ? new HFileBulkLoader(conn, tableTemplate.tableName, conf,
+                                  new Path(conf.get(BULK_LOAD_DIR_KEY, DEFAULT_BULK_LOAD_DIR)),
+                                  conf.getLong(BULK_LOAD_BUFFER_BYTES_KEY, DEFAULT_BULK_LOAD_BUFFER_BYTES))
+            : conn.getBufferedMutator(tableTemplate.tableName);
+        return new PgToHBaseMutator(mutator, tableTemplate, writers, timeoutMs, bulkLoad ? 0 : timeoutMs);
+    }
+
+    /**
+     * Starts an UPDATE or DELETE of the rows matching the filters, see
+     * PgDirectModifier.  The values an UPDATE sets are laid out like a
+     * mutation without its type.
+     */
+    public Scanner makeDirectModifier(final TableTemplate tableTemplate, final HBaseFilterCreator filterCreator,
+                                      final int timeoutMs, final int mutationType,
+                                      final ByteBuffer values) throws IOException {
+        final Scan scan = tableTemplate.newScan();
+        final boolean anyRows = filterCreator.applyFilters(scan, tableTemplate);
+
+        connect();
+
+        final PgToHBaseMutator mutator = makeMutator(tableTemplate, false, timeoutMs);
+        mutator.setValues(values);
+        if (!anyRows) {
+            return new PgDirectModifier(null, null, mutator, mutationType);
+        }
+
+        // Only the row keys are needed
+        Filter keysOnly = new FilterList(FilterList.Operator.MUST_PASS_ALL,
+                                         new FirstKeyOnlyFilter(), new KeyOnlyFilter());
+        if (scan.getFilter() != null) {
+            keysOnly = new FilterList(FilterList.Operator.MUST_PASS_ALL, scan.getFilter(), keysOnly);
+        }
+        scan.setFilter(keysOnly);
 
-        final Table table = conn.getTable(TableName.valueOf(tableName));
+        final Table table = conn.getTable(tableTemplate.tableName);
         try {
+            if (timeoutMs > 0 && table instanceof HTable) {
+                ((HTable) table).setOperationTimeout(timeoutMs);
+            }
             final ResultScanner scanner = table.getScanner(scan);
-            return new HBaseToPgScanner(table, scanner, columns);
+            final PrefetchingScanner prefetcher = new PrefetchingScanner(scanner, newBuffer(), fetchers, timeoutMs);
+            return new PgDirectModifier(table, prefetcher, mutator, mutationType);
         } catch (Throwable t) {
             table.close();
+            mutator.close();
             throw t;
         }
+    }
+
+    private SpillQueue newBuffer() {
+        final String spillDir = System.getProperty(SPILL_DIR_PROPERTY);
+        return new SpillQueue(conf.getLong(PREFETCH_BYTES_KEY, DEFAULT_PREFETCH_BYTES),
+                              conf.getLong(SPILL_BYTES_KEY, DEFAULT_SPILL_BYTES),
+                              spillDir == null ? null : new File(spillDir), spillBudget);
+    }
 
+    /**
+     * Looks up the location of every region of a table, which leaves them in
+     * the connection's cache, and returns the number of regions.  Gives up
+     * after timeoutMs, see within.
+     */
+    public int prewarmTable(final byte[] tableName, final int timeoutMs) throws IOException {
+        return within(timeoutMs, () -> {
+            connect();
+            try (RegionLocator locator = conn.getRegionLocator(TableName.valueOf(tableName))) {
+                final byte[][] startKeys = locator.getStartKeys();
+                for (byte[] startKey : startKeys) {
+                    locator.getRegionLocation(startKey);
+                }
+                return startKeys.length;
+            }
+        });
     }
 
-    private void connect() throws IOException {
+    public void connect() throws IOException {
         if (conn != null) return;
         synchronized(this) {
             if (conn != null) return;
             conn = ConnectionFactory.createConnection(conf);
         }
     }
+
+    /** Like connect, but gives up after timeoutMs, see within. */
+    public void connect(final int timeoutMs) throws IOException {
+        within(timeoutMs, () -> {
+            connect();
+            return null;
+        });
+    }
+
+    /**
+     * Runs a startup step on a thread of its own and waits at most timeoutMs
+     * for it, so an unreachable cluster can't keep the bgworker from letting
+     * scans in.  A step that times out is left to finish or fail by itself.
+     */
+    private static <T> T within(final int timeoutMs, final Callable<T> step) throws IOException {
+        final FutureTask<T> future = new FutureTask<>(step);
+        final Thread thread = new Thread(future, "hbase-fdw-startup");
+        thread.setDaemon(true);
+        thread.start();
+        try {
+            return future.get(timeoutMs, TimeUnit.MILLISECONDS);
+        } catch (TimeoutException e) {
+            throw new InterruptedIOException("HBase did not respond within " + timeoutMs + " ms");
+        } catch (InterruptedException e) {
+            Thread.currentThread().interrupt();
+            throw new InterruptedIOException("Interrupted while waiting for HBase");
+        } catch (ExecutionException e) {
+            final Throwable cause = e.getCause();
+            if (cause instanceof IOException) throw (IOException) cause;
+            if (cause instanceof RuntimeException) throw (RuntimeException) cause;
+            if (cause instanceof Error) throw (Error) cause;
+            throw new IOException(cause);
+        }
+    }
 }
 
@@ -1,9 +1,6 @@
 package org.bifrost;
 
-
-import org.apache.hadoop.hbase.client.Scan;
-
 public interface HBaseFilter {
-    public boolean apply(Scan scan);
-
+    /** The row keys a row has to have to pass the filter. */
+    public KeyRanges keyRanges(TableTemplate table);
 }
@@ -2,23 +2,51 @@ package org.bifrost;
 
 import org.apache.hadoop.hbase.client.Scan;
 
-import java.util.ArrayList;
-import java.util.List;
+import java.io.IOException;
+import java.util.ArrayDeque;
+import java.util.Deque;
 
+/**
+ * Rebuilds the backend's filter trees, which arrive as a preorder walk.
+ */
 public class HBaseFilterCreator {
-    public List<HBaseFilter> filters = new ArrayList<>();
+    // All filters sent for a scan must hold
+    private final BoolFilter root = new BoolFilter(BoolFilter.FILTER_TYPE_AND, -1);
+
+    // Boolean filters still waiting for arguments, innermost last
+    private final Deque<BoolFilter> open = new ArrayDeque<>();
+
     public HBaseFilterCreator() {}
 
+    private void add(HBaseFilter filter) {
+        BoolFilter parent = open.isEmpty() ? root : open.peekLast();
+        parent.args.add(filter);
+        while (!open.isEmpty() && open.peekLast().isComplete())
+            open.removeLast();
+    }
+
     public void addRowKeyEqualsFilter(byte[] rowKey) {
-        filters.add(new RowKeyEqualsFilter(rowKey));
+        add(new RowKeyEqualsFilter(rowKey));
+    }
+
+    public void addRowKeyPrefixFilter(byte[] prefix) {
+        add(new RowKeyPrefixFilter(prefix));
+    }
+
+    public void addRowKeyPartFilter(int column, int strategy, int valueType, byte[] value) {
+        RowKeyPartsFilter filter = new RowKeyPartsFilter();
+        filter.add(column, strategy, valueType, value);
+        add(filter);
+    }
+
+    public void addBoolFilter(int type, int nargs) {
+        BoolFilter filter = new BoolFilter(type, nargs);
+        add(filter);
+        if (!filter.isComplete())
+            open.addLast(filter);
     }
 
-    public boolean applyFilters(Scan scan) {
-        for (HBaseFilter filter: filters) {
-            if (!filter.apply(scan)) {
-                return false;
-            }
-        }
-        return true;
+    public boolean applyFilters(Scan scan, TableTemplate table) throws IOException {
+        return root.keyRanges(table).applyTo(scan);
     }
 }
@@ -2,64 +2,200 @@ package org.bifrost;
 
 import org.apache.hadoop.hbase.Cell;
 import org.apache.hadoop.hbase.client.Result;
-import org.apache.hadoop.hbase.client.ResultScanner;
+import org.apache.hadoop.hbase.client.Scan;
 import org.apache.hadoop.hbase.client.Table;
+import org.apache.hadoop.hbase.client.metrics.ScanMetrics;
+import org.apache.hadoop.hbase.util.Bytes;
 import org.bifrost.utils.ArrayUtils;
 import org.bifrost.utils.PairStore;
 
 import java.io.IOException;
 import java.io.UnsupportedEncodingException;
+import java.nio.BufferOverflowException;
 import java.nio.ByteBuffer;
 import java.nio.ByteOrder;
+import java.nio.charset.StandardCharsets;
 import java.util.ArrayList;
+import java.util.Collections;
 import java.util.List;
 
 public class HBaseToPgScanner implements Scanner, AutoCloseable {
-    private final ResultScanner scanner;
+    // Must be kept in sync with HBaseFdwMsgType in hbase_fdw.h
+    static final int MSG_TYPE_TUPLE = 0;
+    static final int MSG_TYPE_END_OF_STREAM = 1;
+    static final int MSG_TYPE_TUPLE_CHUNK = 2;
+    static final int MSG_TYPE_HEAP_TUPLE = 4;
+
+    // msg_type and data_len of HBaseFdwMessage
+    static final int MSG_HEADER_SIZE = 8;
+
+    private static final int INITIAL_ROW_BUFFER_SIZE = 65536;
+
+    // Longest start or stop row shown by EXPLAIN ANALYZE
+    private static final int MAX_METRICS_ROW_LENGTH = 1024;
+
+    private final PrefetchingScanner scanner;
     private final PgHbaseColumn[] columns;
     private final Table table;
-    private Result nextResult;
+    private final boolean heapTuples;
+    private final Scan metricsScan;     // reported at the end when not null
+    private final boolean[] isNull;
+    private final Cell[] columnCells;
+    private int rowKeyLength;
+
+    // Row being put back together from partial results
+    private Result first;
+    private List<Cell> cells;
+    private boolean endOfResults;
+
+    // Serialized form of the current row, flipped for reading
+    private ByteBuffer row;
 
     HBaseToPgScanner(final Table table,
-                     final ResultScanner scanner,
-                     PgHbaseColumn[] columns) {
+                     final PrefetchingScanner scanner,
+                     PgHbaseColumn[] columns,
+                     boolean heapTuples,
+                     Scan metricsScan) {
         this.scanner = scanner;
         this.columns = columns;
         this.table = table;
+        this.heapTuples = heapTuples;
+        this.metricsScan = metricsScan;
+        this.isNull = new boolean[columns.length];
+        this.columnCells = new Cell[columns.length];
+        this.row = allocateRowBuffer(INITIAL_ROW_BUFFER_SIZE);
+        this.row.limit(0);
     }
 
     @Override
-    public boolean scan(ByteBuffer buf) throws IOException {
-        if (scanner == null) return false;
+    public int scan(ByteBuffer buf) throws IOException {
+        return nextMessage(buf, true);
+    }
+
+    @Override
+    public int poll(ByteBuffer buf) throws IOException {
+        return nextMessage(buf, false);
+    }
+
+    private int nextMessage(ByteBuffer buf, boolean wait) throws IOException {
         buf.order(ByteOrder.nativeOrder());
-        if (nextResult == null) {
-            nextResult = scanner.next();
+        buf.clear();
+
+        if (!row.hasRemaining()) {
+            Result result = scanner == null ? null : nextRow(wait);
+            if (result == null && scanner != null && !endOfResults)
+                return 0;
+            if (result == null) {
+                buf.putInt(MSG_TYPE_END_OF_STREAM);
+                buf.putInt(0);
+                if (metricsScan != null)
+                    writeMetrics(buf);
+                return buf.position();
+            }
+            serializeRow(result);
         }
-        if (nextResult == null) {
-            return false;
+
+        int len = Math.min(row.remaining(), buf.capacity() - MSG_HEADER_SIZE);
+        if (len < row.remaining())
+            buf.putInt(MSG_TYPE_TUPLE_CHUNK);
+        else
+            buf.putInt(heapTuples ? MSG_TYPE_HEAP_TUPLE : MSG_TYPE_TUPLE);
+        buf.putInt(len);
+        buf.put(row.array(), row.arrayOffset() + row.position(), len);
+        row.position(row.position() + len);
+        return buf.position();
+    }
+
+    /**
+     * Returns the next complete row.  The scan may hand out a wide row as
+     * several partial results, which are merged back together here, so a row
+     * is only complete once the first result of the next one arrives.  Without
+     * wait, returns null if that hasn't happened yet, and endOfResults tells
+     * that apart from the end of the scan.
+     */
+    private Result nextRow(boolean wait) throws IOException {
+        for (;;) {
+            Result next = null;
+            if (!endOfResults) {
+                next = wait ? scanner.next() : scanner.poll();
+                if (next == null && !scanner.isFinished())
+                    return null;
+                endOfResults = next == null;
+            }
+
+            if (first == null) {
+                if (next == null)
+                    return null;
+                first = next;
+            } else if (next != null && Bytes.equals(first.getRow(), next.getRow())) {
+                if (cells == null) {
+                    cells = new ArrayList<>();
+                    Collections.addAll(cells, first.rawCells());
+                }
+                Collections.addAll(cells, next.rawCells());
+            } else {
+                Result complete = cells == null ? first : Result.create(cells);
+                first = next;
+                cells = null;
+                return complete;
+            }
         }
-        serializeResult(buf, nextResult);
-        nextResult = null;
-        return true;
     }
 
-    @Override
-    public byte[] scan() throws IOException {
-        ByteBuffer buf = ByteBuffer.allocate(65536);
-        buf.order(ByteOrder.nativeOrder());
-        boolean res = scan(buf);
-        if (!res) return null;
-        return buf.array();
+    /**
+     * Appends the scan's metrics and row range to the end of stream message,
+     * laid out as HBaseScanMetrics in hbase_fdw.h.
+     */
+    private void writeMetrics(ByteBuffer buf) {
+        ScanMetrics metrics = scanner.getScanMetrics();
+        if (metrics == null)
+            return;
+
+        buf.putLong(metrics.countOfRPCcalls.get());
+        buf.putLong(metrics.countOfRemoteRPCcalls.get());
+        buf.putLong(metrics.countOfRPCRetries.get());
+        buf.putLong(metrics.countOfRegions.get());
+        buf.putLong(metrics.countOfBytesInResults.get());
+        for (byte[] row : new byte[][] { metricsScan.getStartRow(), metricsScan.getStopRow() }) {
+            byte[] text = Bytes.toStringBinary(row).getBytes(StandardCharsets.UTF_8);
+            int len = Math.min(text.length, MAX_METRICS_ROW_LENGTH);
+            buf.putInt(len);
+            buf.put(text, 0, len);
+        }
+        buf.putInt(4, buf.position() - MSG_HEADER_SIZE);
     }
 
+    private void serializeRow(Result result) throws UnsupportedEncodingException {
+        for (;;) {
+            row.clear();
+            try {
+                if (heapTuples)
+                    serializeHeapTuple(row, result);
+                else
+                    serializeResult(row, result);
+                row.flip();
+                return;
+            } catch (BufferOverflowException e) {
+                row = allocateRowBuffer(row.capacity() * 2);
+            }
+        }
+    }
+
+    private static ByteBuffer allocateRowBuffer(int size) {
+        ByteBuffer buf = ByteBuffer.allocate(size);
+        buf.order(ByteOrder.nativeOrder());
+        return buf;
+    }
 
     private void serializeResult(ByteBuffer buf, Result result) throws UnsupportedEncodingException {
-        int startPos = buf.position();
-        buf.putInt(0);
-        for (PgHbaseColumn column: columns) {
+        findColumnCells(result);
+        for (int i = 0; i < columns.length; i++) {
             int lenPos = buf.position();
             buf.putInt(0);
-            writeColumns(buf, column, result);
+            if (hasValue(i)) {
+                PgDatum.align(buf, PgHeapTuple.alignment(columns[i].typeAlign));
+                writeColumns(buf, i, result);
+            }
             PgDatum.align(buf, 4);
             int endPos = buf.position();
             buf.position(lenPos);
@@ -67,28 +203,67 @@ public class HBaseToPgScanner implements Scanner, AutoCloseable {
             buf.position(endPos);
         }
         buf.putInt(0);
-        int endPos = buf.position();
-        buf.position(startPos);
-        buf.putInt(endPos - startPos);
-        buf.position(endPos);
     }
 
-    private void writeColumns(ByteBuffer buf, PgHbaseColumn column, Result result) throws UnsupportedEncodingException {
+    private void serializeHeapTuple(ByteBuffer buf, Result result) throws UnsupportedEncodingException {
+        boolean hasNull = false;
+        boolean hasVarWidth = false;
+        findColumnCells(result);
+        for (int i = 0; i < columns.length; i++) {
+            isNull[i] = !hasValue(i);
+            hasNull |= isNull[i];
+            hasVarWidth |= !isNull[i] && columns[i].typeLength == -1;
+        }
+
+        PgHeapTuple.writeHeader(buf, isNull, hasNull, hasVarWidth);
+        for (int i = 0; i < columns.length; i++) {
+            if (isNull[i]) continue;
+            PgDatum.align(buf, PgHeapTuple.alignment(columns[i].typeAlign));
+            writeColumns(buf, i, result);
+        }
+    }
+
+    private void findColumnCells(Result result) {
+        Cell[] cells = result.rawCells();
+        rowKeyLength = cells.length > 0 ? cells[0].getRowLength() : 0;
+        for (int i = 0; i < columns.length; i++) {
+            PgHbaseColumn column = columns[i];
+            columnCells[i] = column.qualifier ?
+                result.getColumnLatestCell(column.familyName, column.qualifierName) : null;
+        }
+    }
+
+    private boolean hasValue(int i) {
+        PgHbaseColumn column = columns[i];
+        if (column.keyPart)
+            return rowKeyLength >= column.keyOffset + Math.max(column.keyWidth, 0);
+        return column.row || column.family || columnCells[i] != null;
+    }
+
+    private void writeColumns(ByteBuffer buf, int i, Result result) throws UnsupportedEncodingException {
+        PgHbaseColumn column = columns[i];
         Cell[] cells = result.rawCells();
 
         if (column.row) {
-            PgDatum.writeByteArrayDatum(buf, cells[0].getRowArray(), cells[0].getRowOffset(), cells[0].getRowLength());
+            PgValueCodec.writeValue(buf, column, cells[0].getRowArray(), cells[0].getRowOffset(), cells[0].getRowLength());
+        } else if (column.keyPart) {
+            int width = column.keyWidth >= 0 ? column.keyWidth : rowKeyLength - column.keyOffset;
+            PgValueCodec.writeValue(buf, column, cells[0].getRowArray(),
+                    cells[0].getRowOffset() + column.keyOffset, width);
         } else if (column.family) {
             List<Cell> familyCells = new ArrayList<>(cells.length);
-            for (int i = 0; i < cells.length; i++) {
+            for (int j = 0; j < cells.length; j++) {
                 if (ArrayUtils.equals(column.familyName,
-                        cells[i].getFamilyArray(),
-                        cells[i].getFamilyOffset(),
-                        cells[i].getFamilyLength())) {
-                    familyCells.add(cells[i]);
+                        cells[j].getFamilyArray(),
+                        cells[j].getFamilyOffset(),
+                        cells[j].getFamilyLength())) {
+                    familyCells.add(cells[j]);
                 }
             }
             PgDatum.writeJsonbObject(buf, new PairStore(familyCells.toArray(new Cell[familyCells.size()])));
+        } else if (column.qualifier) {
+            Cell cell = columnCells[i];
+            PgValueCodec.writeValue(buf, column, cell.getValueArray(), cell.getValueOffset(), cell.getValueLength());
         }
     }
 
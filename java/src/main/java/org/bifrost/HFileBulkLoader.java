@@ -0,0 +1,211 @@
+package org.bifrost;
+
+import org.apache.hadoop.conf.Configuration;
+import org.apache.hadoop.fs.FileSystem;
+import org.apache.hadoop.fs.Path;
+import org.apache.hadoop.hbase.Cell;
+import org.apache.hadoop.hbase.CellUtil;
+import org.apache.hadoop.hbase.HColumnDescriptor;
+import org.apache.hadoop.hbase.HConstants;
+import org.apache.hadoop.hbase.HTableDescriptor;
+import org.apache.hadoop.hbase.KeyValue;
+import org.apache.hadoop.hbase.TableName;
+import org.apache.hadoop.hbase.client.Admin;
+import org.apache.hadoop.hbase.client.BufferedMutator;
+import org.apache.hadoop.hbase.client.Connection;
+import org.apache.hadoop.hbase.client.Mutation;
+import org.apache.hadoop.hbase.client.Put;
+import org.apache.hadoop.hbase.client.RegionLocator;
+import org.apache.hadoop.hbase.client.Table;
+import org.apache.hadoop.hbase.io.hfile.CacheConfig;
+import org.apache.hadoop.hbase.io.hfile.HFile;
+import org.apache.hadoop.hbase.io.hfile.HFileContextBuilder;
+import org.apache.hadoop.hbase.mapreduce.LoadIncrementalHFiles;
+import org.apache.hadoop.hbase.regionserver.HStore;
+import org.apache.hadoop.hbase.regionserver.StoreFile;
+import org.apache.hadoop.hbase.util.Bytes;
+
+import java.io.IOException;
+import java.util.ArrayList;
+import java.util.List;
+import java.util.Map;
+import java.util.TreeMap;
+import java.util.UUID;
+
+/**
+ * A BufferedMutator that writes Puts into HFiles instead of sending them to
+ * the region servers, and has the region servers adopt the files with
+ * LoadIncrementalHFiles when flushed.  Cells are buffered up to bufferBytes,
+ * then sorted and written out as one HFile per column family, so a load of
+ * any size needs only that much memory: a family may have any number of
+ * files, and LoadIncrementalHFiles splits those spanning several regions.
+ * The files are written with each family's compression, encoding, block
+ * size and bloom filter, as HFileOutputFormat2 does, so the loaded data
+ * needn't wait for a major compaction to get them.
+ * Only Puts can be loaded.  Not thread safe: PgToHBaseMutator calls it
+ * from its write pool, one call at a time.
+ */
+class HFileBulkLoader implements BufferedMutator {
+    private final Connection conn;
+    private final TableName tableName;
+    private final Configuration conf;
+    private final long bufferBytes;
+    private final FileSystem fs;
+    private final Path root;
+    private final CacheConfig cacheConf;
+
+    // Read when the first files are written
+    private HTableDescriptor descriptor;
+
+    // This load's files, in a subdirectory per family as LoadIncrementalHFiles expects
+    private Path dir;
+    private int files;
+
+    private final Map<byte[], List<KeyValue>> buffered = new TreeMap<>(Bytes.BYTES_COMPARATOR);
+    private long bufferedBytes;
+
+    HFileBulkLoader(final Connection conn, final TableName tableName, final Configuration conf,
+                    final Path root, final long bufferBytes) throws IOException {
+        this.conn = conn;
+        this.tableName = tableName;
+        this.conf = conf;
+        this.bufferBytes = bufferBytes;
+        this.fs = root.getFileSystem(conf);
+        this.root = root;
+        this.dir = newLoadDir();
+
+        // Nothing written here is read back, so keep it out of the block cache
+        final Configuration noCache = new Configuration(conf);
+        noCache.setFloat(HConstants.HFILE_BLOCK_CACHE_SIZE_KEY, 0.0f);
+        this.cacheConf = new CacheConfig(noCache);
+    }
+
+    private Path newLoadDir() {
+        return new Path(root, UUID.randomUUID().toString());
+    }
+
+    @Override
+    public TableName getName() {
+        return tableName;
+    }
+
+    @Override
+    public Configuration getConfiguration() {
+        return conf;
+    }
+
+    @Override
+    public long getWriteBufferSize() {
+        return bufferBytes;
+    }
+
+    @Override
+    public void mutate(final Mutation mutation) throws IOException {
+        if (!(mutation instanceof Put))
+            throw new UnsupportedOperationException("Bulk loads can only insert rows");
+
+        // Region servers stamp the cells they are sent, here it's up to us
+        final long now = System.currentTimeMillis();
+        for (Map.Entry<byte[], List<Cell>> family : mutation.getFamilyCellMap().entrySet()) {
+            final List<KeyValue> kvs = buffered.computeIfAbsent(family.getKey(), k -> new ArrayList<>());
+            for (Cell cell : family.getValue()) {
+                final long ts = cell.getTimestamp() == HConstants.LATEST_TIMESTAMP ? now : cell.getTimestamp();
+                final KeyValue kv = new KeyValue(CellUtil.cloneRow(cell), CellUtil.cloneFamily(cell),
+                                                 CellUtil.cloneQualifier(cell), ts, CellUtil.cloneValue(cell));
+                kvs.add(kv);
+                bufferedBytes += kv.heapSize();
+            }
+        }
+
+        if (bufferedBytes >= bufferBytes)
+            writeFiles();
+    }
+
+    @Override
+    public void mutate(final List<? extends Mutation> mutations) throws IOException {
+        for (Mutation mutation : mutations)
+            mutate(mutation);
+    }
+
+    private HColumnDescriptor familyDescriptor(final byte[] family) throws IOException {
+        if (descriptor == null) {
+            try (Table table = conn.getTable(tableName)) {
+                descriptor = table.getTableDescriptor();
+            }
+        }
+        final HColumnDescriptor hcd = descriptor.getFamily(family);
+        if (hcd == null)
+            throw new IOException(tableName + " has no column family " + Bytes.toString(family));
+        return hcd;
+    }
+
+    /** Sorts the buffered cells and writes them out as an HFile per family. */
+    private void writeFiles() throws IOException {
+        for (Map.Entry<byte[], List<KeyValue>> family : buffered.entrySet()) {
+            final List<KeyValue> kvs = family.getValue();
+            final HColumnDescriptor hcd = familyDescriptor(family.getKey());
+            final Path file = new Path(new Path(dir, Bytes.toString(family.getKey())), "hfile-" + files++);
+            final HFileContextBuilder context = new HFileContextBuilder()
+                .withCompression(hcd.getCompressionType())
+                .withDataBlockEncoding(hcd.getDataBlockEncoding())
+                .withBlockSize(hcd.getBlocksize())
+                .withChecksumType(HStore.getChecksumType(conf))
+                .withBytesPerCheckSum(HStore.getBytesPerChecksum(conf));
+            if (HFile.getFormatVersion(conf) >= HFile.MIN_FORMAT_VERSION_WITH_TAGS)
+                context.withIncludesTags(true);
+            final StoreFile.Writer writer = new StoreFile.WriterBuilder(conf, cacheConf, fs)
+                .withFilePath(file)
+                .withComparator(KeyValue.COMPARATOR)
+                .withBloomType(hcd.getBloomFilterType())
+                .withFileContext(context.build())
+                .build();
+
+            // The sort is stable, so of cells with the same key the last one written wins, as with Puts
+            kvs.sort(KeyValue.COMPARATOR);
+            try {
+                for (int i = 0; i < kvs.size(); i++) {
+                    if (i + 1 < kvs.size() && KeyValue.COMPARATOR.compare(kvs.get(i), kvs.get(i + 1)) == 0)
+                        continue;
+                    writer.append(kvs.get(i));
+                }
+                writer.appendFileInfo(StoreFile.BULKLOAD_TIME_KEY, Bytes.toBytes(System.currentTimeMillis()));
+                writer.appendFileInfo(StoreFile.MAJOR_COMPACTION_KEY, Bytes.toBytes(false));
+                writer.appendTrackedTimestampsToMetadata();
+            } finally {
+                writer.close();
+            }
+        }
+        buffered.clear();
+        bufferedBytes = 0;
+    }
+
+    /** Writes what is buffered and loads every file written so far. */
+    @Override
+    public void flush() throws IOException {
+        writeFiles();
+        if (files == 0)
+            return;
+
+        try (Admin admin = conn.getAdmin();
+             Table table = conn.getTable(tableName);
+             RegionLocator locator = conn.getRegionLocator(tableName)) {
+            new LoadIncrementalHFiles(conf).doBulkLoad(dir, admin, table, locator);
+        } catch (IOException e) {
+            throw e;
+        } catch (Exception e) {
+            throw new IOException("Bulk load into " + tableName + " failed", e);
+        } finally {
+            fs.delete(dir, true);
+            dir = newLoadDir();
+            files = 0;
+        }
+    }
+
+    /** Drops whatever hasn't been loaded. */
+    @Override
+    public void close() throws IOException {
+        buffered.clear();
+        bufferedBytes = 0;
+        fs.delete(dir, true);
+    }
+}
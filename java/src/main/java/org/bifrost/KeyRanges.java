@@ -0,0 +1,150 @@
+package org.bifrost;
+
+import org.apache.hadoop.hbase.HConstants;
+import org.apache.hadoop.hbase.client.Scan;
+import org.apache.hadoop.hbase.filter.Filter;
+import org.apache.hadoop.hbase.filter.FilterList;
+import org.apache.hadoop.hbase.filter.MultiRowRangeFilter;
+import org.apache.hadoop.hbase.filter.MultiRowRangeFilter.RowRange;
+import org.apache.hadoop.hbase.util.Bytes;
+
+import java.io.IOException;
+import java.util.ArrayList;
+import java.util.Collections;
+import java.util.List;
+
+/**
+ * A set of row keys as a sorted list of disjoint ranges.  Each range runs
+ * from an inclusive start key up to an exclusive stop key, where an empty
+ * stop key means the end of the table.
+ */
+public class KeyRanges {
+    private static final byte[] EMPTY = HConstants.EMPTY_BYTE_ARRAY;
+
+    static final KeyRanges ALL = new KeyRanges(Collections.singletonList(new Range(EMPTY, EMPTY)));
+    static final KeyRanges NONE = new KeyRanges(Collections.<Range>emptyList());
+
+    private static class Range {
+        final byte[] start;
+        final byte[] stop;
+
+        Range(byte[] start, byte[] stop) {
+            this.start = start;
+            this.stop = stop;
+        }
+    }
+
+    private final List<Range> ranges;
+
+    private KeyRanges(List<Range> ranges) {
+        this.ranges = ranges;
+    }
+
+    /** Keys from start up to stop, with a null or empty stop for no limit. */
+    public static KeyRanges of(byte[] start, byte[] stop) {
+        if (start == null)
+            start = EMPTY;
+        if (stop == null)
+            stop = EMPTY;
+        if (compareStop(start, stop) >= 0)
+            return NONE;
+        return new KeyRanges(Collections.singletonList(new Range(start, stop)));
+    }
+
+    public boolean isEmpty() {
+        return ranges.isEmpty();
+    }
+
+    public KeyRanges union(KeyRanges other) {
+        List<Range> all = new ArrayList<>(ranges.size() + other.ranges.size());
+        all.addAll(ranges);
+        all.addAll(other.ranges);
+        all.sort((a, b) -> Bytes.compareTo(a.start, b.start));
+
+        List<Range> result = new ArrayList<>();
+        Range current = null;
+        for (Range r : all) {
+            if (current == null) {
+                current = r;
+            } else if (compareStop(r.start, current.stop) <= 0) {
+                if (compareStops(r.stop, current.stop) > 0)
+                    current = new Range(current.start, r.stop);
+            } else {
+                result.add(current);
+                current = r;
+            }
+        }
+        if (current != null)
+            result.add(current);
+        return new KeyRanges(result);
+    }
+
+    public KeyRanges intersect(KeyRanges other) {
+        List<Range> result = new ArrayList<>();
+        int i = 0;
+        int j = 0;
+        while (i < ranges.size() && j < other.ranges.size()) {
+            Range a = ranges.get(i);
+            Range b = other.ranges.get(j);
+            byte[] start = Bytes.compareTo(a.start, b.start) >= 0 ? a.start : b.start;
+            byte[] stop = compareStops(a.stop, b.stop) <= 0 ? a.stop : b.stop;
+            if (compareStop(start, stop) < 0)
+                result.add(new Range(start, stop));
+            if (compareStops(a.stop, b.stop) <= 0)
+                i++;
+            else
+                j++;
+        }
+        return new KeyRanges(result);
+    }
+
+    public KeyRanges complement() {
+        List<Range> result = new ArrayList<>();
+        byte[] from = EMPTY;
+        for (Range r : ranges) {
+            if (Bytes.compareTo(from, r.start) < 0)
+                result.add(new Range(from, r.start));
+            if (r.stop.length == 0)
+                return new KeyRanges(result);
+            from = r.stop;
+        }
+        result.add(new Range(from, EMPTY));
+        return new KeyRanges(result);
+    }
+
+    /**
+     * Restricts the scan to these keys, returning false if no key can match.
+     * The scan covers the outermost range and a MultiRowRangeFilter skips the
+     * gaps between ranges.
+     */
+    public boolean applyTo(Scan scan) throws IOException {
+        KeyRanges r = intersect(of(scan.getStartRow(), scan.getStopRow()));
+        if (r.isEmpty())
+            return false;
+
+        scan.setStartRow(r.ranges.get(0).start);
+        scan.setStopRow(r.ranges.get(r.ranges.size() - 1).stop);
+        if (r.ranges.size() > 1) {
+            List<RowRange> rowRanges = new ArrayList<>(r.ranges.size());
+            for (Range range : r.ranges)
+                rowRanges.add(new RowRange(range.start, true, range.stop, false));
+
+            Filter filter = new MultiRowRangeFilter(rowRanges);
+            if (scan.getFilter() != null)
+                filter = new FilterList(FilterList.Operator.MUST_PASS_ALL, scan.getFilter(), filter);
+            scan.setFilter(filter);
+        }
+        return true;
+    }
+
+    /** Compares a key with a stop key. */
+    private static int compareStop(byte[] key, byte[] stop) {
+        return stop.length == 0 ? -1 : Bytes.compareTo(key, stop);
+    }
+
+    private static int compareStops(byte[] a, byte[] b) {
+        if (a.length == 0)
+            return b.length == 0 ? 0 : 1;
+        return b.length == 0 ? -1 : Bytes.compareTo(a, b);
+    }
+}
@@ -0,0 +1,109 @@
+package org.bifrost;
+
+import org.apache.hadoop.hbase.client.Result;
+import org.apache.hadoop.hbase.client.Table;
+import org.apache.hadoop.hbase.util.Bytes;
+
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.ArrayList;
+import java.util.List;
+
+/**
+ * Runs an UPDATE or DELETE the backend pushed down whole: scans the keys of
+ * the matching rows and queues a mutation for each, so no row travels to the
+ * backend and back.  The only message sent is the end of stream, once every
+ * mutation has been written, carrying the number of rows changed.
+ */
+public class PgDirectModifier implements Scanner {
+    // Rows written per batch, and per poll, so other scans of the worker thread get a turn
+    private static final int ROWS_PER_POLL = 1000;
+
+    private final Table table;
+    private final PrefetchingScanner scanner;
+    private final PgToHBaseMutator mutator;
+    private final int mutationType;
+
+    private byte[] lastRow;
+    private long rows;
+    private boolean scanned;        // every matching row was handed to the mutator
+
+    /** A null scanner means no row can match. */
+    PgDirectModifier(final Table table, final PrefetchingScanner scanner,
+                     final PgToHBaseMutator mutator, final int mutationType) {
+        this.table = table;
+        this.scanner = scanner;
+        this.mutator = mutator;
+        this.mutationType = mutationType;
+    }
+
+    @Override
+    public int scan(ByteBuffer buf) throws IOException {
+        for (;;) {
+            final int len = nextMessage(buf, true);
+            if (len != POLL_AGAIN)
+                return len;
+        }
+    }
+
+    @Override
+    public int poll(ByteBuffer buf) throws IOException {
+        return nextMessage(buf, false);
+    }
+
+    /*
+     * Hands the keys of up to ROWS_PER_POLL rows at a time to the mutator,
+     * then flushes it.  The mutator writes one batch at a time, and wakes
+     * the worker thread when it is done.
+     */
+    private int nextMessage(ByteBuffer buf, boolean wait) throws IOException {
+        final int state = wait ? mutator.await() : mutator.poll();
+        if (state == PgToHBaseMutator.BUSY)
+            return 0;
+        if (state == PgToHBaseMutator.FLUSHED) {
+            buf.order(ByteOrder.nativeOrder());
+            buf.clear();
+            buf.putInt(HBaseToPgScanner.MSG_TYPE_END_OF_STREAM);
+            buf.putInt(8);
+            buf.putLong(rows);
+            return buf.position();
+        }
+
+        if (!scanned) {
+            final List<byte[]> keys = new ArrayList<>();
+            while (keys.size() < ROWS_PER_POLL) {
+                final Result result = scanner == null ? null : wait ? scanner.next() : scanner.poll();
+                if (result == null) {
+                    scanned = scanner == null || scanner.isFinished();
+                    break;
+                }
+
+                // A wide row may arrive as several partial results
+                final byte[] row = result.getRow();
+                if (lastRow != null && Bytes.equals(lastRow, row))
+                    continue;
+                lastRow = row;
+                keys.add(row);
+            }
+
+            if (!keys.isEmpty()) {
+                mutator.mutateRows(mutationType, keys);
+                rows += keys.size();
+                return POLL_AGAIN;
+            }
+            if (!scanned)
+                return 0;
+        }
+
+        mutator.startFlush();
+        return POLL_AGAIN;
+    }
+
+    @Override
+    public void close() {
+        try { if (scanner != null) scanner.close(); } catch (Throwable t) {}
+        try { mutator.close(); } catch (Throwable t) {}
+        try { if (table != null) table.close(); } catch (Throwable t) {}
+    }
+}
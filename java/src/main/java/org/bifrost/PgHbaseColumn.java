@@ -8,13 +8,36 @@ public class PgHbaseColumn {
     public final byte[] familyName;
     public final byte[] qualifierName;
 
+    // attlen and attalign of the Postgres attribute
+    public final int typeLength;
+    public final char typeAlign;
+
+    // See PgValueCodec for the type and encoding constants
+    public final int valueType;
+    public final int encoding;
+
+    // Component of a composite row key, keyWidth is -1 for the rest of the key
+    public final boolean keyPart;
+    public final int keyOffset;
+    public final int keyWidth;
+
     public PgHbaseColumn(boolean row, boolean family, boolean qualifier,
-                         byte[] familyName, byte[] qualifierName)
+                         byte[] familyName, byte[] qualifierName,
+                         int typeLength, char typeAlign,
+                         int valueType, int encoding,
+                         boolean keyPart, int keyOffset, int keyWidth)
     {
         this.row = row;
         this.family = family;
         this.qualifier = qualifier;
         this.familyName = familyName;
         this.qualifierName = qualifierName;
+        this.typeLength = typeLength;
+        this.typeAlign = typeAlign;
+        this.valueType = valueType;
+        this.encoding = encoding;
+        this.keyPart = keyPart;
+        this.keyOffset = keyOffset;
+        this.keyWidth = keyWidth;
     }
 }
@@ -0,0 +1,67 @@
+package org.bifrost;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
+/**
+ * Writes HeapTupleHeaderData as laid out in access/htup_details.h, so the
+ * backend can store the tuple without copying it again.
+ */
+public class PgHeapTuple {
+    static final int MAXIMUM_ALIGNOF = 8;
+    static final int SIZEOF_HEAP_TUPLE_HEADER = 23;
+
+    static final int HEAP_HASNULL = 0x0001;
+    static final int HEAP_HASVARWIDTH = 0x0002;
+    static final int HEAP_NATTS_MASK = 0x07FF;
+
+    public static int writeHeader(ByteBuffer output, boolean[] isNull, boolean hasNull, boolean hasVarWidth) {
+        output.order(ByteOrder.nativeOrder());
+        int startPos = output.position();
+        int natts = isNull.length;
+
+        // t_xmin, t_xmax and t_cid are all invalid
+        output.putInt(0);
+        output.putInt(0);
+        output.putInt(0);
+
+        // t_ctid is an invalid item pointer
+        output.putShort((short) 0xFFFF);
+        output.putShort((short) 0xFFFF);
+        output.putShort((short) 0);
+
+        output.putShort((short) (natts & HEAP_NATTS_MASK));
+        output.putShort((short) ((hasNull ? HEAP_HASNULL : 0) | (hasVarWidth ? HEAP_HASVARWIDTH : 0)));
+
+        int hoff = SIZEOF_HEAP_TUPLE_HEADER;
+        if (hasNull)
+            hoff += (natts + 7) / 8;
+        hoff = (hoff + MAXIMUM_ALIGNOF - 1) & ~(MAXIMUM_ALIGNOF - 1);
+        output.put((byte) hoff);
+
+        // Null bitmap, a set bit means the attribute is present
+        if (hasNull) {
+            for (int i = 0; i < natts; i += 8) {
+                int bits = 0;
+                for (int j = 0; j < 8 && i + j < natts; j++) {
+                    if (!isNull[i + j])
+                        bits |= 1 << j;
+                }
+                output.put((byte) bits);
+            }
+        }
+
+        while (output.position() - startPos < hoff)
+            output.put((byte) 0);
+        return hoff;
+    }
+
+    public static int alignment(char typeAlign) {
+        switch (typeAlign) {
+            case 's': return 2;
+            case 'i': return 4;
+            case 'd': return 8;
+            default: return 1;
+        }
+    }
+}
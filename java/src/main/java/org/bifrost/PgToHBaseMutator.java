@@ -0,0 +1,284 @@
+package org.bifrost;
+
+import org.apache.hadoop.hbase.client.BufferedMutator;
+import org.apache.hadoop.hbase.client.Delete;
+import org.apache.hadoop.hbase.client.Mutation;
+import org.apache.hadoop.hbase.client.Put;
+
+import java.io.ByteArrayOutputStream;
+import java.io.IOException;
+import java.io.InterruptedIOException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.ArrayList;
+import java.util.List;
+import java.util.concurrent.CompletableFuture;
+import java.util.concurrent.Executor;
+import java.util.concurrent.TimeUnit;
+
+/**
+ * Applies batches of rows written by the backend to a table through a
+ * BufferedMutator.  The calls into the BufferedMutator, which block while
+ * its buffer is written out, run on a shared executor, one at a time and in
+ * order, and the worker thread polls for them to finish, as it does for
+ * scans.  Batches are decoded by the caller, as the backend's buffer is only
+ * valid during the call.
+ */
+public class PgToHBaseMutator implements AutoCloseable {
+    // Must be kept in sync with HBaseMutationType in hbase_fdw.h
+    static final int MUTATION_INSERT = 0;
+    static final int MUTATION_UPDATE = 1;
+    static final int MUTATION_DELETE = 2;
+
+    // Length of a value the mutation doesn't touch, see HBASE_FDW_PARAM_UNSET
+    static final int PARAM_UNSET = -2;
+
+    // Results of poll, must be kept in sync with jvm.c
+    static final int IDLE = 0;          // ready for the next operation
+    static final int BUSY = 1;          // an operation is in flight
+    static final int FLUSHED = 2;       // a flush finished, reported once
+
+    private interface Operation {
+        void run() throws IOException;
+    }
+
+    private final BufferedMutator mutator;
+    private final TableTemplate table;
+    private final PgHbaseColumn[] columns;
+    private final Executor writers;
+    private final int timeoutMs;
+    private final int flushTimeoutMs;
+    private final WorkerWakeup wakeup = WorkerWakeup.current();
+
+    // Values of the mutation being decoded, null for NULL
+    private final byte[][] values;
+    private final boolean[] isSet;
+
+    // All below are guarded by this
+    private CompletableFuture<Void> last = CompletableFuture.completedFuture(null);
+    private boolean busy;
+    private int busyTimeoutMs;          // of the operation in flight
+    private long deadline;              // System.nanoTime() by which it must be done
+    private boolean flushed;
+    private Throwable error;
+    private boolean closed;
+
+    /**
+     * Each write may take up to timeoutMs, and each flush up to
+     * flushTimeoutMs, 0 or less for no limit.
+     */
+    PgToHBaseMutator(final BufferedMutator mutator, final TableTemplate table,
+                     final Executor writers, final int timeoutMs, final int flushTimeoutMs) {
+        this.mutator = mutator;
+        this.table = table;
+        this.columns = table.columns;
+        this.writers = writers;
+        this.timeoutMs = timeoutMs;
+        this.flushTimeoutMs = flushTimeoutMs;
+        this.values = new byte[columns.length][];
+        this.isSet = new boolean[columns.length];
+    }
+
+    /**
+     * Starts writing a batch of mutations, each an int mutation type followed
+     * by a length prefixed value for every column, padded to 4 bytes, as laid
+     * out by the backend.
+     */
+    public void mutate(final ByteBuffer batch) throws IOException {
+        final List<Mutation> mutations = new ArrayList<>();
+        batch.order(ByteOrder.nativeOrder());
+
+        while (batch.hasRemaining()) {
+            final int type = batch.getInt();
+            readValues(batch);
+            addMutations(type, rowKey(), mutations);
+        }
+        submit(() -> mutator.mutate(mutations), false);
+    }
+
+    /**
+     * Sets the column values for mutateRow, laid out like a mutation without
+     * its type.
+     */
+    void setValues(final ByteBuffer buf) {
+        buf.order(ByteOrder.nativeOrder());
+        readValues(buf);
+    }
+
+    /** Starts writing mutations of existing rows, with the values from setValues. */
+    void mutateRows(final int type, final List<byte[]> rowKeys) throws IOException {
+        final List<Mutation> mutations = new ArrayList<>(rowKeys.size());
+        for (byte[] rowKey : rowKeys)
+            addMutations(type, rowKey, mutations);
+        submit(() -> mutator.mutate(mutations), false);
+    }
+
+    private void readValues(final ByteBuffer buf) {
+        for (int i = 0; i < columns.length; i++) {
+            final int len = buf.getInt();
+            isSet[i] = len != PARAM_UNSET;
+            values[i] = null;
+            if (len >= 0) {
+                values[i] = new byte[len];
+                buf.get(values[i]);
+                buf.position((buf.position() + 3) & ~3);
+            }
+        }
+    }
+
+    private void addMutations(final int type, final byte[] rowKey, final List<Mutation> mutations) {
+        if (type == MUTATION_DELETE) {
+            mutations.add(new Delete(rowKey));
+            return;
+        }
+
+        final Put put = new Put(rowKey);
+        Delete delete = null;
+        for (int i = 0; i < columns.length; i++) {
+            final PgHbaseColumn column = columns[i];
+            if (!isSet[i] || column.row || column.keyPart || !(column.qualifier || column.family))
+                continue;
+
+            if (values[i] == null) {
+                // Inserted rows simply have no cell, updates remove it
+                if (type == MUTATION_UPDATE && column.qualifier) {
+                    if (delete == null)
+                        delete = new Delete(rowKey);
+                    delete.addColumns(column.familyName, column.qualifierName);
+                }
+                continue;
+            }
+            if (!column.qualifier)
+                throw new IllegalArgumentException("Can not write a whole column family");
+            put.addColumn(column.familyName, column.qualifierName, PgValueCodec.encodeValue(column, values[i]));
+        }
+
+        if (type == MUTATION_INSERT && put.isEmpty())
+            throw new IllegalArgumentException("Row has no values to write");
+        if (!put.isEmpty())
+            mutations.add(put);
+        if (delete != null)
+            mutations.add(delete);
+    }
+
+    /** Builds the row key from the row key column or the key components. */
+    private byte[] rowKey() {
+        for (int i = 0; i < columns.length; i++) {
+            if (columns[i].row) {
+                if (values[i] == null)
+                    throw new IllegalArgumentException("Row key can not be NULL");
+                return PgValueCodec.encodeValue(columns[i], values[i]);
+            }
+        }
+
+        if (table.keyParts.length == 0)
+            throw new IllegalArgumentException("Table has no row key column");
+
+        final ByteArrayOutputStream key = new ByteArrayOutputStream();
+        for (int i : table.keyParts) {
+            final PgHbaseColumn column = columns[i];
+            if (values[i] == null)
+                throw new IllegalArgumentException("Row key components can not be NULL");
+            final byte[] b = column.encoding == PgValueCodec.ENCODING_STRING
+                ? PgValueCodec.encodeValue(column, values[i])
+                : PgValueCodec.encodeKeyPart(column, column.valueType, values[i]);
+            if (b == null || (column.keyWidth >= 0 && b.length != column.keyWidth))
+                throw new IllegalArgumentException("Value does not fit row key component of width " +
+                                                   column.keyWidth);
+            if (key.size() != column.keyOffset)
+                throw new IllegalArgumentException("Row key components leave a gap at offset " + key.size());
+            key.write(b, 0, b.length);
+        }
+        return key.toByteArray();
+    }
+
+    /** Starts writing out everything mutated so far, see poll. */
+    public void startFlush() throws IOException {
+        submit(mutator::flush, true);
+    }
+
+    private synchronized void submit(final Operation operation, final boolean isFlush) throws IOException {
+        if (poll() != IDLE)
+            throw new IllegalStateException("HBase mutator is busy");
+        busy = true;
+        busyTimeoutMs = isFlush ? flushTimeoutMs : timeoutMs;
+        deadline = System.nanoTime() + TimeUnit.MILLISECONDS.toNanos(Math.max(busyTimeoutMs, 0));
+        last = last.thenRunAsync(() -> run(operation, isFlush), writers);
+    }
+
+    private void run(final Operation operation, final boolean isFlush) {
+        Throwable failure = null;
+        try {
+            operation.run();
+        } catch (Throwable t) {
+            failure = t;
+        }
+
+        synchronized (this) {
+            busy = false;
+            if (failure != null && error == null)
+                error = failure;
+            else if (isFlush)
+                flushed = true;
+            notifyAll();
+        }
+        wakeup.wake();
+    }
+
+    /**
+     * Returns BUSY while an operation is in flight, FLUSHED once after a
+     * flush finished, and IDLE otherwise.  Throws if an operation failed, or
+     * took longer than the timeout, after which the mutator is unusable.
+     */
+    public synchronized int poll() throws IOException {
+        if (error == null && busy && busyTimeoutMs > 0 && deadline - System.nanoTime() <= 0)
+            error = new InterruptedIOException("HBase did not finish writing within " + busyTimeoutMs + " ms");
+        if (error != null) {
+            if (error instanceof IOException)
+                throw (IOException) error;
+            if (error instanceof RuntimeException)
+                throw (RuntimeException) error;
+            if (error instanceof Error)
+                throw (Error) error;
+            throw new IOException(error);
+        }
+        if (busy)
+            return BUSY;
+        if (flushed) {
+            flushed = false;
+            return FLUSHED;
+        }
+        return IDLE;
+    }
+
+    /** Like poll, but waits for an operation in flight to finish. */
+    public synchronized int await() throws IOException {
+        while (busy && error == null) {
+            try {
+                if (busyTimeoutMs > 0)
+                    TimeUnit.NANOSECONDS.timedWait(this, Math.max(deadline - System.nanoTime(), 1));
+                else
+                    wait();
+            } catch (InterruptedException e) {
+                throw new InterruptedIOException("Interrupted while waiting for HBase writes");
+            }
+            if (busyTimeoutMs > 0 && deadline - System.nanoTime() <= 0)
+                break;
+        }
+        return poll();
+    }
+
+    /**
+     * Closes the BufferedMutator, which writes out whatever is left, once the
+     * operation in flight is done.  Doesn't wait for either.
+     */
+    @Override
+    public synchronized void close() {
+        if (closed)
+            return;
+        closed = true;
+        last.whenCompleteAsync((v, t) -> {
+            try { mutator.close(); } catch (Throwable e) {}
+        }, writers);
+    }
+}
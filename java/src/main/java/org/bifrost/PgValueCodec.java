@@ -0,0 +1,337 @@
+package org.bifrost;
+
+import org.apache.hadoop.hbase.util.Bytes;
+
+import java.io.UnsupportedEncodingException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.charset.StandardCharsets;
+import java.time.Instant;
+import java.time.LocalDateTime;
+import java.time.OffsetDateTime;
+import java.time.ZoneOffset;
+import java.time.format.DateTimeFormatter;
+import java.time.format.DateTimeFormatterBuilder;
+import java.time.temporal.TemporalAccessor;
+import java.util.Arrays;
+
+/**
+ * Decodes HBase cell values into Postgres datums of the column's type, and
+ * encodes Postgres values into row key components and cell values.
+ */
+public class PgValueCodec {
+    // Must be kept in sync with HBaseValueType in hbase_fdw.h
+    static final int TYPE_TEXT = 0;
+    static final int TYPE_BYTEA = 1;
+    static final int TYPE_INT2 = 2;
+    static final int TYPE_INT4 = 3;
+    static final int TYPE_INT8 = 4;
+    static final int TYPE_FLOAT4 = 5;
+    static final int TYPE_FLOAT8 = 6;
+    static final int TYPE_BOOL = 7;
+    static final int TYPE_TIMESTAMPTZ = 8;
+    static final int TYPE_JSONB = 9;
+
+    // Must be kept in sync with HBaseEncoding in hbase_fdw.h
+    static final int ENCODING_BINARY = 0;
+    static final int ENCODING_STRING = 1;
+    static final int ENCODING_PHOENIX = 2;
+
+    // Milliseconds between the Unix epoch and the Postgres epoch, 2000-01-01
+    static final long POSTGRES_EPOCH_MILLIS = 946684800000L;
+
+    // ISO date-times, with an optional offset such as Z, +01 or +05:30
+    private static final DateTimeFormatter TIMESTAMP_FORMAT = new DateTimeFormatterBuilder()
+        .append(DateTimeFormatter.ISO_LOCAL_DATE_TIME)
+        .optionalStart().appendOffset("+HH:mm", "Z").optionalEnd()
+        .toFormatter();
+
+    public static int writeValue(ByteBuffer output, PgHbaseColumn column,
+                                 byte[] b, int offset, int length) throws UnsupportedEncodingException {
+        output.order(ByteOrder.nativeOrder());
+        int startPos = output.position();
+
+        switch (column.valueType) {
+            case TYPE_TEXT:
+            case TYPE_BYTEA:
+                return PgDatum.writeByteArrayDatum(output, b, offset, length);
+            case TYPE_INT2:
+                output.putShort((short) decodeLong(column, b, offset, length, 2));
+                break;
+            case TYPE_INT4:
+                output.putInt((int) decodeLong(column, b, offset, length, 4));
+                break;
+            case TYPE_INT8:
+                output.putLong(decodeLong(column, b, offset, length, 8));
+                break;
+            case TYPE_FLOAT4:
+                output.putFloat((float) decodeDouble(column, b, offset, length, 4));
+                break;
+            case TYPE_FLOAT8:
+                output.putDouble(decodeDouble(column, b, offset, length, 8));
+                break;
+            case TYPE_BOOL:
+                output.put((byte) (decodeBoolean(column, b, offset, length) ? 1 : 0));
+                break;
+            case TYPE_TIMESTAMPTZ:
+                output.putLong(decodeTimestamp(column, b, offset, length));
+                break;
+            default:
+                throw new IllegalArgumentException("Can not decode values of type " + column.valueType);
+        }
+        return output.position() - startPos;
+    }
+
+    private static long decodeLong(PgHbaseColumn column, byte[] b, int offset, int length, int size) {
+        switch (column.encoding) {
+            case ENCODING_STRING: {
+                long l = Long.parseLong(toString(b, offset, length).trim());
+                if (size < 8 && (l < -(1L << (size * 8 - 1)) || l >= (1L << (size * 8 - 1))))
+                    throw new IllegalArgumentException("Value out of range for a " + size + " byte integer: " + l);
+                return l;
+            }
+            case ENCODING_PHOENIX:
+                checkLength(length, size);
+                // Phoenix flips the sign bit so that values sort as bytes
+                return toSignedLong(b, offset, size, true);
+            default:
+                checkLength(length, size);
+                return toSignedLong(b, offset, size, false);
+        }
+    }
+
+    private static double decodeDouble(PgHbaseColumn column, byte[] b, int offset, int length, int size) {
+        switch (column.encoding) {
+            case ENCODING_STRING:
+                return Double.parseDouble(toString(b, offset, length).trim());
+            case ENCODING_PHOENIX:
+                checkLength(length, size);
+                if (size == 4) {
+                    int i = Bytes.toInt(b, offset) - 1;
+                    i ^= (~i >> 31) | Integer.MIN_VALUE;
+                    return Float.intBitsToFloat(i);
+                } else {
+                    long l = Bytes.toLong(b, offset) - 1;
+                    l ^= (~l >> 63) | Long.MIN_VALUE;
+                    return Double.longBitsToDouble(l);
+                }
+            default:
+                checkLength(length, size);
+                return size == 4 ? Bytes.toFloat(b, offset) : Bytes.toDouble(b, offset);
+        }
+    }
+
+    private static boolean decodeBoolean(PgHbaseColumn column, byte[] b, int offset, int length) {
+        if (column.encoding == ENCODING_STRING) {
+            String s = toString(b, offset, length).trim().toLowerCase();
+            switch (s) {
+                case "t": case "true": case "y": case "yes": case "on": case "1":
+                    return true;
+                case "f": case "false": case "n": case "no": case "off": case "0":
+                    return false;
+                default:
+                    throw new IllegalArgumentException("Invalid boolean value: " + s);
+            }
+        }
+        checkLength(length, 1);
+        return b[offset] != 0;
+    }
+
+    /**
+     * Returns microseconds since the Postgres epoch.  Binary values are
+     * milliseconds since the Unix epoch, as written by Bytes.toBytes(long).
+     * Strings without an offset are taken to be in UTC.
+     */
+    private static long decodeTimestamp(PgHbaseColumn column, byte[] b, int offset, int length) {
+        long millis;
+        long extraMicros = 0;
+
+        switch (column.encoding) {
+            case ENCODING_STRING: {
+                String s = toString(b, offset, length).trim();
+                if (!s.isEmpty() && s.chars().allMatch(Character::isDigit)) {
+                    millis = Long.parseLong(s);
+                } else {
+                    TemporalAccessor parsed = TIMESTAMP_FORMAT.parseBest(
+                        s.replace(' ', 'T'), OffsetDateTime::from, LocalDateTime::from);
+                    OffsetDateTime t = parsed instanceof OffsetDateTime
+                        ? (OffsetDateTime) parsed
+                        : ((LocalDateTime) parsed).atOffset(ZoneOffset.UTC);
+                    millis = t.toEpochSecond() * 1000;
+                    extraMicros = t.getNano() / 1000;
+                }
+                break;
+            }
+            case ENCODING_PHOENIX:
+                // DATE is 8 bytes of millis, TIMESTAMP adds 4 bytes of nanos
+                if (length != 8 && length != 12)
+                    throw new IllegalArgumentException("Expected 8 or 12 bytes, got " + length);
+                millis = Bytes.toLong(b, offset) ^ Long.MIN_VALUE;
+                if (length == 12)
+                    extraMicros = Bytes.toInt(b, offset + 8) / 1000;
+                break;
+            default:
+                checkLength(length, 8);
+                millis = Bytes.toLong(b, offset);
+        }
+        return (millis - POSTGRES_EPOCH_MILLIS) * 1000 + extraMicros;
+    }
+
+    /**
+     * Encodes a value the backend sent in its native representation the way
+     * the column's row key component stores it.  Returns null if the
+     * component can't hold the value exactly.
+     */
+    public static byte[] encodeKeyPart(PgHbaseColumn column, int valueType, byte[] value) {
+        byte[] b = encodeBinary(column, valueType, value, true);
+        if (b != null && column.keyWidth >= 0 && b.length != column.keyWidth)
+            return null;
+        return b;
+    }
+
+    /**
+     * Encodes a value of the column's own type, as the backend sends it for
+     * writes, the way the column's cells store it.
+     */
+    public static byte[] encodeValue(PgHbaseColumn column, byte[] value) {
+        byte[] b;
+        if (column.encoding == ENCODING_STRING)
+            b = encodeString(column, value);
+        else if (column.valueType == TYPE_JSONB)
+            b = value;
+        else
+            b = encodeBinary(column, column.valueType, value, false);
+        if (b == null)
+            throw new IllegalArgumentException("Can not store the value exactly in a column of type " +
+                                               column.valueType);
+        return b;
+    }
+
+    private static byte[] encodeString(PgHbaseColumn column, byte[] value) {
+        ByteBuffer in = ByteBuffer.wrap(value).order(ByteOrder.nativeOrder());
+        String s;
+
+        switch (column.valueType) {
+            case TYPE_TEXT:
+            case TYPE_BYTEA:
+            case TYPE_JSONB:
+                return value;
+            case TYPE_INT2: s = Short.toString(in.getShort()); break;
+            case TYPE_INT4: s = Integer.toString(in.getInt()); break;
+            case TYPE_INT8: s = Long.toString(in.getLong()); break;
+            case TYPE_FLOAT4: s = Float.toString(in.getFloat()); break;
+            case TYPE_FLOAT8: s = Double.toString(in.getDouble()); break;
+            case TYPE_BOOL: s = value[0] != 0 ? "true" : "false"; break;
+            case TYPE_TIMESTAMPTZ: {
+                long micros = in.getLong();
+                long seconds = Math.floorDiv(micros, 1000000L) + POSTGRES_EPOCH_MILLIS / 1000;
+                int nanos = (int) Math.floorMod(micros, 1000000L) * 1000;
+                s = OffsetDateTime.ofInstant(Instant.ofEpochSecond(seconds, nanos), ZoneOffset.UTC).toString();
+                break;
+            }
+            default:
+                return null;
+        }
+        return s.getBytes(StandardCharsets.UTF_8);
+    }
+
+    /**
+     * Encodes a value for the binary and Phoenix encodings.  Phoenix
+     * timestamps take 12 bytes in key components that are 12 bytes wide, and
+     * in cells whenever there are microseconds to keep.
+     */
+    private static byte[] encodeBinary(PgHbaseColumn column, int valueType, byte[] value, boolean keyPart) {
+        ByteBuffer in = ByteBuffer.wrap(value).order(ByteOrder.nativeOrder());
+        boolean phoenix = column.encoding == ENCODING_PHOENIX;
+
+        switch (column.valueType) {
+            case TYPE_TEXT:
+            case TYPE_BYTEA:
+                return valueType == TYPE_TEXT || valueType == TYPE_BYTEA ? value : null;
+            case TYPE_INT2:
+            case TYPE_INT4:
+            case TYPE_INT8: {
+                long l;
+                switch (valueType) {
+                    case TYPE_INT2: l = in.getShort(); break;
+                    case TYPE_INT4: l = in.getInt(); break;
+                    case TYPE_INT8: l = in.getLong(); break;
+                    default: return null;
+                }
+                int size = column.valueType == TYPE_INT2 ? 2 : column.valueType == TYPE_INT4 ? 4 : 8;
+                if (size < 8 && (l < -(1L << (size * 8 - 1)) || l >= (1L << (size * 8 - 1))))
+                    return null;
+                byte[] b = Arrays.copyOfRange(Bytes.toBytes(l), 8 - size, 8);
+                if (phoenix)
+                    b[0] ^= 0x80;
+                return b;
+            }
+            case TYPE_FLOAT4:
+            case TYPE_FLOAT8: {
+                double d;
+                switch (valueType) {
+                    case TYPE_FLOAT4: d = in.getFloat(); break;
+                    case TYPE_FLOAT8: d = in.getDouble(); break;
+                    default: return null;
+                }
+                // -0.0 equals 0.0 in Postgres, but not bit for bit
+                if (d == 0)
+                    d = 0.0;
+                if (column.valueType == TYPE_FLOAT4) {
+                    float f = (float) d;
+                    if (f != d)
+                        return null;
+                    int i = Float.floatToIntBits(f);
+                    if (phoenix)
+                        i = (i ^ ((i >> 31) | Integer.MIN_VALUE)) + 1;
+                    return Bytes.toBytes(i);
+                }
+                long l = Double.doubleToLongBits(d);
+                if (phoenix)
+                    l = (l ^ ((l >> 63) | Long.MIN_VALUE)) + 1;
+                return Bytes.toBytes(l);
+            }
+            case TYPE_BOOL:
+                if (valueType != TYPE_BOOL)
+                    return null;
+                // Bytes.toBytes(true) writes 0xff, Phoenix writes 1
+                if (value[0] == 0)
+                    return new byte[] { 0 };
+                return new byte[] { phoenix ? (byte) 1 : (byte) 0xff };
+            case TYPE_TIMESTAMPTZ: {
+                if (valueType != TYPE_TIMESTAMPTZ)
+                    return null;
+                long micros = in.getLong();
+                long millis = Math.floorDiv(micros, 1000L) + POSTGRES_EPOCH_MILLIS;
+                int nanos = (int) Math.floorMod(micros, 1000L) * 1000;
+                if (phoenix && (keyPart ? column.keyWidth == 12 : nanos != 0)) {
+                    ByteBuffer b = ByteBuffer.allocate(12);
+                    b.putLong(millis ^ Long.MIN_VALUE);
+                    b.putInt(nanos);
+                    return b.array();
+                }
+                if (nanos != 0)
+                    return null;
+                return Bytes.toBytes(phoenix ? millis ^ Long.MIN_VALUE : millis);
+            }
+            default:
+                return null;
+        }
+    }
+
+    private static long toSignedLong(byte[] b, int offset, int size, boolean flipSign) {
+        long l = flipSign ? (byte) (b[offset] ^ 0x80) : b[offset];
+        for (int i = 1; i < size; i++)
+            l = (l << 8) | (b[offset + i] & 0xFF);
+        return l;
+    }
+
+    private static void checkLength(int length, int expected) {
+        if (length != expected)
+            throw new IllegalArgumentException("Expected " + expected + " bytes, got " + length);
+    }
+
+    private static String toString(byte[] b, int offset, int length) {
+        return new String(b, offset, length, StandardCharsets.UTF_8);
+    }
+}
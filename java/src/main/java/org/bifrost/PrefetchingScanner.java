@@ -0,0 +1,210 @@
+package org.bifrost;
+
+import org.apache.hadoop.hbase.client.AbstractClientScanner;
+import org.apache.hadoop.hbase.client.Result;
+import org.apache.hadoop.hbase.client.ResultScanner;
+import org.apache.hadoop.hbase.client.metrics.ScanMetrics;
+
+import java.io.IOException;
+import java.io.InterruptedIOException;
+import java.util.concurrent.Executor;
+import java.util.concurrent.TimeUnit;
+
+/**
+ * Reads a ResultScanner ahead of the worker into a SpillQueue.  Each call to
+ * ResultScanner.next runs as a separate task on a small shared executor and
+ * queues the next one only while there is room, so a scan ties up a thread
+ * just while an RPC is in flight and a full buffer costs nothing.  Tasks for
+ * a scan never overlap, as the ResultScanner is not thread safe.
+ *
+ * With room to spill to disk, a slow consumer doesn't hold the scan open on
+ * the region server until its lease expires: the scan is read to the end
+ * at full speed and closed, and the worker is fed from the buffer.
+ */
+public class PrefetchingScanner implements AutoCloseable {
+    private final ResultScanner scanner;
+    private final Executor executor;
+    private final int timeoutMs;
+    private final WorkerWakeup wakeup = WorkerWakeup.current();
+    private final SpillQueue ready;     // has a lock of its own, taken after ours
+
+    // All below are guarded by this
+    private Throwable error;
+    private boolean endOfScan;      // the ResultScanner is exhausted
+    private boolean finished;       // and the consumer has seen that
+    private boolean fetching;       // a fetch task is queued or running
+    private long fetchDeadline;     // System.nanoTime() by which it must be done
+    private boolean closed;
+    private boolean scannerClosed;
+
+    /**
+     * Each fetch, from being queued to returning a result, may take up to
+     * timeoutMs.  Time spent with a full buffer, waiting for the consumer,
+     * doesn't count.  A timeoutMs of 0 or less lets fetches take as long as
+     * they need.
+     */
+    PrefetchingScanner(final ResultScanner scanner, final SpillQueue buffer, final Executor executor,
+                       final int timeoutMs) {
+        this.scanner = scanner;
+        this.ready = buffer;
+        this.executor = executor;
+        this.timeoutMs = timeoutMs;
+        synchronized (this) {
+            schedule();
+        }
+    }
+
+    private void schedule() {
+        if (fetching || closed || endOfScan || error != null || ready.isFull())
+            return;
+        fetching = true;
+        fetchDeadline = System.nanoTime() + TimeUnit.MILLISECONDS.toNanos(Math.max(timeoutMs, 0));
+        executor.execute(this::fetch);
+    }
+
+    private void fetch() {
+        Result result = null;
+        Throwable failure = null;
+
+        synchronized (this) {
+            if (closed) {
+                fetching = false;
+                closeScanner();
+                return;
+            }
+        }
+
+        try {
+            result = scanner.next();
+            // Outside the lock, as it may write to a spill file
+            if (result != null)
+                ready.add(result);
+        } catch (Throwable t) {
+            failure = t;
+        }
+
+        synchronized (this) {
+            fetching = false;
+            if (failure != null)
+                error = failure;
+            else if (result == null)
+                endOfScan = true;
+
+            if (closed || endOfScan || error != null)
+                closeScanner();
+            notifyAll();
+            schedule();
+        }
+        wakeup.wake();
+    }
+
+    // Only called while no fetch task can be using the scanner
+    private void closeScanner() {
+        if (scannerClosed)
+            return;
+        scannerClosed = true;
+        try { scanner.close(); } catch (Throwable t) {}
+    }
+
+    /**
+     * Returns the next result if one has been fetched, or null if none is
+     * ready yet or the scan is over, which isFinished() tells apart.
+     */
+    public Result poll() throws IOException {
+        // Outside the lock, as it may read back a spill file
+        Result result = ready.poll();
+
+        synchronized (this) {
+            return result != null ? resultPolled(result) : nothingPolled();
+        }
+    }
+
+    private Result resultPolled(final Result result) {
+        schedule();
+        return result;
+    }
+
+    private Result nothingPolled() throws IOException {
+        if (error != null) {
+            Throwable t = error;
+            error = null;
+            finished = true;
+            if (t instanceof IOException)
+                throw (IOException) t;
+            if (t instanceof RuntimeException)
+                throw (RuntimeException) t;
+            if (t instanceof Error)
+                throw (Error) t;
+            throw new IOException(t);
+        }
+        if (endOfScan) {
+            // A result added just before the end may have missed our poll
+            finished = ready.isEmpty();
+        } else if (timeoutMs > 0 && fetching && remainingNanos() <= 0) {
+            close();
+            finished = true;
+            throw new InterruptedIOException("HBase did not return results within " + timeoutMs + " ms");
+        }
+        return null;
+    }
+
+    // Of the fetch in flight
+    private long remainingNanos() {
+        return fetchDeadline - System.nanoTime();
+    }
+
+    public synchronized boolean isFinished() {
+        return finished;
+    }
+
+    /**
+     * Returns the scanner's running metrics, or null unless the Scan had
+     * them enabled.  The counters are atomic, so they can be read while a
+     * fetch is in flight.
+     */
+    public ScanMetrics getScanMetrics() {
+        if (scanner instanceof AbstractClientScanner)
+            return ((AbstractClientScanner) scanner).getScanMetrics();
+        return null;
+    }
+
+    /** Returns the next result, waiting for it if needed, or null at the end. */
+    public Result next() throws IOException {
+        for (;;) {
+            Result result = poll();
+            if (result != null)
+                return result;
+
+            synchronized (this) {
+                if (finished || closed)
+                    return null;
+                // Otherwise the fetch in flight notifies us when it is done
+                if (!fetching || !ready.isEmpty())
+                    continue;
+                try {
+                    if (timeoutMs > 0)
+                        TimeUnit.NANOSECONDS.timedWait(this, Math.max(remainingNanos(), 1));
+                    else
+                        wait();
+                } catch (InterruptedException e) {
+                    throw new InterruptedIOException("Interrupted while waiting for HBase results");
+                }
+            }
+        }
+    }
+
+    /**
+     * Stops fetching.  A fetch already in flight is left to finish and then
+     * closes the scanner, which releases the scanner on the region server,
+     * so this never waits for the region server.  The fetch isn't
+     * interrupted: an interrupt while the RPC client writes to a region
+     * server closes the connection that every scan shares.
+     */
+    @Override
+    public synchronized void close() {
+        closed = true;
+        ready.close();
+        if (!fetching)
+            closeScanner();
+    }
+}
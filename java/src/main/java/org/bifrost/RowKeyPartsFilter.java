@@ -0,0 +1,204 @@
+package org.bifrost;
+
+import org.apache.hadoop.hbase.util.Bytes;
+
+import java.io.ByteArrayOutputStream;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.List;
+
+/**
+ * Turns comparisons on the components of a composite row key into the range
+ * of keys to scan.  Equalities on the leading components fix a prefix of the
+ * key and comparisons on the component after them bound the range.  Postgres
+ * still checks every comparison, so the range only has to contain all rows
+ * that can match.
+ */
+public class RowKeyPartsFilter implements HBaseFilter {
+    // Btree strategy numbers, must be kept in sync with access/stratnum.h
+    static final int STRATEGY_LESS = 1;
+    static final int STRATEGY_LESS_EQUAL = 2;
+    static final int STRATEGY_EQUAL = 3;
+    static final int STRATEGY_GREATER_EQUAL = 4;
+    static final int STRATEGY_GREATER = 5;
+
+    private static class Comparison {
+        final int column;
+        final int strategy;
+        final int valueType;
+        final byte[] value;
+
+        Comparison(int column, int strategy, int valueType, byte[] value) {
+            this.column = column;
+            this.strategy = strategy;
+            this.valueType = valueType;
+            this.value = value;
+        }
+    }
+
+    private static class Bound {
+        final byte[] value;
+        final boolean inclusive;
+
+        Bound(byte[] value, boolean inclusive) {
+            this.value = value;
+            this.inclusive = inclusive;
+        }
+    }
+
+    private final List<Comparison> comparisons = new ArrayList<>();
+
+    void add(int column, int strategy, int valueType, byte[] value) {
+        comparisons.add(new Comparison(column, strategy, valueType, value));
+    }
+
+    void addAll(RowKeyPartsFilter other) {
+        comparisons.addAll(other.comparisons);
+    }
+
+    @Override
+    public KeyRanges keyRanges(TableTemplate table) {
+        ByteArrayOutputStream prefix = new ByteArrayOutputStream();
+        boolean exact = false;
+        byte[] start = null;
+        byte[] stop = null;
+        boolean bounded = false;
+
+        for (int index : table.keyParts) {
+            PgHbaseColumn column = table.columns[index];
+            byte[] equal = null;
+            Bound lower = null;
+            Bound upper = null;
+
+            for (Comparison c : comparisons) {
+                if (c.column != index)
+                    continue;
+                // Comparing with NULL never matches
+                if (c.value == null)
+                    return KeyRanges.NONE;
+
+                byte[] v = PgValueCodec.encodeKeyPart(column, c.valueType, c.value);
+                if (c.strategy == STRATEGY_EQUAL) {
+                    // No key holds a value the component can't represent
+                    if (v == null || (equal != null && !Bytes.equals(equal, v)))
+                        return KeyRanges.NONE;
+                    equal = v;
+                } else if (v == null) {
+                    continue;
+                } else if (c.strategy == STRATEGY_LESS || c.strategy == STRATEGY_LESS_EQUAL) {
+                    boolean inclusive = c.strategy == STRATEGY_LESS_EQUAL;
+                    int cmp = upper == null ? -1 : compare(column, v, upper.value);
+                    if (cmp < 0 || (cmp == 0 && !inclusive))
+                        upper = new Bound(v, inclusive);
+                } else {
+                    boolean inclusive = c.strategy == STRATEGY_GREATER_EQUAL;
+                    int cmp = lower == null ? 1 : compare(column, v, lower.value);
+                    if (cmp > 0 || (cmp == 0 && !inclusive))
+                        lower = new Bound(v, inclusive);
+                }
+            }
+
+            if (equal != null) {
+                prefix.write(equal, 0, equal.length);
+                exact = column.keyWidth < 0;
+                continue;
+            }
+            if (lower == null && upper == null)
+                break;
+
+            // Negative two's complement values sort after the positive ones
+            if (isSignedBinary(column)) {
+                if (lower != null && upper != null && isNegative(lower.value) != isNegative(upper.value)) {
+                    if (!isNegative(lower.value))
+                        return KeyRanges.NONE;
+                    break;
+                } else if (lower == null) {
+                    if (!isNegative(upper.value))
+                        break;
+                    lower = new Bound(signedLimit(upper.value.length, true), true);
+                } else if (upper == null) {
+                    if (isNegative(lower.value))
+                        break;
+                    upper = new Bound(signedLimit(lower.value.length, false), true);
+                }
+            }
+
+            byte[] p = prefix.toByteArray();
+            if (lower == null)
+                start = p;
+            else if (lower.inclusive)
+                start = Bytes.add(p, lower.value);
+            else
+                start = after(column, Bytes.add(p, lower.value));
+
+            if (upper == null)
+                stop = successor(p);
+            else if (upper.inclusive)
+                stop = after(column, Bytes.add(p, upper.value));
+            else
+                stop = Bytes.add(p, upper.value);
+            bounded = true;
+            break;
+        }
+
+        if (!bounded) {
+            byte[] p = prefix.toByteArray();
+            start = p;
+            stop = exact ? Bytes.add(p, new byte[] { 0 }) : successor(p);
+        }
+        return KeyRanges.of(start, stop);
+    }
+
+    private static boolean isSignedBinary(PgHbaseColumn column) {
+        if (column.encoding != PgValueCodec.ENCODING_BINARY)
+            return false;
+        switch (column.valueType) {
+            case PgValueCodec.TYPE_INT2:
+            case PgValueCodec.TYPE_INT4:
+            case PgValueCodec.TYPE_INT8:
+            case PgValueCodec.TYPE_TIMESTAMPTZ:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    private static boolean isNegative(byte[] value) {
+        return (value[0] & 0x80) != 0;
+    }
+
+    private static int compare(PgHbaseColumn column, byte[] a, byte[] b) {
+        if (isSignedBinary(column) && isNegative(a) != isNegative(b))
+            return isNegative(a) ? -1 : 1;
+        return Bytes.compareTo(a, b);
+    }
+
+    /** The smallest or largest two's complement number of the given size. */
+    private static byte[] signedLimit(int size, boolean smallest) {
+        byte[] b = new byte[size];
+        Arrays.fill(b, smallest ? (byte) 0 : (byte) 0xFF);
+        b[0] = smallest ? (byte) 0x80 : (byte) 0x7F;
+        return b;
+    }
+
+    /**
+     * The first key after every key whose component ends the given key.  A
+     * fixed width component can be followed by more of the key, the rest of
+     * the key can't.
+     */
+    private static byte[] after(PgHbaseColumn column, byte[] key) {
+        return column.keyWidth < 0 ? Bytes.add(key, new byte[] { 0 }) : successor(key);
+    }
+
+    /** The first key not starting with prefix, or null if there is none. */
+    private static byte[] successor(byte[] prefix) {
+        int len = prefix.length;
+        while (len > 0 && prefix[len - 1] == (byte) 0xFF)
+            len--;
+        if (len == 0)
+            return null;
+        byte[] b = Arrays.copyOf(prefix, len);
+        b[len - 1]++;
+        return b;
+    }
+}
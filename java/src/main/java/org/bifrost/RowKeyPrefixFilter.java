@@ -0,0 +1,35 @@
+package org.bifrost;
+
+/** Row keys starting with a prefix, as from row_key LIKE 'prefix%'. */
+public class RowKeyPrefixFilter implements HBaseFilter {
+    private final byte[] prefix;
+
+    public RowKeyPrefixFilter(byte[] prefix) {
+        this.prefix = prefix;
+    }
+
+    @Override
+    public KeyRanges keyRanges(TableTemplate table) {
+        if (prefix == null) {
+            return KeyRanges.NONE;
+        }
+        return KeyRanges.of(prefix, stopRow(prefix));
+    }
+
+    /**
+     * The first key past every key with the prefix: the prefix with its last
+     * byte that isn't 0xff incremented and the rest dropped, or the end of the
+     * table if there is no such byte.
+     */
+    private static byte[] stopRow(byte[] prefix) {
+        for (int i = prefix.length - 1; i >= 0; i--) {
+            if (prefix[i] != (byte) 0xff) {
+                byte[] stop = new byte[i + 1];
+                System.arraycopy(prefix, 0, stop, 0, i + 1);
+                stop[i]++;
+                return stop;
+            }
+        }
+        return null;
+    }
+}
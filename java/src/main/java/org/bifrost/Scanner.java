@@ -4,6 +4,25 @@ import java.io.IOException;
 import java.nio.ByteBuffer;
 
 public interface Scanner {
-    boolean scan(ByteBuffer buf) throws IOException;
-    byte[] scan() throws IOException;
+    /**
+     * Returned by poll when the scanner got something done but has no
+     * message yet, so it should be polled again soon.  Must be kept in sync
+     * with HBASE_FDW_POLL_AGAIN.
+     */
+    int POLL_AGAIN = -2;
+
+    /**
+     * Writes the next message into buf, starting at position 0, and returns
+     * the number of bytes written.
+     */
+    int scan(ByteBuffer buf) throws IOException;
+
+    /**
+     * Like scan, but returns 0 instead of waiting for HBase when the next
+     * message isn't ready yet, or POLL_AGAIN.
+     */
+    int poll(ByteBuffer buf) throws IOException;
+
+    /** Releases the scan's resources, including any read ahead. */
+    void close();
 }
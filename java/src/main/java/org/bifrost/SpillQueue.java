@@ -0,0 +1,281 @@
+package org.bifrost;
+
+import org.apache.hadoop.hbase.Cell;
+import org.apache.hadoop.hbase.CellUtil;
+import org.apache.hadoop.hbase.client.Result;
+import org.apache.hadoop.hbase.protobuf.ProtobufUtil;
+import org.apache.hadoop.hbase.protobuf.generated.ClientProtos;
+
+import java.io.BufferedInputStream;
+import java.io.BufferedOutputStream;
+import java.io.File;
+import java.io.FileInputStream;
+import java.io.FileOutputStream;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.OutputStream;
+import java.util.ArrayDeque;
+import java.util.ArrayList;
+import java.util.List;
+import java.util.concurrent.atomic.AtomicLong;
+
+/**
+ * A FIFO of results kept in memory up to memoryLimit bytes, with the
+ * overflow written to temporary files of up to spillLimit bytes in all.
+ * Once anything has been spilled, new results go to the files too, and are
+ * read back into memory as the consumer empties it, so the order is
+ * preserved.  Spill files also count against a Budget shared by all scans.
+ *
+ * Safe for one producer and one consumer thread.  The file I/O happens
+ * outside the queue's lock, so neither side waits for the other's disk.
+ */
+class SpillQueue implements AutoCloseable {
+    /** Postgres removes files with this prefix from its temp directory at startup. */
+    private static final String SPILL_FILE_PREFIX = "pgsql_tmp_hbase_fdw";
+
+    /** Bytes of spill files all scans together may use, negative for no limit. */
+    static class Budget {
+        private final long limit;
+        private final AtomicLong used = new AtomicLong();
+
+        Budget(final long limit) {
+            this.limit = limit;
+        }
+
+        boolean isExhausted() {
+            return limit >= 0 && used.get() >= limit;
+        }
+
+        void add(final long bytes) {
+            used.addAndGet(bytes);
+        }
+
+        void release(final long bytes) {
+            used.addAndGet(-bytes);
+        }
+    }
+
+    /**
+     * A spill file.  The producer appends to the newest one until the
+     * consumer starts reading it, so a file that has been read to the end
+     * can be deleted.  The streams belong to the side that uses them, the
+     * rest is guarded by the queue.
+     */
+    private static class SpillFile {
+        final File file;
+        final OutputStream out;
+        InputStream in;
+        long written;           // results written and flushed
+        long read;              // and read back
+        long bytes;
+        boolean started;        // the consumer has started on it
+        boolean writing;        // the producer is writing to it right now
+        boolean reading;        // the consumer is reading from it right now
+
+        SpillFile(final File file) throws IOException {
+            this.file = file;
+            this.out = new BufferedOutputStream(new FileOutputStream(file));
+        }
+
+        void delete() {
+            try { if (in != null) in.close(); } catch (IOException e) {}
+            try { out.close(); } catch (IOException e) {}
+            file.delete();
+        }
+    }
+
+    private final long memoryLimit;
+    private final long spillLimit;
+    private final File spillDir;
+    private final Budget budget;
+
+    // All below are guarded by this
+    private final ArrayDeque<Result> memory = new ArrayDeque<>();
+    private long memoryBytes;
+    private final ArrayDeque<SpillFile> files = new ArrayDeque<>();  // oldest first
+    private long spillBytes;
+    private boolean closed;
+
+    SpillQueue(final long memoryLimit, final long spillLimit, final File spillDir, final Budget budget) {
+        this.memoryLimit = memoryLimit;
+        this.spillLimit = spillDir == null ? 0 : spillLimit;
+        this.spillDir = spillDir;
+        this.budget = budget;
+    }
+
+    /** True if there is no room for more results, in memory or on disk. */
+    synchronized boolean isFull() {
+        if (memoryBytes < memoryLimit && files.isEmpty())
+            return false;
+        return spillBytes >= spillLimit || budget.isExhausted();
+    }
+
+    synchronized boolean isEmpty() {
+        return memory.isEmpty() && files.isEmpty();
+    }
+
+    /** Called by the producer.  Results added after close() are dropped. */
+    void add(final Result result) throws IOException {
+        SpillFile target;
+
+        synchronized (this) {
+            if (closed)
+                return;
+            if (memoryBytes < memoryLimit && files.isEmpty()) {
+                memory.addLast(result);
+                memoryBytes += sizeOf(result);
+                return;
+            }
+            target = files.peekLast();
+            if (target != null && target.started)
+                target = null;
+            if (target != null)
+                target.writing = true;
+        }
+
+        if (target == null) {
+            if (!spillDir.isDirectory() && !spillDir.mkdirs() && !spillDir.isDirectory())
+                throw new IOException("Could not create " + spillDir);
+            target = new SpillFile(File.createTempFile(SPILL_FILE_PREFIX, ".tmp", spillDir));
+            target.writing = true;
+            synchronized (this) {
+                if (!closed)
+                    files.addLast(target);
+            }
+        }
+
+        int size = -1;
+        try {
+            ClientProtos.Result proto = ProtobufUtil.toResult(result);
+            proto.writeDelimitedTo(target.out);
+            // The consumer may read the result as soon as it is counted
+            target.out.flush();
+            size = proto.getSerializedSize();
+        } finally {
+            boolean delete;
+            synchronized (this) {
+                target.writing = false;
+                if (size >= 0 && !closed) {
+                    target.written++;
+                    target.bytes += size;
+                    spillBytes += size;
+                    budget.add(size);
+                }
+                delete = closed || removeIfDrained(target);
+            }
+            if (delete)
+                target.delete();
+        }
+    }
+
+    /** Called by the consumer.  Returns null if there are no results. */
+    Result poll() throws IOException {
+        SpillFile source;
+        long available;
+
+        synchronized (this) {
+            Result result = pollMemory();
+            if (result != null || closed)
+                return result;
+            source = files.peekFirst();
+            if (source == null)
+                return null;
+            source.started = true;
+            available = source.written - source.read;
+            if (available == 0) {
+                if (removeIfDrained(source))
+                    source.delete();
+                return null;
+            }
+            source.reading = true;
+        }
+
+        // Read back up to the memory limit
+        List<Result> batch = new ArrayList<>();
+        long batchBytes = 0;
+        try {
+            if (source.in == null)
+                source.in = new BufferedInputStream(new FileInputStream(source.file));
+            while (batch.size() < available && (batch.isEmpty() || batchBytes < memoryLimit)) {
+                ClientProtos.Result proto = ClientProtos.Result.parseDelimitedFrom(source.in);
+                if (proto == null)
+                    throw new IOException("Unexpected end of " + source.file);
+                Result result = ProtobufUtil.toResult(proto);
+                batch.add(result);
+                batchBytes += sizeOf(result);
+            }
+        } finally {
+            boolean delete;
+            synchronized (this) {
+                source.reading = false;
+                source.read += batch.size();
+                if (!closed) {
+                    memory.addAll(batch);
+                    memoryBytes += batchBytes;
+                }
+                delete = closed || removeIfDrained(source);
+            }
+            if (delete)
+                source.delete();
+        }
+
+        synchronized (this) {
+            return pollMemory();
+        }
+    }
+
+    private Result pollMemory() {
+        Result result = memory.pollFirst();
+        if (result != null)
+            memoryBytes -= sizeOf(result);
+        return result;
+    }
+
+    /*
+     * Takes a file the consumer has read to the end, and the producer has
+     * moved on from, out of the queue.  The caller deletes it outside the
+     * lock.
+     */
+    private boolean removeIfDrained(final SpillFile file) {
+        if (!file.started || file.writing || file.reading || file.read < file.written)
+            return false;
+        if (!files.remove(file))
+            return false;
+        spillBytes -= file.bytes;
+        budget.release(file.bytes);
+        return true;
+    }
+
+    private static long sizeOf(final Result result) {
+        long size = 0;
+        for (Cell cell : result.rawCells())
+            size += CellUtil.estimatedSerializedSizeOf(cell);
+        return size;
+    }
+
+    /**
+     * Drops every result.  Files the producer is writing to are deleted once
+     * it is done with them.
+     */
+    @Override
+    public void close() {
+        List<SpillFile> unused = new ArrayList<>();
+
+        synchronized (this) {
+            if (closed)
+                return;
+            closed = true;
+            memory.clear();
+            memoryBytes = 0;
+            for (SpillFile file : files) {
+                budget.release(file.bytes);
+                if (!file.writing && !file.reading)
+                    unused.add(file);
+            }
+            files.clear();
+            spillBytes = 0;
+        }
+        for (SpillFile file : unused)
+            file.delete();
+    }
+}
@@ -0,0 +1,59 @@
+package org.bifrost;
+
+import org.apache.hadoop.hbase.TableName;
+import org.apache.hadoop.hbase.client.Scan;
+
+import java.io.IOException;
+import java.util.ArrayList;
+import java.util.Comparator;
+import java.util.List;
+import java.util.Map;
+import java.util.NavigableSet;
+
+/**
+ * Column descriptors and a prepared Scan for one foreign table.  Instances
+ * are shared between worker threads and must not be modified once built.
+ */
+public class TableTemplate {
+    public final int version;
+    public final TableName tableName;
+    public final PgHbaseColumn[] columns;
+
+    // Indexes into columns of the row key components, in key order
+    public final int[] keyParts;
+
+    private final Scan scan;
+
+    TableTemplate(final int version, final byte[] tableName, final PgHbaseColumn[] columns, final Scan scan) {
+        this.version = version;
+        this.tableName = TableName.valueOf(tableName);
+        this.columns = columns;
+        this.scan = scan;
+
+        List<Integer> parts = new ArrayList<>();
+        for (int i = 0; i < columns.length; i++) {
+            if (columns[i].keyPart)
+                parts.add(i);
+        }
+        parts.sort(Comparator.comparingInt(i -> columns[i].keyOffset));
+        this.keyParts = parts.stream().mapToInt(Integer::intValue).toArray();
+
+        for (PgHbaseColumn column: columns) {
+            if (column.row || column.keyPart) continue;
+            if (column.family) {
+                scan.addFamily(column.familyName);
+            }
+            if (column.qualifier) {
+                Map<byte[], NavigableSet<byte[]>> familyMap = scan.getFamilyMap();
+                if (!familyMap.containsKey(column.familyName) ||
+                    familyMap.get(column.familyName) != null)
+                    scan.addColumn(column.familyName, column.qualifierName);
+            }
+        }
+    }
+
+    /** Returns a Scan for this table that the caller is free to modify. */
+    public Scan newScan() throws IOException {
+        return new Scan(scan);
+    }
+}
@@ -0,0 +1,36 @@
+package org.bifrost;
+
+/**
+ * Wakes the worker thread serving a scan once the scan can make progress,
+ * so a thread whose scans are all waiting for HBase sleeps rather than
+ * polling them.  Scans pick up the wakeup of the worker thread that creates
+ * them, and may use it from any thread.
+ */
+final class WorkerWakeup {
+    private static final WorkerWakeup NONE = new WorkerWakeup(-1);
+    private static final ThreadLocal<WorkerWakeup> current = ThreadLocal.withInitial(() -> NONE);
+
+    private final int thread;
+
+    private WorkerWakeup(final int thread) {
+        this.thread = thread;
+    }
+
+    /** Called by each worker thread once it has attached to the JVM. */
+    static void register(final int thread) {
+        current.set(new WorkerWakeup(thread));
+    }
+
+    /** The wakeup of the calling worker thread, or one that does nothing. */
+    static WorkerWakeup current() {
+        return current.get();
+    }
+
+    void wake() {
+        if (thread >= 0)
+            wakeThread(thread);
+    }
+
+    // Registered by the bgworker, see jvm.c
+    private static native void wakeThread(int thread);
+}
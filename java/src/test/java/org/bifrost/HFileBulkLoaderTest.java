@@ -0,0 +1,212 @@
+package org.bifrost;
+
+import org.apache.hadoop.conf.Configuration;
+import org.apache.hadoop.fs.FileSystem;
+import org.apache.hadoop.fs.LocatedFileStatus;
+import org.apache.hadoop.fs.Path;
+import org.apache.hadoop.fs.RemoteIterator;
+import org.apache.hadoop.hbase.HBaseTestingUtility;
+import org.apache.hadoop.hbase.HColumnDescriptor;
+import org.apache.hadoop.hbase.HTableDescriptor;
+import org.apache.hadoop.hbase.TableName;
+import org.apache.hadoop.hbase.client.Admin;
+import org.apache.hadoop.hbase.client.Connection;
+import org.apache.hadoop.hbase.client.ConnectionFactory;
+import org.apache.hadoop.hbase.client.Put;
+import org.apache.hadoop.hbase.client.Result;
+import org.apache.hadoop.hbase.client.ResultScanner;
+import org.apache.hadoop.hbase.client.Scan;
+import org.apache.hadoop.hbase.client.Table;
+import org.apache.hadoop.hbase.io.encoding.DataBlockEncoding;
+import org.apache.hadoop.hbase.io.hfile.CacheConfig;
+import org.apache.hadoop.hbase.io.hfile.HFile;
+import org.apache.hadoop.hbase.regionserver.BloomType;
+import org.apache.hadoop.hbase.regionserver.HRegion;
+import org.apache.hadoop.hbase.regionserver.StoreFile;
+import org.apache.hadoop.hbase.util.Bytes;
+import org.junit.AfterClass;
+import org.junit.BeforeClass;
+import org.junit.Test;
+
+import java.io.IOException;
+import java.util.ArrayList;
+import java.util.List;
+import java.util.Map;
+
+import static org.junit.Assert.assertEquals;
+import static org.junit.Assert.assertTrue;
+
+/**
+ * Bulk loads through HFileBulkLoader into a mini cluster that keeps its
+ * data on the local filesystem, and reads the rows back.
+ */
+public class HFileBulkLoaderTest {
+    private static final byte[] FAMILY = Bytes.toBytes("f");
+    private static final byte[] QUALIFIER = Bytes.toBytes("q");
+
+    // Small enough that every Put is written out to a file of its own
+    private static final long TINY_BUFFER = 1;
+    private static final long LARGE_BUFFER = 64L << 20;
+
+    private static final HBaseTestingUtility util = new HBaseTestingUtility();
+    private static Connection conn;
+    private static FileSystem fs;
+
+    @BeforeClass
+    public static void startCluster() throws Exception {
+        // Without a mini DFS the cluster uses the local filesystem
+        util.startMiniZKCluster();
+        util.startMiniHBaseCluster(1, 1);
+        conn = ConnectionFactory.createConnection(util.getConfiguration());
+        fs = FileSystem.get(util.getConfiguration());
+    }
+
+    @AfterClass
+    public static void stopCluster() throws Exception {
+        if (conn != null)
+            conn.close();
+        util.shutdownMiniCluster();
+    }
+
+    private static TableName createTable(final String name, final HColumnDescriptor family,
+                                         final byte[]... splitKeys) throws IOException {
+        final TableName tableName = TableName.valueOf(name);
+        final HTableDescriptor desc = new HTableDescriptor(tableName);
+        desc.addFamily(family);
+        try (Admin admin = conn.getAdmin()) {
+            if (splitKeys.length == 0)
+                admin.createTable(desc);
+            else
+                admin.createTable(desc, splitKeys);
+        }
+        util.waitUntilAllRegionsAssigned(tableName);
+        return tableName;
+    }
+
+    private static TableName createTable(final String name, final byte[]... splitKeys) throws IOException {
+        return createTable(name, new HColumnDescriptor(FAMILY), splitKeys);
+    }
+
+    private static HFileBulkLoader loader(final TableName tableName, final Path root, final long bufferBytes)
+            throws IOException {
+        return new HFileBulkLoader(conn, tableName, util.getConfiguration(), root, bufferBytes);
+    }
+
+    private static Put put(final String row, final long ts, final String value) {
+        return new Put(Bytes.toBytes(row)).addColumn(FAMILY, QUALIFIER, ts, Bytes.toBytes(value));
+    }
+
+    private static List<Path> hfiles(final Path root) throws IOException {
+        final List<Path> result = new ArrayList<>();
+        if (!fs.exists(root))
+            return result;
+        final RemoteIterator<LocatedFileStatus> it = fs.listFiles(root, true);
+        while (it.hasNext()) {
+            final Path path = it.next().getPath();
+            if (path.getName().startsWith("hfile-"))
+                result.add(path);
+        }
+        return result;
+    }
+
+    /** Every row of the table as "row=value". */
+    private static List<String> readRows(final TableName tableName) throws IOException {
+        final List<String> rows = new ArrayList<>();
+        try (Table table = conn.getTable(tableName);
+             ResultScanner scanner = table.getScanner(new Scan())) {
+            for (Result result : scanner)
+                rows.add(Bytes.toString(result.getRow()) + "=" + Bytes.toString(result.getValue(FAMILY, QUALIFIER)));
+        }
+        return rows;
+    }
+
+    @Test
+    public void lastWriteWinsForDuplicateKeys() throws IOException {
+        final TableName tableName = createTable("duplicates");
+        try (HFileBulkLoader loader = loader(tableName, util.getDataTestDir("duplicates"), LARGE_BUFFER)) {
+            loader.mutate(put("row", 1, "first"));
+            loader.mutate(put("other", 1, "only"));
+            loader.mutate(put("row", 1, "second"));
+            loader.flush();
+        }
+        final List<String> expected = new ArrayList<>();
+        expected.add("other=only");
+        expected.add("row=second");
+        assertEquals(expected, readRows(tableName));
+    }
+
+    @Test
+    public void loadsSeveralFilesPerFamily() throws IOException {
+        final TableName tableName = createTable("spill");
+        final Path root = util.getDataTestDir("spill");
+        final List<String> expected = new ArrayList<>();
+        try (HFileBulkLoader loader = loader(tableName, root, TINY_BUFFER)) {
+            for (int i = 0; i < 5; i++) {
+                loader.mutate(put("row" + i, 1, "value" + i));
+                expected.add("row" + i + "=value" + i);
+            }
+            assertEquals(5, hfiles(root).size());
+            loader.flush();
+            assertEquals(0, hfiles(root).size());
+        }
+        assertEquals(expected, readRows(tableName));
+    }
+
+    @Test
+    public void loadSpansRegionSplit() throws IOException {
+        final TableName tableName = createTable("split", Bytes.toBytes("m"));
+        final List<String> expected = new ArrayList<>();
+        try (HFileBulkLoader loader = loader(tableName, util.getDataTestDir("split"), LARGE_BUFFER)) {
+            // One file holding keys on both sides of the split
+            for (char c = 'a'; c <= 'z'; c++) {
+                loader.mutate(put(String.valueOf(c), 1, "value-" + c));
+                expected.add(c + "=value-" + c);
+            }
+            loader.flush();
+        }
+        assertEquals(expected, readRows(tableName));
+
+        final List<HRegion> regions = util.getHBaseCluster().getRegions(tableName);
+        assertEquals(2, regions.size());
+        for (HRegion region : regions)
+            assertTrue(region.getStore(FAMILY).getStorefilesCount() > 0);
+    }
+
+    @Test
+    public void closeWithoutFlushDropsFiles() throws IOException {
+        final TableName tableName = createTable("unflushed");
+        final Path root = util.getDataTestDir("unflushed");
+        try (HFileBulkLoader loader = loader(tableName, root, TINY_BUFFER)) {
+            for (int i = 0; i < 3; i++)
+                loader.mutate(put("row" + i, 1, "value" + i));
+            assertEquals(3, hfiles(root).size());
+        }
+        assertEquals(0, hfiles(root).size());
+        assertEquals(0, readRows(tableName).size());
+    }
+
+    @Test
+    public void filesUseFamilySettings() throws IOException {
+        final HColumnDescriptor family = new HColumnDescriptor(FAMILY)
+            .setDataBlockEncoding(DataBlockEncoding.PREFIX)
+            .setBloomFilterType(BloomType.ROWCOL);
+        final TableName tableName = createTable("settings", family);
+        final Path root = util.getDataTestDir("settings");
+        final Configuration conf = util.getConfiguration();
+        try (HFileBulkLoader loader = loader(tableName, root, TINY_BUFFER)) {
+            loader.mutate(put("row", 1, "value"));
+            final List<Path> files = hfiles(root);
+            assertEquals(1, files.size());
+
+            final HFile.Reader reader = HFile.createReader(fs, files.get(0), new CacheConfig(conf), conf);
+            try {
+                final Map<byte[], byte[]> fileInfo = reader.loadFileInfo();
+                assertEquals(DataBlockEncoding.PREFIX, reader.getDataBlockEncoding());
+                assertEquals(BloomType.ROWCOL.toString(),
+                             Bytes.toString(fileInfo.get(StoreFile.BLOOM_FILTER_TYPE_KEY)));
+            } finally {
+                reader.close();
+            }
+        }
+    }
+}
@@ -16,16 +16,60 @@ static JavaVM *jvm = NULL;
 static JNIEnv *jvm_env = NULL;
 void *hbase_connector = NULL;
 
+/* Classes and methods used by a worker thread, resolved when it attaches */
+struct JniContext
+{
+	JNIEnv *env;
+
+	jclass pg_hbase_column_class;
+	jmethodID pg_hbase_column_constructor;
+
+	jclass filter_creator_class;
+	jmethodID filter_creator_constructor;
+	jmethodID add_row_key_equals_filter;
+	jmethodID add_row_key_part_filter;
+	jmethodID add_row_key_prefix_filter;
+	jmethodID add_bool_filter;
+
+	jclass hbase_connector_class;
+	jmethodID get_table;
+	jmethodID register_table;
+	jmethodID forget_table;
+	jmethodID make_scanner;
+	jmethodID make_direct_modifier;
+
+	jmethodID make_mutator;
+
+	jclass scanner_class;
+	jmethodID poll;
+
+	jclass mutator_class;
+	jmethodID mutate;
+	jmethodID start_flush;
+	jmethodID poll_mutator;
+
+	/* Closes both scanners and mutators */
+	jclass closeable_class;
+	jmethodID close_scanner;
+};
+
 static void log_exception(JNIEnv *env);
+static void describe_exception(JNIEnv *env, char *buf, size_t len);
+static int exception_message(JniContext *ctx, ScannerData *data, const char *what);
 static void hbase_worker(void);
 static jbyteArray make_byte_array(JNIEnv *env, char *bytes, int len);
 static void parse_hbase_data(char *data);
-static void release_scanner_bytes(void *env_, ScannerData *scanner_data);
 
 static jobject create_hbase_connector(JNIEnv *env);
+static bool register_natives(JNIEnv *env);
+static bool init_jni_context(JniContext *ctx);
+static void free_jni_context(JniContext *ctx);
+
+/* The bgworker main thread's, for forget_table_template */
+static JniContext *main_context = NULL;
 
 static jobject
-create_filters(JNIEnv *env, HBaseFilter *filters, int nr_filters);
+create_filters(JniContext *ctx, HBaseFilter *filters, int nr_filters, char *params);
 
 
 void open_jvm_lib(char *libjvm_path)
@@ -49,23 +93,171 @@ void initialize_hbase_connector(void)
 	{
 		pg_elog(ERROR, "Failed to create HBaseConnector");
 	}
+	if (!register_natives(jvm_env))
+	{
+		pg_elog(ERROR, "Failed to register native methods");
+	}
+
+	pg_palloc(main_context, sizeof(JniContext));
+	main_context->env = jvm_env;
+	if (!init_jni_context(main_context))
+	{
+		pg_elog(ERROR, "Failed to look up JNI classes and methods");
+	}
+}
+
+/* Milliseconds left until the deadline, at least 0 */
+static int
+ms_until(TimestampTz deadline)
+{
+	long secs;
+	int usecs;
+
+	TimestampDifference(GetCurrentTimestamp(), deadline, &secs, &usecs);
+	return secs >= INT_MAX / 1000 ? INT_MAX : (int) (secs * 1000 + usecs / 1000);
+}
+
+/*
+ * Connect to HBase and cache the region locations of the given comma separated
+ * tables, so the first scans after a restart don't pay for those lookups.
+ * Failures are only logged: scans still connect on demand.  Whatever is left
+ * at the deadline is skipped, so scans are let in by then.
+ */
+void
+prewarm_hbase_connector(char *tables, TimestampTz deadline)
+{
+	JNIEnv *env = jvm_env;
+	jclass clz = NULL;
+	jmethodID connect = NULL;
+	jmethodID prewarm_table = NULL;
+	char *list = NULL;
+	char *name;
+	char *saveptr;
+
+	clz = (*env)->GetObjectClass(env, hbase_connector);
+	if (clz == NULL)
+	{
+		log_exception(env);
+		pg_elog(WARNING, "Failed to get HBaseConnector class");
+		goto error_exit;
+	}
+
+	connect = (*env)->GetMethodID(env, clz, "connect", "(I)V");
+	prewarm_table = (*env)->GetMethodID(env, clz, "prewarmTable", "([BI)I");
+	if (connect == NULL || prewarm_table == NULL)
+	{
+		log_exception(env);
+		pg_elog(WARNING, "Failed to get HBaseConnector prewarm methods");
+		goto error_exit;
+	}
+
+	(*env)->CallVoidMethod(env, hbase_connector, connect, (jint) ms_until(deadline));
+	if ((*env)->ExceptionCheck(env))
+	{
+		log_exception(env);
+		pg_elog(WARNING, "Failed to connect to HBase");
+		goto error_exit;
+	}
+
+	if (tables != NULL)
+	{
+		with_pg_lock(list = pstrdup(tables));
+		for (name = strtok_r(list, ", ", &saveptr);
+			 name != NULL;
+			 name = strtok_r(NULL, ", ", &saveptr))
+		{
+			jbyteArray arr;
+			jint regions;
+			int timeout_ms = ms_until(deadline);
+
+			if (timeout_ms <= 0)
+			{
+				pg_elog(WARNING, "Ran out of hbase_fdw.startup_timeout, not looking up the regions of %s", name);
+				record_prewarmed_table(false, 0);
+				continue;
+			}
+
+			arr = make_byte_array(env, name, strlen(name));
+			if (arr == NULL)
+			{
+				record_prewarmed_table(false, 0);
+				continue;
+			}
+
+			regions = (*env)->CallIntMethod(env, hbase_connector, prewarm_table, arr,
+											(jint) timeout_ms);
+			(*env)->DeleteLocalRef(env, arr);
+			if ((*env)->ExceptionCheck(env))
+			{
+				log_exception(env);
+				pg_elog(WARNING, "Failed to look up the regions of %s", name);
+				record_prewarmed_table(false, 0);
+				continue;
+			}
+
+			pg_elog(LOG, "Cached the locations of %d regions of %s", regions, name);
+			record_prewarmed_table(true, regions);
+		}
+		pg_pfree(list);
+	}
+
+	set_connector_state(connector_state_connected);
+	goto exit;
+
+ error_exit:
+	set_connector_state(connector_state_unavailable);
+ exit:
+	if (clz != NULL)
+		(*env)->DeleteLocalRef(env, clz);
+}
+
+/*
+ * Drop the JVM's template of a table that was dropped or altered, or with
+ * InvalidOid as dboid, every template.  Called from the bgworker's main loop.
+ */
+void
+forget_table_template(Oid dboid, Oid relid)
+{
+	JNIEnv *env = jvm_env;
+
+	if (hbase_connector == NULL || main_context == NULL)
+		return;
+
+	(*env)->CallVoidMethod(env, hbase_connector, main_context->forget_table,
+						   (jint) dboid, (jint) relid);
+	if ((*env)->ExceptionCheck(env))
+	{
+		log_exception(env);
+		pg_elog(WARNING, "Failed to forget table template");
+	}
 }
 
 void
 destroy_hbase_connector(void)
 {
+	if (main_context != NULL)
+	{
+		free_jni_context(main_context);
+		main_context = NULL;
+	}
 	if (hbase_connector == NULL) return;
 	(*jvm_env)->DeleteGlobalRef(jvm_env, hbase_connector);
 	hbase_connector = NULL;
 }
 
 
-void create_java_vm(char *java_classpath)
+/*
+ * Start the JVM with the given classpath and list of option strings.  The
+ * options are passed in order, so later ones override earlier ones.
+ */
+void create_java_vm(char *java_classpath, List *jvm_options)
 {
 	char *classpath_prefix = "-Djava.class.path=";
 	JavaVMInitArgs vm_args;
-	JavaVMOption options[4];
+	JavaVMOption *options;
 	char *classpath;
+	ListCell *lc;
+	int n = 0;
 
 	if (java_classpath == NULL)
 		elog(FATAL, "Java classpath must be set");
@@ -74,14 +266,17 @@ void create_java_vm(char *java_classpath)
 	strcpy(classpath, classpath_prefix);
 	strcat(classpath, java_classpath);
 
-	options[3].optionString = "-Xrs";
-	options[1].optionString = "-Xusealtsigs";
-	options[2].optionString = "-Xmx1024M";
-	options[0].optionString = classpath;
+	options = palloc0(sizeof(JavaVMOption) * (list_length(jvm_options) + 1));
+	options[n++].optionString = classpath;
+	foreach(lc, jvm_options)
+	{
+		options[n++].optionString = lfirst(lc);
+		elog(DEBUG1, "JVM option: %s", (char *) lfirst(lc));
+	}
 
 	vm_args.version = JNI_VERSION_1_8;
-    vm_args.nOptions = 4;
-    vm_args.options = &options[0];
+    vm_args.nOptions = n;
+    vm_args.options = options;
     vm_args.ignoreUnrecognized = 0;
 
 	if (jvm != NULL)
@@ -101,6 +296,7 @@ void create_java_vm(char *java_classpath)
 	elog(LOG, "Creating JVM");
 	if (JNI_CreateJavaVM_ptr(&jvm, (void**)&jvm_env, &vm_args) < 0)
 		elog(FATAL, "Could not create JavaVM");
+	pfree(options);
 	pfree(classpath);
 }
 
@@ -229,6 +425,57 @@ log_exception(JNIEnv *env)
 	(*env)->DeleteLocalRef(env, t);
 }
 
+/*
+ * Copy the message of the pending exception into buf.  The exception is left
+ * pending so that log_exception can still print its stack trace.
+ */
+static void
+describe_exception(JNIEnv *env, char *buf, size_t len)
+{
+	jthrowable t = NULL;
+	jclass clz = NULL;
+	jmethodID toString = NULL;
+	jstring str = NULL;
+	const char *chars;
+
+	strlcpy(buf, "unknown Java exception", len);
+
+	t = (*env)->ExceptionOccurred(env);
+	if (t == NULL)
+		return;
+
+	(*env)->ExceptionClear(env);
+
+	clz = (*env)->GetObjectClass(env, t);
+	if (clz == NULL)
+		goto exit;
+
+	toString = (*env)->GetMethodID(env, clz, "toString", "()Ljava/lang/String;");
+	if (toString == NULL)
+		goto exit;
+
+	str = (*env)->CallObjectMethod(env, t, toString);
+	if (str == NULL || (*env)->ExceptionCheck(env))
+		goto exit;
+
+	chars = (*env)->GetStringUTFChars(env, str, NULL);
+	if (chars != NULL)
+	{
+		strlcpy(buf, chars, len);
+		(*env)->ReleaseStringUTFChars(env, str, chars);
+	}
+
+ exit:
+	(*env)->ExceptionClear(env);
+	(*env)->Throw(env, t);
+
+	if (str != NULL)
+		(*env)->DeleteLocalRef(env, str);
+	if (clz != NULL)
+		(*env)->DeleteLocalRef(env, clz);
+	(*env)->DeleteLocalRef(env, t);
+}
+
 static void
 hbase_worker(void)
 {
@@ -396,6 +643,70 @@ make_byte_array(JNIEnv *env, char *bytes, int len)
 	return NULL;
 }
 
+static void JNICALL
+wake_thread_native(JNIEnv *env, jclass clz, jint thread)
+{
+	if (thread >= 0 && thread < HBASE_FDW_NUM_WORKERS)
+		wake_thread(thread);
+}
+
+static bool
+register_natives(JNIEnv *env)
+{
+	JNINativeMethod methods[] = {
+		{"wakeThread", "(I)V", (void *) wake_thread_native}
+	};
+	jclass clz = (*env)->FindClass(env, "org/bifrost/WorkerWakeup");
+	bool success;
+
+	if (clz == NULL)
+	{
+		log_exception(env);
+		pg_elog(WARNING, "Failed to get org/bifrost/WorkerWakeup");
+		return false;
+	}
+	success = (*env)->RegisterNatives(env, clz, methods, lengthof(methods)) == 0;
+	if (!success)
+		log_exception(env);
+	(*env)->DeleteLocalRef(env, clz);
+	return success;
+}
+
+/* Let the scans the thread creates wake it, see WorkerWakeup */
+static bool
+register_worker_wakeup(JNIEnv *env, int thread)
+{
+	jclass clz = (*env)->FindClass(env, "org/bifrost/WorkerWakeup");
+	jmethodID register_thread;
+	bool success = false;
+
+	if (clz == NULL)
+	{
+		log_exception(env);
+		pg_elog(WARNING, "Failed to get org/bifrost/WorkerWakeup");
+		return false;
+	}
+	register_thread = (*env)->GetStaticMethodID(env, clz, "register", "(I)V");
+	if (register_thread == NULL)
+	{
+		log_exception(env);
+		pg_elog(WARNING, "Failed to get WorkerWakeup.register");
+		goto exit;
+	}
+	(*env)->CallStaticVoidMethod(env, clz, register_thread, (jint) thread);
+	if ((*env)->ExceptionCheck(env))
+	{
+		log_exception(env);
+		pg_elog(WARNING, "Failed to register worker thread %d for wakeups", thread);
+		goto exit;
+	}
+	success = true;
+
+ exit:
+	(*env)->DeleteLocalRef(env, clz);
+	return success;
+}
+
 static jobject
 create_hbase_connector(JNIEnv *env)
 {
@@ -665,59 +976,248 @@ pg_jsonb(void *env_, char *s)
 	pg_pfree(buf);
 }
 
-void *
-jvm_attach_thread(void)
+/*
+ * Resolve a class and keep a global reference to it, so it stays valid for
+ * the lifetime of the thread.
+ */
+static jclass
+find_global_class(JNIEnv *env, char *class_name)
+{
+	jclass local_class;
+	jclass global_class;
+
+	local_class = (*env)->FindClass(env, class_name);
+	if (local_class == NULL)
+	{
+		log_exception(env);
+		pg_elog(WARNING, "Failed to find %s", class_name);
+		return NULL;
+	}
+
+	global_class = (*env)->NewGlobalRef(env, local_class);
+	(*env)->DeleteLocalRef(env, local_class);
+	if (global_class == NULL)
+	{
+		log_exception(env);
+		pg_elog(WARNING, "Failed to make global reference to %s", class_name);
+	}
+	return global_class;
+}
+
+static jmethodID
+find_method(JNIEnv *env, jclass clz, char *class_name, char *name, char *signature)
+{
+	jmethodID method = (*env)->GetMethodID(env, clz, name, signature);
+	if (method == NULL)
+	{
+		log_exception(env);
+		pg_elog(WARNING, "Failed to get %s from %s", name, class_name);
+	}
+	return method;
+}
+
+/*
+ * Look up every class and method the scan path uses.  This runs once per
+ * worker thread, so starting a scan makes no reflective calls at all.
+ */
+static bool
+init_jni_context(JniContext *ctx)
+{
+	JNIEnv *env = ctx->env;
+
+	ctx->pg_hbase_column_class = find_global_class(env, "org/bifrost/PgHbaseColumn");
+	if (ctx->pg_hbase_column_class == NULL)
+		return false;
+
+	ctx->pg_hbase_column_constructor = find_method(
+		env, ctx->pg_hbase_column_class, "org/bifrost/PgHbaseColumn",
+		"<init>", "(ZZZ[B[BICIIZII)V");
+	if (ctx->pg_hbase_column_constructor == NULL)
+		return false;
+
+	ctx->filter_creator_class = find_global_class(env, "org/bifrost/HBaseFilterCreator");
+	if (ctx->filter_creator_class == NULL)
+		return false;
+
+	ctx->filter_creator_constructor = find_method(
+		env, ctx->filter_creator_class, "org/bifrost/HBaseFilterCreator",
+		"<init>", "()V");
+	if (ctx->filter_creator_constructor == NULL)
+		return false;
+
+	ctx->add_row_key_equals_filter = find_method(
+		env, ctx->filter_creator_class, "org/bifrost/HBaseFilterCreator",
+		"addRowKeyEqualsFilter", "([B)V");
+	if (ctx->add_row_key_equals_filter == NULL)
+		return false;
+
+	ctx->add_row_key_part_filter = find_method(
+		env, ctx->filter_creator_class, "org/bifrost/HBaseFilterCreator",
+		"addRowKeyPartFilter", "(III[B)V");
+	if (ctx->add_row_key_part_filter == NULL)
+		return false;
+
+	ctx->add_row_key_prefix_filter = find_method(
+		env, ctx->filter_creator_class, "org/bifrost/HBaseFilterCreator",
+		"addRowKeyPrefixFilter", "([B)V");
+	if (ctx->add_row_key_prefix_filter == NULL)
+		return false;
+
+	ctx->add_bool_filter = find_method(
+		env, ctx->filter_creator_class, "org/bifrost/HBaseFilterCreator",
+		"addBoolFilter", "(II)V");
+	if (ctx->add_bool_filter == NULL)
+		return false;
+
+	ctx->hbase_connector_class = find_global_class(env, "org/bifrost/HBaseConnector");
+	if (ctx->hbase_connector_class == NULL)
+		return false;
+
+	ctx->get_table = find_method(
+		env, ctx->hbase_connector_class, "org/bifrost/HBaseConnector",
+		"getTable", "(III)Lorg/bifrost/TableTemplate;");
+	if (ctx->get_table == NULL)
+		return false;
+
+	ctx->register_table = find_method(
+		env, ctx->hbase_connector_class, "org/bifrost/HBaseConnector",
+		"registerTable", "(III[B[Lorg/bifrost/PgHbaseColumn;)Lorg/bifrost/TableTemplate;");
+	if (ctx->register_table == NULL)
+		return false;
+
+	ctx->forget_table = find_method(
+		env, ctx->hbase_connector_class, "org/bifrost/HBaseConnector",
+		"forgetTable", "(II)V");
+	if (ctx->forget_table == NULL)
+		return false;
+
+	ctx->make_scanner = find_method(
+		env, ctx->hbase_connector_class, "org/bifrost/HBaseConnector",
+		"makeScanner",
+		"(Lorg/bifrost/TableTemplate;Lorg/bifrost/HBaseFilterCreator;ZIZ)Lorg/bifrost/Scanner;");
+	if (ctx->make_scanner == NULL)
+		return false;
+
+	ctx->make_direct_modifier = find_method(
+		env, ctx->hbase_connector_class, "org/bifrost/HBaseConnector",
+		"makeDirectModifier",
+		"(Lorg/bifrost/TableTemplate;Lorg/bifrost/HBaseFilterCreator;IILjava/nio/ByteBuffer;)Lorg/bifrost/Scanner;");
+	if (ctx->make_direct_modifier == NULL)
+		return false;
+
+	ctx->make_mutator = find_method(
+		env, ctx->hbase_connector_class, "org/bifrost/HBaseConnector",
+		"makeMutator",
+		"(Lorg/bifrost/TableTemplate;ZI)Lorg/bifrost/PgToHBaseMutator;");
+	if (ctx->make_mutator == NULL)
+		return false;
+
+	ctx->scanner_class = find_global_class(env, "org/bifrost/Scanner");
+	if (ctx->scanner_class == NULL)
+		return false;
+
+	ctx->poll = find_method(
+		env, ctx->scanner_class, "org/bifrost/Scanner",
+		"poll", "(Ljava/nio/ByteBuffer;)I");
+	if (ctx->poll == NULL)
+		return false;
+
+	ctx->mutator_class = find_global_class(env, "org/bifrost/PgToHBaseMutator");
+	if (ctx->mutator_class == NULL)
+		return false;
+
+	ctx->mutate = find_method(
+		env, ctx->mutator_class, "org/bifrost/PgToHBaseMutator",
+		"mutate", "(Ljava/nio/ByteBuffer;)V");
+	if (ctx->mutate == NULL)
+		return false;
+
+	ctx->start_flush = find_method(
+		env, ctx->mutator_class, "org/bifrost/PgToHBaseMutator",
+		"startFlush", "()V");
+	if (ctx->start_flush == NULL)
+		return false;
+
+	ctx->poll_mutator = find_method(
+		env, ctx->mutator_class, "org/bifrost/PgToHBaseMutator",
+		"poll", "()I");
+	if (ctx->poll_mutator == NULL)
+		return false;
+
+	ctx->closeable_class = find_global_class(env, "java/lang/AutoCloseable");
+	if (ctx->closeable_class == NULL)
+		return false;
+
+	ctx->close_scanner = find_method(
+		env, ctx->closeable_class, "java/lang/AutoCloseable",
+		"close", "()V");
+	if (ctx->close_scanner == NULL)
+		return false;
+
+	return true;
+}
+
+static void
+free_jni_context(JniContext *ctx)
+{
+	JNIEnv *env = ctx->env;
+
+	if (ctx->pg_hbase_column_class != NULL)
+		(*env)->DeleteGlobalRef(env, ctx->pg_hbase_column_class);
+	if (ctx->filter_creator_class != NULL)
+		(*env)->DeleteGlobalRef(env, ctx->filter_creator_class);
+	if (ctx->hbase_connector_class != NULL)
+		(*env)->DeleteGlobalRef(env, ctx->hbase_connector_class);
+	if (ctx->scanner_class != NULL)
+		(*env)->DeleteGlobalRef(env, ctx->scanner_class);
+	if (ctx->mutator_class != NULL)
+		(*env)->DeleteGlobalRef(env, ctx->mutator_class);
+	if (ctx->closeable_class != NULL)
+		(*env)->DeleteGlobalRef(env, ctx->closeable_class);
+	pg_pfree(ctx);
+}
+
+JniContext *
+jvm_attach_thread(int thread)
 {
 	void* env = NULL;
+	JniContext *ctx;
 	int i = 0;
 	if ((i = (*jvm)->AttachCurrentThread(jvm, &env, NULL)) < 0) {
 		pg_elog(WARNING, "There was a problem: %d", i);
+		return NULL;
 	}
-	return env;
+
+	pg_palloc(ctx, sizeof(JniContext));
+	ctx->env = env;
+	if (!init_jni_context(ctx) || !register_worker_wakeup(env, thread))
+	{
+		free_jni_context(ctx);
+		(*jvm)->DetachCurrentThread(jvm);
+		return NULL;
+	}
+	return ctx;
 }
 
 void
-jvm_detach_thread(void)
+jvm_detach_thread(JniContext *ctx)
 {
+	if (ctx != NULL)
+		free_jni_context(ctx);
 	(*jvm)->DetachCurrentThread(jvm);
 }
 
 void *
-create_pg_hbase_columns(void *env_, HBaseColumn *columns, size_t n_columns)
+create_pg_hbase_columns(JniContext *ctx, HBaseColumn *columns, size_t n_columns)
 {
-	JNIEnv *env = env_;
-	char *hbase_column_class_name = "org/bifrost/PgHbaseColumn";
-	char *hbase_column_constructor_name = "<init>";
-	char *hbase_column_constructor_signature = "(ZZZ[B[B)V";
-	jmethodID hbase_column_constructor = NULL;
-	jclass hbase_column_class = NULL;
+	JNIEnv *env = ctx->env;
 	jobjectArray res = NULL;
 	size_t i;
 
-	hbase_column_class = (*env)->FindClass(env, hbase_column_class_name);
-	if (hbase_column_class == NULL)
-	{
-		pg_elog(WARNING, "Failed to find %s", hbase_column_class_name);
-		log_exception(env);
-		goto error_exit;
-	}
-
-	hbase_column_constructor = (*env)->GetMethodID(
-		env,
-		hbase_column_class,
-		hbase_column_constructor_name,
-		hbase_column_constructor_signature);
-	if (hbase_column_constructor == NULL)
-	{
-		pg_elog(WARNING, "Failed to get constructor for %s", hbase_column_class_name);
-		log_exception(env);
-		goto error_exit;
-	}
-
-	res = (*env)->NewObjectArray(env, n_columns, hbase_column_class, NULL);
+	res = (*env)->NewObjectArray(env, n_columns, ctx->pg_hbase_column_class, NULL);
 	if (res == NULL)
 	{
-		pg_elog(WARNING, "Failed to create object array of %s", hbase_column_class_name);
+		pg_elog(WARNING, "Failed to create object array of PgHbaseColumn");
 		log_exception(env);
 		goto error_exit;
 	}
@@ -752,13 +1252,20 @@ create_pg_hbase_columns(void *env_, HBaseColumn *columns, size_t n_columns)
 
 		column = (*env)->NewObject(
 			env,
-			hbase_column_class,
-			hbase_column_constructor,
+			ctx->pg_hbase_column_class,
+			ctx->pg_hbase_column_constructor,
 			(jboolean)col->row_key,
 			(jboolean)col->family,
 			(jboolean)col->column,
 			family_name,
-			qualifier
+			qualifier,
+			(jint)col->attlen,
+			(jchar)col->attalign,
+			(jint)col->value_type,
+			(jint)col->encoding,
+			(jboolean)col->row_key_part,
+			(jint)col->key_offset,
+			(jint)col->key_width
 			);
 
 		if (column == NULL || (*env)->ExceptionCheck(env))
@@ -784,92 +1291,49 @@ create_pg_hbase_columns(void *env_, HBaseColumn *columns, size_t n_columns)
 			(*env)->DeleteLocalRef(env, column);
 
 		if (family_name != NULL)
-			(*env)->DeleteLocalRef(env, column);
+			(*env)->DeleteLocalRef(env, family_name);
 
 		if (qualifier != NULL)
-			(*env)->DeleteLocalRef(env, column);
+			(*env)->DeleteLocalRef(env, qualifier);
 
 		if (error)
 			goto error_exit;
 	}
 
-	goto exit;
+	return res;
 
  error_exit:
 	if (res != NULL)
-	{
 		(*env)->DeleteLocalRef(env, res);
-		res = NULL;
-	}
 
- exit:
-	if (hbase_column_class != NULL)
-		(*env)->DeleteLocalRef(env, hbase_column_class);
+	return NULL;
+}
 
-	return res;
+static HBaseParamValue *
+lookup_param(char *params, int n)
+{
+	HBaseParamValue *param = (HBaseParamValue *) params;
+
+	while (n-- > 0)
+		param = (HBaseParamValue *) ((char *) param + HBASE_FDW_PARAM_SIZE(param->len));
+	return param;
 }
 
 static jobject
-create_filters(JNIEnv *env, HBaseFilter *filters, int nr_filters)
+create_filters(JniContext *ctx, HBaseFilter *filters, int nr_filters, char *params)
 {
-	char *filter_creator_class_name = "org/bifrost/HBaseFilterCreator";
-	char *row_key_equals_creator_method_name = "addRowKeyEqualsFilter";
-	char *row_key_equals_creator_method_signature = "([B)V";
-	char *constructor_method_name = "<init>";
-	char *constructor_method_signature = "()V";
-	jclass filter_creator_class = NULL;
-	jmethodID constructor_method = NULL;
-	jmethodID row_key_equals_creator = NULL;
+	JNIEnv *env = ctx->env;
 	jobject creator = NULL;
 
-	filter_creator_class = (*env)->FindClass(env, filter_creator_class_name);
-	if (filter_creator_class == NULL)
-	{
-		log_exception(env);
-		pg_elog(WARNING, "Failed get %s class", filter_creator_class_name);
-		goto error_exit;
-	}
-
-	constructor_method = (*env)->GetMethodID(
-		env,
-		filter_creator_class,
-		constructor_method_name,
-		constructor_method_signature);
-
-	if (constructor_method == NULL)
-	{
-		log_exception(env);
-		pg_elog(WARNING, "Failed to get %s from %s",
-				constructor_method_name,
-				filter_creator_class_name);
-		goto error_exit;
-	}
-
-	row_key_equals_creator = (*env)->GetMethodID(
-		env,
-		filter_creator_class,
-		row_key_equals_creator_method_name,
-		row_key_equals_creator_method_signature);
-
-	if (row_key_equals_creator == NULL)
-	{
-		log_exception(env);
-		pg_elog(WARNING, "Failed to get %s from %s",
-				row_key_equals_creator_method_name,
-				filter_creator_class_name);
-		goto error_exit;
-	}
-
 	creator = (*env)->NewObject(
 		env,
-		filter_creator_class,
-		constructor_method);
+		ctx->filter_creator_class,
+		ctx->filter_creator_constructor);
 
 	if (creator == NULL)
 	{
 		log_exception(env);
-		pg_elog(WARNING, "Failed to create %s object",
-				filter_creator_class_name);
+		pg_elog(WARNING, "Failed to create HBaseFilterCreator object");
 		goto error_exit;
 	}
 
@@ -880,10 +1344,13 @@ create_filters(JNIEnv *env, HBaseFilter *filters, int nr_filters)
 		{
 			case filter_type_row_key_equals:
 			{
-				jobject row_key = make_byte_array(env,
-												  filter->row_key_equals.row_key,
-												  strlen(filter->row_key_equals.row_key));
-				if(row_key == NULL)
+				HBaseParamValue *value = lookup_param(params, filter->row_key_equals.param);
+				jobject row_key = NULL;
+
+				/* A NULL key matches nothing, which Java handles for us */
+				if (value->len >= 0)
+					row_key = make_byte_array(env, value->data, value->len);
+				if (value->len >= 0 && row_key == NULL)
 				{
 					log_exception(env);
 					pg_elog(WARNING, "Failed to create row key byte array");
@@ -893,7 +1360,7 @@ create_filters(JNIEnv *env, HBaseFilter *filters, int nr_filters)
 				(*env)->CallVoidMethod(
 					env,
 					creator,
-					row_key_equals_creator,
+					ctx->add_row_key_equals_filter,
 					row_key);
 
 				(*env)->DeleteLocalRef(env, row_key);
@@ -905,54 +1372,131 @@ create_filters(JNIEnv *env, HBaseFilter *filters, int nr_filters)
 				}
 				break;
 			}
+			case filter_type_row_key_part:
+			{
+				HBaseParamValue *value = lookup_param(params, filter->row_key_part.param);
+				jobject bytes = NULL;
+
+				if (value->len >= 0)
+				{
+					bytes = make_byte_array(env, value->data, value->len);
+					if (bytes == NULL)
+					{
+						log_exception(env);
+						pg_elog(WARNING, "Failed to create row key component byte array");
+						goto error_exit;
+					}
+				}
+
+				(*env)->CallVoidMethod(
+					env,
+					creator,
+					ctx->add_row_key_part_filter,
+					(jint)filter->row_key_part.column,
+					(jint)filter->row_key_part.strategy,
+					(jint)filter->row_key_part.param_type,
+					bytes);
+
+				(*env)->DeleteLocalRef(env, bytes);
+				if ((*env)->ExceptionCheck(env))
+				{
+					log_exception(env);
+					pg_elog(WARNING, "Failed to create row_key_part filter");
+					goto error_exit;
+				}
+				break;
+			}
+			case filter_type_row_key_prefix:
+			{
+				HBaseParamValue *value = lookup_param(params, filter->row_key_prefix.param);
+				jobject prefix = NULL;
+
+				if (value->len >= 0)
+					prefix = make_byte_array(env, value->data, value->len);
+				if (value->len >= 0 && prefix == NULL)
+				{
+					log_exception(env);
+					pg_elog(WARNING, "Failed to create row key prefix byte array");
+					goto error_exit;
+				}
+
+				(*env)->CallVoidMethod(
+					env,
+					creator,
+					ctx->add_row_key_prefix_filter,
+					prefix);
+
+				(*env)->DeleteLocalRef(env, prefix);
+				if ((*env)->ExceptionCheck(env))
+				{
+					log_exception(env);
+					pg_elog(WARNING, "Failed to create row_key_prefix filter");
+					goto error_exit;
+				}
+				break;
+			}
+			case filter_type_and:
+			case filter_type_or:
+			case filter_type_not:
+			{
+				(*env)->CallVoidMethod(
+					env,
+					creator,
+					ctx->add_bool_filter,
+					(jint)filter->filter_type,
+					(jint)filter->bool_expr.nargs);
+
+				if ((*env)->ExceptionCheck(env))
+				{
+					log_exception(env);
+					pg_elog(WARNING, "Failed to create boolean filter");
+					goto error_exit;
+				}
+				break;
+			}
 			default:
-				continue;
+				pg_elog(WARNING, "Unknown filter type: %d", filter->filter_type);
+				goto error_exit;
 		}
 	}
 
-	goto exit;
+	return creator;
 
  error_exit:
-	(*env)->DeleteLocalRef(env, creator);
-	creator = NULL;
-
- exit:
-	(*env)->DeleteLocalRef(env, filter_creator_class);
-	return creator;
+	if (creator != NULL)
+		(*env)->DeleteLocalRef(env, creator);
+	return NULL;
 }
 
-ScannerData
-setup_scanner(void *env_, char *table,
-			  HBaseColumn *c_columns, int nr_columns,
-			  HBaseFilter *filters, int nr_filters)
+/*
+ * Fetch the JVM's template for the command's table, building it only when
+ * the table hasn't been scanned before or its options have changed.
+ */
+static jobject
+get_table_template(JniContext *ctx, HBaseCommand *command, HBaseColumn *c_columns)
 {
-	char *make_scanner_method_name = "makeScanner";
-	char *make_scanner_method_signature =
-		"([B[Lorg/bifrost/PgHbaseColumn;Lorg/bifrost/HBaseFilterCreator;)Lorg/bifrost/Scanner;";
-	char *scan_method_name = "scan";
-	char *scan_method_signature = "()[B";
-
-	JNIEnv *env = env_;
+	JNIEnv *env = ctx->env;
 	jobject columns = NULL;
 	jbyteArray table_name = NULL;
-	jclass hbase_connector_class = NULL;
-	jmethodID make_scanner = NULL;
-	jobject local_scanner_ref = NULL;
-	jobject global_scanner_ref = NULL;
-	jclass scanner_class = NULL;
-	jmethodID scan_method = NULL;
-	ScannerData res = { NULL, NULL, NULL, NULL };
-	jobject filter_obj = NULL;
+	jobject table = NULL;
 
-	filter_obj = create_filters(env, filters, nr_filters);
-	if (filter_obj== NULL)
+	table = (*env)->CallObjectMethod(
+		env,
+		hbase_connector,
+		ctx->get_table,
+		(jint)command->dboid,
+		(jint)command->relid,
+		(jint)command->options_version);
+	if ((*env)->ExceptionCheck(env))
 	{
 		log_exception(env);
-		pg_elog(WARNING, "Failed to create filters");
-		goto exit;
+		pg_elog(WARNING, "Failed to look up table template");
+		return NULL;
 	}
+	if (table != NULL)
+		return table;
 
-	columns = create_pg_hbase_columns(env_, c_columns, nr_columns);
+	columns = create_pg_hbase_columns(ctx, c_columns, command->nr_columns);
 	if (columns == NULL)
 	{
 		log_exception(env);
@@ -960,40 +1504,96 @@ setup_scanner(void *env_, char *table,
 		goto exit;
 	}
 
-	hbase_connector_class = (*env)->GetObjectClass(env, hbase_connector);
-	if (hbase_connector_class == NULL)
+	table_name = make_byte_array(env, command->table_name, strlen(command->table_name));
+	if (table_name == NULL)
 	{
 		log_exception(env);
-		pg_elog(WARNING, "Failed get hbase_connector class");
+		pg_elog(WARNING, "Failed to make table name byte array");
 		goto exit;
 	}
 
-	make_scanner = (*env)->GetMethodID(env, hbase_connector_class,
-									   make_scanner_method_name,
-									   make_scanner_method_signature);
-	if (make_scanner == NULL)
+	table = (*env)->CallObjectMethod(
+		env,
+		hbase_connector,
+		ctx->register_table,
+		(jint)command->dboid,
+		(jint)command->relid,
+		(jint)command->options_version,
+		table_name,
+		columns);
+	if (table == NULL || (*env)->ExceptionCheck(env))
 	{
 		log_exception(env);
-		pg_elog(WARNING, "Failed to get make scanner method");
-		goto exit;
+		pg_elog(WARNING, "Failed to register table template");
+		table = NULL;
 	}
 
-	table_name = make_byte_array(env, table, strlen(table));
-	if (table_name == NULL)
+ exit:
+	(*env)->DeleteLocalRef(env, table_name);
+	(*env)->DeleteLocalRef(env, columns);
+	return table;
+}
+
+ScannerData
+setup_scanner(JniContext *ctx, HBaseCommand *command,
+			  HBaseColumn *c_columns, HBaseFilter *filters, char *params)
+{
+	JNIEnv *env = ctx->env;
+	jobject table = NULL;
+	jobject local_scanner_ref = NULL;
+	jobject global_scanner_ref = NULL;
+	ScannerData res = { NULL, NULL, NULL };
+	jobject filter_obj = NULL;
+	jobject buffer = NULL;
+	jobject values = NULL;
+	char *ptr = NULL;
+
+	filter_obj = create_filters(ctx, filters, command->nr_filters, params);
+	if (filter_obj== NULL)
 	{
 		log_exception(env);
-		pg_elog(WARNING, "Failed to make table name byte array");
+		pg_elog(WARNING, "Failed to create filters");
 		goto exit;
 	}
 
-	local_scanner_ref = (*env)->CallObjectMethod(
-		env,
-		hbase_connector,
-		make_scanner,
-		table_name,
-		columns,
-		filter_obj
-		);
+	table = get_table_template(ctx, command, c_columns);
+	if (table == NULL)
+		goto exit;
+
+	if (command->operation == operation_direct_modify)
+	{
+		char *start = (char *) lookup_param(params, command->nr_params);
+		char *end = (char *) lookup_param(start, command->nr_columns);
+
+		values = (*env)->NewDirectByteBuffer(env, start, end - start);
+		if (values == NULL)
+		{
+			log_exception(env);
+			pg_elog(WARNING, "Failed to create update values buffer");
+			goto exit;
+		}
+
+		local_scanner_ref = (*env)->CallObjectMethod(
+			env,
+			hbase_connector,
+			ctx->make_direct_modifier,
+			table,
+			filter_obj,
+			(jint)command->timeout_ms,
+			(jint)command->mutation_type,
+			values);
+	}
+	else
+		local_scanner_ref = (*env)->CallObjectMethod(
+			env,
+			hbase_connector,
+			ctx->make_scanner,
+			table,
+			filter_obj,
+			(jboolean)command->heap_tuples,
+			(jint)command->timeout_ms,
+			(jboolean)command->collect_metrics
+			);
 	if (local_scanner_ref == NULL || (*env)->ExceptionCheck(env))
 	{
 		log_exception(env);
@@ -1009,103 +1609,215 @@ setup_scanner(void *env_, char *table,
 		goto exit;
 	}
 
-	scanner_class = (*env)->GetObjectClass(env, global_scanner_ref);
-	if (scanner_class == NULL)
-	{
-		log_exception(env);
-		pg_elog(WARNING, "Failed to create global scanner ref");
-		goto exit;
-	}
-
-	scan_method = (*env)->GetMethodID(env,
-									  scanner_class,
-									  scan_method_name,
-									  scan_method_signature);
-	if (scan_method == NULL)
+	pg_palloc(ptr, HBASE_FDW_CHUNK_SIZE);
+	buffer = (*env)->NewDirectByteBuffer(env, ptr, HBASE_FDW_CHUNK_SIZE);
+	if (buffer == NULL)
 	{
 		log_exception(env);
-		pg_elog(WARNING, "Failed to create global scanner ref");
+		pg_elog(WARNING, "Failed to create scan buffer");
+		pg_pfree(ptr);
 		goto exit;
 	}
 
-	res.scan = scan_method;
 	res.scanner = global_scanner_ref;
+	res.buffer = buffer;
+	res.ptr = ptr;
 
 
  exit:
-	(*env)->DeleteLocalRef(env, scanner_class);
 	(*env)->DeleteLocalRef(env, local_scanner_ref);
-	(*env)->DeleteLocalRef(env, table_name);
-	(*env)->DeleteLocalRef(env, hbase_connector_class);
-	(*env)->DeleteLocalRef(env, columns);
+	(*env)->DeleteLocalRef(env, table);
 	(*env)->DeleteLocalRef(env, filter_obj);
+	(*env)->DeleteLocalRef(env, values);
 
-	if (res.scanner == NULL)
+	if (res.scanner == NULL && global_scanner_ref != NULL)
 		(*env)->DeleteGlobalRef(env, global_scanner_ref);
 
 	return res;
 }
 
-bool
-scan_row(void *env_, ScannerData *data)
+/*
+ * Have the scanner write the next message into the scan buffer and return its
+ * length, 0 if HBase hasn't delivered the next row yet, or
+ * HBASE_FDW_POLL_AGAIN if the scanner has more to do first.  A failed call is
+ * turned into a msg_type_error message, so the caller always has something to
+ * forward to the backend.
+ */
+int
+poll_row(JniContext *ctx, ScannerData *data)
 {
-	JNIEnv *env = env_;
-	jobject byte_array;
-	release_scanner_bytes(env, data);
-	byte_array = (*env)->CallObjectMethod(
+	JNIEnv *env = ctx->env;
+	jint len;
+
+	len = (*env)->CallIntMethod(
 		env,
 		data->scanner,
-		data->scan);
+		ctx->poll,
+		data->buffer);
 	if ((*env)->ExceptionCheck(env))
+		return exception_message(ctx, data, "Failed to do scan.");
+	return len;
+}
+
+/*
+ * Turn the pending exception into a msg_type_error message in the scan
+ * buffer, and return the message's length.
+ */
+static int
+exception_message(JniContext *ctx, ScannerData *data, const char *what)
+{
+	JNIEnv *env = ctx->env;
+	HBaseFdwMessage *msg = (HBaseFdwMessage *) data->ptr;
+	Size max_len = HBASE_FDW_CHUNK_SIZE - offsetof(HBaseFdwMessage, data);
+
+	describe_exception(env, msg->data, max_len);
+	pg_elog(WARNING, "%s", what);
+	log_exception(env);
+	msg->msg_type = msg_type_error;
+	msg->data_len = strlen(msg->data);
+	return offsetof(HBaseFdwMessage, data) + msg->data_len;
+}
+
+void
+destroy_scanner(JniContext *ctx, ScannerData *scanner_data)
+{
+	JNIEnv *env = ctx->env;
+	if (scanner_data->scanner != NULL)
+	{
+		/*
+		 * Stops a scanner's read ahead, which would otherwise wait for us
+		 * forever, or flushes and closes a mutator.
+		 */
+		(*env)->CallVoidMethod(env, scanner_data->scanner, ctx->close_scanner);
+		if ((*env)->ExceptionCheck(env))
+		{
+			log_exception(env);
+			pg_elog(WARNING, "Failed to close scanner");
+		}
+		(*env)->DeleteGlobalRef(env, scanner_data->scanner);
+	}
+	scanner_data->scanner = NULL;
+
+	if (scanner_data->buffer != NULL)
+		(*env)->DeleteLocalRef(env, scanner_data->buffer);
+	scanner_data->buffer = NULL;
+
+	if (scanner_data->ptr != NULL)
+		pg_pfree(scanner_data->ptr);
+	scanner_data->ptr = NULL;
+}
+
+/*
+ * Start writing to the command's table.  Like a scanner, the mutator comes
+ * with a buffer for the messages sent back to the backend.
+ */
+ScannerData
+setup_mutator(JniContext *ctx, HBaseCommand *command, HBaseColumn *c_columns)
+{
+	JNIEnv *env = ctx->env;
+	jobject table = NULL;
+	jobject local_mutator_ref = NULL;
+	ScannerData res = { NULL, NULL, NULL };
+
+	table = get_table_template(ctx, command, c_columns);
+	if (table == NULL)
+		goto exit;
+
+	local_mutator_ref = (*env)->CallObjectMethod(
+		env,
+		hbase_connector,
+		ctx->make_mutator,
+		table,
+		(jboolean)command->bulk_load,
+		(jint)command->timeout_ms);
+	if (local_mutator_ref == NULL || (*env)->ExceptionCheck(env))
 	{
-		pg_elog(WARNING, "Failed to do scan.");
 		log_exception(env);
-		return false;
+		pg_elog(WARNING, "Failed to create mutator");
+		goto exit;
 	}
-	if (byte_array == NULL)
-		return false;
 
-	data->byte_array = byte_array;
-	data->ptr = (char*)(*env)->GetByteArrayElements(env, byte_array, 0);
-	if (data->ptr == NULL)
+	res.scanner = (*env)->NewGlobalRef(env, local_mutator_ref);
+	if (res.scanner == NULL)
 	{
-		pg_elog(WARNING, "Failed to get scanner data");
 		log_exception(env);
-		release_scanner_bytes(env, data);
-		return false;
+		pg_elog(WARNING, "Failed to create global mutator ref");
+		goto exit;
 	}
-	return true;
+	pg_palloc(res.ptr, HBASE_FDW_CHUNK_SIZE);
+
+ exit:
+	(*env)->DeleteLocalRef(env, local_mutator_ref);
+	(*env)->DeleteLocalRef(env, table);
+	return res;
 }
 
-static void
-release_scanner_bytes(void *env_, ScannerData *scanner_data)
+/*
+ * Start writing a batch of mutations, which must not be called while the
+ * mutator is busy, see poll_mutator.  Returns 0, or the length of an error
+ * message to send to the backend.
+ */
+int
+apply_mutations(JniContext *ctx, ScannerData *data, char *batch, Size len)
 {
-	JNIEnv *env = env_;
-	if (scanner_data->ptr != NULL) {
-		(*env)->ReleaseByteArrayElements(
-			env,
-			scanner_data->byte_array,
-			(signed char*)scanner_data->ptr,
-			0);
-		scanner_data->ptr = NULL;
-	}
-	(*env)->DeleteLocalRef(env, scanner_data->byte_array);
-	scanner_data->byte_array = NULL;
+	JNIEnv *env = ctx->env;
+	jobject buffer;
+
+	buffer = (*env)->NewDirectByteBuffer(env, batch, len);
+	if (buffer == NULL)
+		return exception_message(ctx, data, "Failed to create mutation buffer");
+
+	(*env)->CallVoidMethod(env, data->scanner, ctx->mutate, buffer);
+	(*env)->DeleteLocalRef(env, buffer);
+	if ((*env)->ExceptionCheck(env))
+		return exception_message(ctx, data, "Failed to apply mutations");
+	return 0;
 }
 
-void
-destroy_scanner(void *env_, ScannerData *scanner_data)
+/*
+ * Start writing out everything mutated so far.  Like apply_mutations, and
+ * poll_mutator replies once the flush is done.
+ */
+int
+start_flush(JniContext *ctx, ScannerData *data)
 {
-	JNIEnv *env = env_;
-	(*env)->DeleteGlobalRef(env, scanner_data->scanner);
-	scanner_data->scanner = NULL;
-	scanner_data->scan = NULL;
+	JNIEnv *env = ctx->env;
+
+	(*env)->CallVoidMethod(env, data->scanner, ctx->start_flush);
+	if ((*env)->ExceptionCheck(env))
+		return exception_message(ctx, data, "Failed to flush mutations");
+	return 0;
 }
 
-void
-free_local_jvm_obj(void *env_, void *object)
+/* Results of PgToHBaseMutator.poll */
+#define MUTATOR_IDLE 0
+#define MUTATOR_BUSY 1
+#define MUTATOR_FLUSHED 2
+
+/*
+ * Check on the mutator's write or flush in flight.  Returns the length of
+ * the reply to the backend's flush, msg_type_end_of_stream once it is done
+ * or an error if a write failed, or 0 with *busy telling whether a write is
+ * still in flight.
+ */
+int
+poll_mutator(JniContext *ctx, ScannerData *data, bool *busy)
 {
-	JNIEnv *env = env_;
-	if (object != NULL)
-		(*env)->DeleteLocalRef(env, object);
+	JNIEnv *env = ctx->env;
+	HBaseFdwMessage *msg = (HBaseFdwMessage *) data->ptr;
+	jint state;
+
+	*busy = false;
+	state = (*env)->CallIntMethod(env, data->scanner, ctx->poll_mutator);
+	if ((*env)->ExceptionCheck(env))
+		return exception_message(ctx, data, "Failed to write mutations");
+
+	if (state == MUTATOR_BUSY)
+		*busy = true;
+	if (state != MUTATOR_FLUSHED)
+		return 0;
+
+	msg->msg_type = msg_type_end_of_stream;
+	msg->data_len = 0;
+	return offsetof(HBaseFdwMessage, data);
 }
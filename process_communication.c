@@ -9,8 +9,22 @@
 #include "storage/spin.h"
 #include "storage/ipc.h"
 #include "storage/lwlock.h"
+#include "port/atomics.h"
 #include "miscadmin.h"
+#include "pgstat.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/htup_details.h"
+#include "catalog/pg_type.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
 
+/*
+ * A slot for one running scan.  Slots are handed to the worker threads by
+ * maintain_workers, and each thread serves several of them.
+ */
 typedef struct hbase_fdw_worker
 {
 	slock_t mutex;
@@ -18,22 +32,92 @@ typedef struct hbase_fdw_worker
 	bool shutdown;
 	bool is_activated;
 	bool is_working;
+	bool cancelled;			/* the backend no longer wants the rows */
 	dsm_handle dsm_handle;
 	dsm_segment *seg;
-	HBaseCommand command;
+	HBaseCommand command;		/* copied when the bgworker picks the scan up */
+
+	/* Shown by hbase_fdw_stat_activity, protected by mutex */
+	int backend_pid;
+	TimestampTz requested;		/* when the backend first asked for a slot */
+	TimestampTz started;		/* when the bgworker picked the scan up */
+
+	HBaseScanStats stats;
 } hbase_fdw_worker;
 
+/* Totals over every scan since the server started */
+typedef struct hbase_fdw_totals {
+	pg_atomic_uint64 scans;
+	pg_atomic_uint64 modifies;
+	pg_atomic_uint64 cancelled;
+	pg_atomic_uint64 failed;
+	pg_atomic_uint64 rows;
+	pg_atomic_uint64 bytes;
+	pg_atomic_uint64 hbase_us;
+	pg_atomic_uint64 blocked_us;
+	pg_atomic_uint64 queue_wait_us;
+	pg_atomic_uint64 duration_histogram[HBASE_FDW_HISTOGRAM_BUCKETS];
+	pg_atomic_uint64 queue_wait_histogram[HBASE_FDW_HISTOGRAM_BUCKETS];
+} hbase_fdw_totals;
+
+/* Tables dropped or altered that the bgworker hasn't caught up with yet */
+#define HBASE_FDW_FORGOTTEN_TABLES 64
+
+typedef struct hbase_fdw_table_key {
+	Oid dboid;
+	Oid relid;
+} hbase_fdw_table_key;
+
 typedef struct hbase_fdw_control {
 	LWLock *lock;
 	slock_t mutex;
 	int num_workers;
 	Latch *latch;
+	pg_atomic_uint64 queue_memory_used;
+
+	/* Progress of the bgworker's startup, protected by mutex */
+	HBaseConnectorState connector_state;
+	TimestampTz startup_deadline;	/* scans give up waiting after this */
+	int prewarmed_tables;
+	int prewarm_failures;
+	int64 prewarmed_regions;
+
+	hbase_fdw_totals totals;
+
+	/*
+	 * Ring of the tables whose templates the JVM should drop, see
+	 * forget_table.  Protected by mutex.
+	 */
+	uint64 forgotten_count;
+	hbase_fdw_table_key forgotten[HBASE_FDW_FORGOTTEN_TABLES];
+
+	/* See report_wait_start and set_thread_state */
+	int wait_tranche_ids[num_wait_events];
+	pg_atomic_uint32 thread_state[HBASE_FDW_NUM_WORKERS];
+
 	hbase_fdw_worker worker[FLEXIBLE_ARRAY_MEMBER];
 } hbase_fdw_control;
 
+/* Must be kept in the order of HBaseWaitEvent */
+static const char *wait_event_names[] = {
+	"hbase_fdw_admission",
+	"hbase_fdw_first_row",
+	"hbase_fdw_next_row",
+	"hbase_fdw_send_mutations",
+	"hbase_fdw_modify_reply",
+	"hbase_fdw_bgworker_main"
+};
+
+static LWLockTranche wait_tranches[num_wait_events];
+
 static hbase_fdw_control *control;
+
+/* How much of the forgotten ring the bgworker has handled */
+static uint64 forgotten_seen = 0;
 static void hbase_fdw_shmem_startup(void);
 static size_t ss_size(void);
+static void record_queue_wait(hbase_fdw_worker *worker);
+static void bgworker_exit(int code, Datum arg);
 
 static shmem_startup_hook_type old_startup_hook;
 
@@ -53,7 +137,41 @@ static size_t
 ss_size(void)
 {
 	return sizeof(*control) +
-		HBASE_FDW_NUM_WORKERS * sizeof(hbase_fdw_worker);
+		HBASE_FDW_MAX_SCANS * sizeof(hbase_fdw_worker);
+}
+
+static void
+init_totals(hbase_fdw_totals *totals)
+{
+	pg_atomic_init_u64(&totals->scans, 0);
+	pg_atomic_init_u64(&totals->modifies, 0);
+	pg_atomic_init_u64(&totals->cancelled, 0);
+	pg_atomic_init_u64(&totals->failed, 0);
+	pg_atomic_init_u64(&totals->rows, 0);
+	pg_atomic_init_u64(&totals->bytes, 0);
+	pg_atomic_init_u64(&totals->hbase_us, 0);
+	pg_atomic_init_u64(&totals->blocked_us, 0);
+	pg_atomic_init_u64(&totals->queue_wait_us, 0);
+	for (int i = 0; i < HBASE_FDW_HISTOGRAM_BUCKETS; i++)
+	{
+		pg_atomic_init_u64(&totals->duration_histogram[i], 0);
+		pg_atomic_init_u64(&totals->queue_wait_histogram[i], 0);
+	}
+}
+
+/* Bucket 0 counts times under 1ms, bucket n those under 2^n ms */
+static int
+histogram_bucket(uint64 us)
+{
+	uint64 ms = us / 1000;
+	int bucket = 0;
+
+	while (ms > 0 && bucket < HBASE_FDW_HISTOGRAM_BUCKETS - 1)
+	{
+		ms >>= 1;
+		bucket++;
+	}
+	return bucket;
 }
 
 static void
@@ -71,7 +189,24 @@ hbase_fdw_shmem_startup(void)
 	if (!found) {
 		control->lock = &(GetNamedLWLockTranche("hbase_fdw"))->lock;
 		SpinLockInit(&control->mutex);
-		control->num_workers = HBASE_FDW_NUM_WORKERS;
+		control->num_workers = HBASE_FDW_MAX_SCANS;
+		control->latch = NULL;
+		pg_atomic_init_u64(&control->queue_memory_used, 0);
+		control->connector_state = connector_state_starting;
+		/* Also bounds the wait when the bgworker never gets to start */
+		control->startup_deadline =
+			TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+										hbase_fdw_startup_timeout);
+		control->prewarmed_tables = 0;
+		control->prewarm_failures = 0;
+		control->prewarmed_regions = 0;
+		control->forgotten_count = 0;
+		init_totals(&control->totals);
+
+		for (int i = 0; i < num_wait_events; i++)
+			control->wait_tranche_ids[i] = LWLockNewTrancheId();
+		for (int i = 0; i < HBASE_FDW_NUM_WORKERS; i++)
+			pg_atomic_init_u32(&control->thread_state[i], scan_state_idle);
 
 		for (int i = 0; i < control->num_workers; i++)
 		{
@@ -79,12 +214,33 @@ hbase_fdw_shmem_startup(void)
 			SpinLockInit(&worker->mutex);
 			worker->is_activated = false;
 			worker->is_working = false;
+			worker->cancelled = false;
 			worker->worker_num = i;
 			worker->shutdown = false;
 			worker->dsm_handle = 0;
+			worker->backend_pid = 0;
+			worker->stats.thread = -1;
+			pg_atomic_init_u32(&worker->stats.state, scan_state_idle);
+			pg_atomic_init_u64(&worker->stats.rows, 0);
+			pg_atomic_init_u64(&worker->stats.bytes, 0);
+			pg_atomic_init_u64(&worker->stats.hbase_us, 0);
+			pg_atomic_init_u64(&worker->stats.blocked_us, 0);
 		}
 	}
 
+	/*
+	 * The tranches only name our wait events, they have no locks.  Every
+	 * process needs them registered to show the names, which backends
+	 * inherit from the postmaster.
+	 */
+	for (int i = 0; i < num_wait_events; i++)
+	{
+		wait_tranches[i].name = wait_event_names[i];
+		wait_tranches[i].array_base = NULL;
+		wait_tranches[i].array_stride = sizeof(LWLock);
+		LWLockRegisterTranche(control->wait_tranche_ids[i], &wait_tranches[i]);
+	}
+
 	elog(LOG, "Initialized shared memory");
 
 	LWLockRelease(AddinShmemInitLock);
@@ -93,11 +249,55 @@ hbase_fdw_shmem_startup(void)
 		old_startup_hook();
 }
 
+/*
+ * Called by the bgworker before it starts connecting, with the time scans
+ * should stop waiting for it.  A previous bgworker may have left slots
+ * behind; their segments went away with it, so they are simply freed.
+ */
 void
-setup_bgworker(void)
+setup_bgworker(TimestampTz deadline)
 {
+	for (int i = 0; i < control->num_workers; i++)
+	{
+		hbase_fdw_worker *worker = &control->worker[i];
+
+		SpinLockAcquire(&worker->mutex);
+		if (worker->is_working)
+		{
+			worker->is_working = false;
+			worker->cancelled = false;
+			worker->seg = NULL;
+			worker->dsm_handle = 0;
+			worker->backend_pid = 0;
+			pg_atomic_write_u32(&worker->stats.state, scan_state_idle);
+		}
+		SpinLockRelease(&worker->mutex);
+	}
+	for (int i = 0; i < HBASE_FDW_NUM_WORKERS; i++)
+		pg_atomic_write_u32(&control->thread_state[i], scan_state_idle);
+
+	SpinLockAcquire(&control->mutex);
+	control->connector_state = connector_state_starting;
+	control->startup_deadline = deadline;
+	control->prewarmed_tables = 0;
+	control->prewarm_failures = 0;
+	control->prewarmed_regions = 0;
 	control->latch = MyLatch;
-	pg_write_barrier();
+	/* A new JVM has no templates to forget */
+	forgotten_seen = control->forgotten_count;
+	SpinLockRelease(&control->mutex);
+
+	before_shmem_exit(bgworker_exit, (Datum) 0);
+}
+
+/* However the bgworker exits, stop scans from waiting for it */
+static void
+bgworker_exit(int code, Datum arg)
+{
+	SpinLockAcquire(&control->mutex);
+	control->connector_state = connector_state_stopped;
+	control->latch = NULL;
+	SpinLockRelease(&control->mutex);
 }
 
 void
@@ -112,10 +312,12 @@ maintain_workers(void)
 			dsm_segment *seg;
 			shm_mq *mq;
 			shm_mq_handle *handle;
+			shm_mq_handle *mutations_handle = NULL;
 			shm_toc *toc;
 			HBaseCommand *command;
 			HBaseColumn *columns;
 			HBaseFilter *filters;
+			char *params;
 
 			worker->is_activated = false;
 			if (worker->dsm_handle == 0)
@@ -123,7 +325,7 @@ maintain_workers(void)
 				pg_elog(WARNING, "Expected a dsm handle");
 				goto unlock_worker;
 			}
-			seg = dsm_attach(worker->dsm_handle);
+			with_pg_lock(seg = dsm_attach(worker->dsm_handle));
 			if (seg == NULL)
 			{
 				pg_elog(WARNING, "Failed to find segment");
@@ -143,12 +345,26 @@ maintain_workers(void)
 			columns = shm_toc_lookup(toc, 2);
 			filters = shm_toc_lookup(toc, 3);
 			mq = shm_toc_lookup(toc, 4);
+			params = shm_toc_lookup(toc, 5);
 			shm_mq_set_sender(mq, MyProc);
 
-			handle = shm_mq_attach(mq, seg, NULL);
+			with_pg_lock(handle = shm_mq_attach(mq, seg, NULL));
+
+			if (command->operation == operation_modify)
+			{
+				shm_mq *mutations_mq = shm_toc_lookup(toc, 6);
+
+				shm_mq_set_receiver(mutations_mq, MyProc);
+				with_pg_lock(mutations_handle = shm_mq_attach(mutations_mq, seg, NULL));
+			}
+
 			worker->is_working = true;
 			worker->seg = seg;
-			thread_start_worker(i, handle, command, columns, filters);
+			worker->command = *command;
+			worker->started = GetCurrentTimestamp();
+			record_queue_wait(worker);
+			pg_atomic_write_u32(&worker->stats.state, scan_state_hbase);
+			thread_start_worker(i, handle, mutations_handle, command, columns, filters, params);
 		}
 
 	unlock_worker:
@@ -156,9 +372,117 @@ maintain_workers(void)
 	}
 }
 
-bool
-activate_worker(dsm_handle handle)
+/* How long the scan waited for a slot and for the bgworker to notice it */
+static void
+record_queue_wait(hbase_fdw_worker *worker)
 {
+	long secs;
+	int usecs;
+	uint64 wait_us;
+
+	TimestampDifference(worker->requested, worker->started, &secs, &usecs);
+	wait_us = (uint64) secs * 1000000 + usecs;
+	pg_atomic_fetch_add_u64(&control->totals.queue_wait_us, wait_us);
+	pg_atomic_fetch_add_u64(&control->totals.queue_wait_histogram[histogram_bucket(wait_us)], 1);
+}
+
+HBaseScanStats *
+scan_stats(int n)
+{
+	return &control->worker[n].stats;
+}
+
+/*
+ * Add a scan's counters to the totals.  Called by the worker thread that
+ * served it, before the slot is reset.
+ */
+void
+record_scan_finished(int n, uint64 duration_us, bool cancelled, bool failed)
+{
+	hbase_fdw_worker *worker = &control->worker[n];
+	hbase_fdw_totals *totals = &control->totals;
+
+	if (worker->command.operation == operation_scan)
+		pg_atomic_fetch_add_u64(&totals->scans, 1);
+	else
+		pg_atomic_fetch_add_u64(&totals->modifies, 1);
+	if (cancelled)
+		pg_atomic_fetch_add_u64(&totals->cancelled, 1);
+	if (failed)
+		pg_atomic_fetch_add_u64(&totals->failed, 1);
+	pg_atomic_fetch_add_u64(&totals->rows, pg_atomic_read_u64(&worker->stats.rows));
+	pg_atomic_fetch_add_u64(&totals->bytes, pg_atomic_read_u64(&worker->stats.bytes));
+	pg_atomic_fetch_add_u64(&totals->hbase_us, pg_atomic_read_u64(&worker->stats.hbase_us));
+	pg_atomic_fetch_add_u64(&totals->blocked_us, pg_atomic_read_u64(&worker->stats.blocked_us));
+	pg_atomic_fetch_add_u64(&totals->duration_histogram[histogram_bucket(duration_us)], 1);
+}
+
+void
+set_thread_state(int thread, HBaseScanState state)
+{
+	pg_atomic_write_u32(&control->thread_state[thread], state);
+}
+
+void
+report_wait_start(HBaseWaitEvent event)
+{
+	pgstat_report_wait_start(WAIT_LWLOCK_TRANCHE, control->wait_tranche_ids[event]);
+}
+
+void
+report_wait_end(void)
+{
+	pgstat_report_wait_end();
+}
+
+void
+set_connector_state(HBaseConnectorState state)
+{
+	SpinLockAcquire(&control->mutex);
+	control->connector_state = state;
+	SpinLockRelease(&control->mutex);
+}
+
+void
+record_prewarmed_table(bool success, int regions)
+{
+	SpinLockAcquire(&control->mutex);
+	if (success)
+	{
+		control->prewarmed_tables++;
+		control->prewarmed_regions += regions;
+	}
+	else
+		control->prewarm_failures++;
+	SpinLockRelease(&control->mutex);
+}
+
+/*
+ * Returns the slot the scan was given, or -1 if none is free.  Scans are
+ * also turned away until the bgworker has finished connecting and
+ * prewarming, and the caller waits as if every slot were taken.  Once the
+ * bgworker has exited, or is still starting past hbase_fdw.startup_timeout,
+ * returns HBASE_FDW_WORKER_UNAVAILABLE instead.
+ */
+int
+activate_worker(dsm_handle handle, TimestampTz requested)
+{
+	HBaseConnectorState state;
+	TimestampTz deadline;
+	Latch *latch;
+
+	SpinLockAcquire(&control->mutex);
+	state = control->connector_state;
+	deadline = control->startup_deadline;
+	latch = control->latch;
+	SpinLockRelease(&control->mutex);
+	if (state == connector_state_stopped)
+		return HBASE_FDW_WORKER_UNAVAILABLE;
+	if (state == connector_state_starting)
+		return GetCurrentTimestamp() < deadline ? -1 : HBASE_FDW_WORKER_UNAVAILABLE;
+	if (latch == NULL)
+		return HBASE_FDW_WORKER_UNAVAILABLE;
+
 	for (int i = 0; i < control->num_workers; i++)
 	{
 		bool success = false;
@@ -166,34 +490,436 @@ activate_worker(dsm_handle handle)
 		SpinLockAcquire(&worker->mutex);
 		if (!worker->is_activated && !worker->is_working && !worker->shutdown)
 		{
-			pg_elog(LOG, "Activating worker");
 			worker->is_activated = true;
+			worker->cancelled = false;
 			worker->dsm_handle = handle;
 			worker->seg = NULL;
+			worker->backend_pid = MyProcPid;
+			worker->requested = requested;
+			worker->started = 0;
+			worker->stats.thread = -1;
+			pg_atomic_write_u32(&worker->stats.state, scan_state_queued);
+			pg_atomic_write_u64(&worker->stats.rows, 0);
+			pg_atomic_write_u64(&worker->stats.bytes, 0);
+			pg_atomic_write_u64(&worker->stats.hbase_us, 0);
+			pg_atomic_write_u64(&worker->stats.blocked_us, 0);
 			success = true;
 		}
 		SpinLockRelease(&worker->mutex);
 		if (success)
 		{
-			SetLatch(control->latch);
-			return true;
+			SetLatch(latch);
+			return i;
 		}
 	}
-	return false;
+	return -1;
+}
+
+/*
+ * Have the bgworker drop the JVM's template of a table, after the table was
+ * dropped or altered.  Only templates of dropped tables would stay around
+ * otherwise, as an altered table's next scan replaces its template.
+ */
+void
+forget_table(Oid dboid, Oid relid)
+{
+	Latch *latch;
+
+	if (control == NULL)
+		return;
+
+	SpinLockAcquire(&control->mutex);
+	control->forgotten[control->forgotten_count % HBASE_FDW_FORGOTTEN_TABLES].dboid = dboid;
+	control->forgotten[control->forgotten_count % HBASE_FDW_FORGOTTEN_TABLES].relid = relid;
+	control->forgotten_count++;
+	latch = control->latch;
+	SpinLockRelease(&control->mutex);
+
+	if (latch != NULL)
+		SetLatch(latch);
 }
 
+/*
+ * Called by the bgworker to pass on what forget_table recorded.  If the ring
+ * wrapped around since the last call, every template is dropped.
+ */
+void
+forget_dropped_tables(void)
+{
+	hbase_fdw_table_key keys[HBASE_FDW_FORGOTTEN_TABLES];
+	int n = 0;
+	bool overflowed;
+
+	SpinLockAcquire(&control->mutex);
+	overflowed = control->forgotten_count - forgotten_seen > HBASE_FDW_FORGOTTEN_TABLES;
+	for (; !overflowed && forgotten_seen < control->forgotten_count; forgotten_seen++)
+		keys[n++] = control->forgotten[forgotten_seen % HBASE_FDW_FORGOTTEN_TABLES];
+	forgotten_seen = control->forgotten_count;
+	SpinLockRelease(&control->mutex);
+
+	if (overflowed)
+		forget_table_template(InvalidOid, InvalidOid);
+	for (int i = 0; i < n; i++)
+		forget_table_template(keys[i].dboid, keys[i].relid);
+}
+
+/*
+ * Ask the worker to stop a scan.  The handle makes sure the slot still holds
+ * our scan, as it is reused as soon as the worker is done with it.
+ */
+void
+cancel_worker(int n, dsm_handle handle)
+{
+	hbase_fdw_worker *worker = &control->worker[n];
+	Latch *latch;
+
+	SpinLockAcquire(&worker->mutex);
+	if (worker->dsm_handle == handle && (worker->is_activated || worker->is_working))
+		worker->cancelled = true;
+	SpinLockRelease(&worker->mutex);
+
+	/* Have the thread serving it notice, see wake_threads */
+	SpinLockAcquire(&control->mutex);
+	latch = control->latch;
+	SpinLockRelease(&control->mutex);
+	if (latch != NULL)
+		SetLatch(latch);
+}
+
+bool
+worker_cancelled(int n)
+{
+	hbase_fdw_worker *worker = &control->worker[n];
+	bool cancelled;
+
+	SpinLockAcquire(&worker->mutex);
+	cancelled = worker->cancelled;
+	SpinLockRelease(&worker->mutex);
+	return cancelled;
+}
+
+/*
+ * Called from the worker threads, which share the process's list of attached
+ * segments, hence the postgres lock around the detach.
+ */
 void
 reset_worker(int n)
 {
 	hbase_fdw_worker *worker = &control->worker[n];
+	dsm_segment *seg;
+
+	SpinLockAcquire(&worker->mutex);
+	seg = worker->seg;
+	worker->seg = NULL;
+	SpinLockRelease(&worker->mutex);
+
+	if (seg != NULL)
+		with_pg_lock(dsm_detach(seg));
+
 	SpinLockAcquire(&worker->mutex);
 	worker->is_working = false;
 	worker->is_activated = false;
-	if (worker->seg != NULL)
-	{
-		dsm_detach(worker->seg);
-		worker->seg = NULL;
-	}
+	worker->cancelled = false;
 	worker->dsm_handle = 0;
+	worker->backend_pid = 0;
+	pg_atomic_write_u32(&worker->stats.state, scan_state_idle);
 	SpinLockRelease(&worker->mutex);
 }
+
+/*
+ * Take up to `wanted` bytes of tuple queue memory out of the budget shared by
+ * all backends.  If the budget is exhausted the scan still gets the minimum
+ * queue size, so a busy server degrades to small queues instead of failing.
+ */
+Size
+reserve_queue_memory(Size wanted)
+{
+	Size min_size = (Size) hbase_fdw_min_queue_size * 1024;
+	uint64 budget = (uint64) hbase_fdw_total_queue_size * 1024;
+	uint64 used = pg_atomic_read_u64(&control->queue_memory_used);
+	Size granted;
+
+	for (;;)
+	{
+		granted = wanted;
+		if (used + granted > budget)
+			granted = used < budget ? budget - used : 0;
+		if (granted < min_size)
+			granted = min_size;
+
+		if (pg_atomic_compare_exchange_u64(&control->queue_memory_used,
+										   &used, used + granted))
+			return granted;
+	}
+}
+
+void
+release_queue_memory(Size size)
+{
+	pg_atomic_fetch_sub_u64(&control->queue_memory_used, size);
+}
+
+PG_FUNCTION_INFO_V1(hbase_fdw_status);
+
+/*
+ * Report the state of the bgworker's HBase connection and how many of the
+ * hbase_fdw.prewarm_tables had their region locations cached.
+ */
+Datum
+hbase_fdw_status(PG_FUNCTION_ARGS)
+{
+	static const char *state_names[] = { "starting", "connected", "unavailable", "stopped" };
+	TupleDesc tupdesc;
+	Datum values[4];
+	bool nulls[4] = { false, false, false, false };
+	HBaseConnectorState state;
+
+	if (control == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("hbase_fdw must be loaded via shared_preload_libraries")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	SpinLockAcquire(&control->mutex);
+	state = control->connector_state;
+	values[1] = Int32GetDatum(control->prewarmed_tables);
+	values[2] = Int32GetDatum(control->prewarm_failures);
+	values[3] = Int64GetDatum(control->prewarmed_regions);
+	SpinLockRelease(&control->mutex);
+	values[0] = CStringGetTextDatum(state_names[state]);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+static double
+us_to_ms(uint64 us)
+{
+	return (double) us / 1000.0;
+}
+
+static Datum
+histogram_datum(pg_atomic_uint64 *histogram)
+{
+	Datum counts[HBASE_FDW_HISTOGRAM_BUCKETS];
+
+	for (int i = 0; i < HBASE_FDW_HISTOGRAM_BUCKETS; i++)
+		counts[i] = Int64GetDatum(pg_atomic_read_u64(&histogram[i]));
+	return PointerGetDatum(construct_array(counts, HBASE_FDW_HISTOGRAM_BUCKETS,
+										   INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+}
+
+PG_FUNCTION_INFO_V1(hbase_fdw_stat_activity);
+
+/*
+ * One row for every slot that is waiting for or serving a scan.  Slots are
+ * not tied to a thread, the bgworker hands each to whichever thread has the
+ * fewest scans, so they are what the view shows.
+ */
+Datum
+hbase_fdw_stat_activity(PG_FUNCTION_ARGS)
+{
+	static const char *state_names[] = { "idle", "queued", "hbase", "blocked", "running" };
+	static const char *operation_names[] = { "scan", "modify", "direct modify" };
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	TimestampTz now = GetCurrentTimestamp();
+
+	if (control == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("hbase_fdw must be loaded via shared_preload_libraries")));
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	for (int i = 0; i < control->num_workers; i++)
+	{
+		hbase_fdw_worker *worker = &control->worker[i];
+		HBaseScanStats *stats = &worker->stats;
+		Datum values[13];
+		bool nulls[13];
+		HBaseScanState state;
+		HBaseCommand command;
+		int pid;
+		int thread;
+		TimestampTz requested;
+		TimestampTz started;
+		long secs;
+		int usecs;
+
+		SpinLockAcquire(&worker->mutex);
+		state = pg_atomic_read_u32(&stats->state);
+		pid = worker->backend_pid;
+		requested = worker->requested;
+		started = worker->started;
+		command = worker->command;
+		thread = stats->thread;
+		SpinLockRelease(&worker->mutex);
+
+		if (state == scan_state_idle)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int32GetDatum(i);
+		values[1] = Int32GetDatum(pid);
+		values[5] = CStringGetTextDatum(state_names[state]);
+		values[7] = Int64GetDatum(pg_atomic_read_u64(&stats->rows));
+		values[8] = Int64GetDatum(pg_atomic_read_u64(&stats->bytes));
+		values[9] = Float8GetDatum(us_to_ms(pg_atomic_read_u64(&stats->hbase_us)));
+		values[10] = Float8GetDatum(us_to_ms(pg_atomic_read_u64(&stats->blocked_us)));
+
+		/* The command is only copied once the bgworker picks the scan up */
+		if (state == scan_state_queued)
+		{
+			nulls[2] = nulls[3] = nulls[4] = nulls[6] = true;
+			TimestampDifference(requested, now, &secs, &usecs);
+		}
+		else
+		{
+			values[2] = ObjectIdGetDatum(command.relid);
+			values[3] = CStringGetTextDatum(command.table_name);
+			values[4] = CStringGetTextDatum(operation_names[command.operation]);
+			values[6] = TimestampTzGetDatum(started);
+			TimestampDifference(requested, started, &secs, &usecs);
+		}
+		values[11] = Float8GetDatum(secs * 1000.0 + usecs / 1000.0);
+		values[12] = Int32GetDatum(thread);
+		nulls[12] = thread < 0;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(hbase_fdw_stat_workers);
+
+/*
+ * Totals over every scan that has finished since the server started, with
+ * histograms of scan duration and queue wait.  Bucket 0 counts times under
+ * 1ms and bucket n those under 2^n ms, the last one everything longer.
+ */
+Datum
+hbase_fdw_stat_workers(PG_FUNCTION_ARGS)
+{
+	hbase_fdw_totals *totals;
+	TupleDesc tupdesc;
+	Datum values[13];
+	bool nulls[13];
+	int in_use = 0;
+
+	if (control == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("hbase_fdw must be loaded via shared_preload_libraries")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	for (int i = 0; i < control->num_workers; i++)
+	{
+		if (pg_atomic_read_u32(&control->worker[i].stats.state) != scan_state_idle)
+			in_use++;
+	}
+
+	totals = &control->totals;
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int32GetDatum(control->num_workers);
+	values[1] = Int32GetDatum(in_use);
+	values[2] = Int64GetDatum(pg_atomic_read_u64(&totals->scans));
+	values[3] = Int64GetDatum(pg_atomic_read_u64(&totals->modifies));
+	values[4] = Int64GetDatum(pg_atomic_read_u64(&totals->cancelled));
+	values[5] = Int64GetDatum(pg_atomic_read_u64(&totals->failed));
+	values[6] = Int64GetDatum(pg_atomic_read_u64(&totals->rows));
+	values[7] = Int64GetDatum(pg_atomic_read_u64(&totals->bytes));
+	values[8] = Float8GetDatum(us_to_ms(pg_atomic_read_u64(&totals->hbase_us)));
+	values[9] = Float8GetDatum(us_to_ms(pg_atomic_read_u64(&totals->blocked_us)));
+	values[10] = Float8GetDatum(us_to_ms(pg_atomic_read_u64(&totals->queue_wait_us)));
+	values[11] = histogram_datum(totals->duration_histogram);
+	values[12] = histogram_datum(totals->queue_wait_histogram);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+PG_FUNCTION_INFO_V1(hbase_fdw_stat_threads);
+
+/*
+ * One row for every worker thread of the bgworker, with what it is doing
+ * right now and how many scans it serves.  A thread is idle while it sleeps
+ * because none of its scans can make progress.
+ */
+Datum
+hbase_fdw_stat_threads(PG_FUNCTION_ARGS)
+{
+	static const char *state_names[] = { "idle", "queued", "hbase", "blocked", "running" };
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	int scans[HBASE_FDW_NUM_WORKERS];
+
+	if (control == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("hbase_fdw must be loaded via shared_preload_libraries")));
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	memset(scans, 0, sizeof(scans));
+	for (int i = 0; i < control->num_workers; i++)
+	{
+		hbase_fdw_worker *worker = &control->worker[i];
+		int thread;
+
+		SpinLockAcquire(&worker->mutex);
+		thread = worker->stats.thread;
+		if (pg_atomic_read_u32(&worker->stats.state) == scan_state_idle)
+			thread = -1;
+		SpinLockRelease(&worker->mutex);
+
+		if (thread >= 0 && thread < HBASE_FDW_NUM_WORKERS)
+			scans[thread]++;
+	}
+
+	for (int i = 0; i < HBASE_FDW_NUM_WORKERS; i++)
+	{
+		Datum values[3];
+		bool nulls[3] = { false, false, false };
+
+		values[0] = Int32GetDatum(i);
+		values[1] = CStringGetTextDatum(state_names[pg_atomic_read_u32(&control->thread_state[i])]);
+		values[2] = Int32GetDatum(scans[i]);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
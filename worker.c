@@ -11,6 +11,60 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <time.h>
+
+/*
+ * Most messages a scan may send before the thread moves on to its next scan,
+ * so one fast consumer can't starve the others.
+ */
+#define HBASE_FDW_MESSAGES_PER_TURN 16
+
+/*
+ * Longest a thread sleeps when none of its scans could make progress.  It is
+ * woken as soon as one can, see wake_thread, so this only bounds how late a
+ * scan notices its timeout.
+ */
+#define HBASE_FDW_IDLE_WAIT_NS 100000000L
+
+/*
+ * A scan being served by a worker thread.  There is one of these for every
+ * slot in shared memory, owned by whichever thread the slot was handed to.
+ */
+typedef struct worker_scan {
+	int slot;
+	int thread;
+	shm_mq_handle *tuples_mq;
+	shm_mq_handle *mutations_mq;	/* only for operation_modify */
+	HBaseCommand *command;
+	HBaseColumn *columns;
+	HBaseFilter *filters;
+	char *params;
+
+	bool started;
+	ScannerData scanner_data;
+
+	/* Counters shown by hbase_fdw_stat_activity, see set_state */
+	HBaseScanStats *stats;
+	HBaseScanState state;
+	uint64 state_since_us;
+	uint64 started_us;
+	bool failed;
+
+	/*
+	 * The message being sent.  A send that finds the queue full is parked
+	 * and retried later with the same message, as shm_mq requires.
+	 */
+	char *msg;
+	Size msg_len;
+	bool last_msg;
+	bool parked;
+	union {
+		HBaseFdwMessage msg;
+		char buf[offsetof(HBaseFdwMessage, data) + 256];
+	} error;
+
+	struct worker_scan *next;
+} worker_scan;
 
 typedef struct thread_data  {
 	slock_t mutex;
@@ -19,14 +73,18 @@ typedef struct thread_data  {
 	pthread_t thread;
 	int worker_num;
 	bool shutdown_worker;
-	void *jvm_env;
-	HBaseCommand *command;
-	HBaseColumn *columns;
-	HBaseFilter *filters;
-	shm_mq_handle *tuples_mq;
+	JniContext *jni;
+
+	/* Scans handed over by the main thread, protected by cond_mutex */
+	worker_scan *incoming;
+	int nr_scans;
+
+	/* One of the thread's scans may be able to move, protected by cond_mutex */
+	bool woken;
 } thread_data;
 
 thread_data *threads;
+static worker_scan *scans;
 
 static void *
 run_worker(void *thread_data);
@@ -34,18 +92,63 @@ run_worker(void *thread_data);
 static bool
 check_for_exit(thread_data *thread_data);
 
+static bool
+step_scan(JniContext *jni, worker_scan *scan);
+
+static void
+finish_scan(thread_data *thread_data, worker_scan *scan);
+
+static void
+set_error(worker_scan *scan, const char *error);
+
+static int
+next_mutation_reply(JniContext *jni, worker_scan *scan, bool *applied);
+
+static void
+set_state(worker_scan *scan, HBaseScanState state);
+
+static uint64
+now_us(void);
+
+/*
+ * Hand a newly activated slot to the thread with the fewest scans.
+ */
 void
 thread_start_worker(int n, shm_mq_handle *tuples_mq,
+					shm_mq_handle *mutations_mq,
 					HBaseCommand *command,
 					HBaseColumn *columns,
-					HBaseFilter *filters)
+					HBaseFilter *filters,
+					char *params)
 {
-	thread_data *data = &threads[n];
+	worker_scan *scan = &scans[n];
+	thread_data *data = &threads[0];
+
+	for (int i = 1; i < HBASE_FDW_NUM_WORKERS; i++)
+	{
+		pg_read_barrier();
+		if (threads[i].nr_scans < data->nr_scans)
+			data = &threads[i];
+	}
+
+	memset(scan, 0, sizeof(*scan));
+	scan->slot = n;
+	scan->tuples_mq = tuples_mq;
+	scan->mutations_mq = mutations_mq;
+	scan->command = command;
+	scan->columns = columns;
+	scan->filters = filters;
+	scan->params = params;
+	scan->thread = data->worker_num;
+	scan->stats = scan_stats(n);
+	scan->stats->thread = data->worker_num;
+	scan->state = scan_state_hbase;
+	scan->started_us = scan->state_since_us = now_us();
+
 	pthread_mutex_lock(&data->cond_mutex);
-	data->tuples_mq = tuples_mq;
-	data->command = command;
-	data->columns = columns;
-	data->filters = filters;
+	scan->next = data->incoming;
+	data->incoming = scan;
+	data->nr_scans++;
 	pthread_cond_signal(&data->cond);
 	pthread_mutex_unlock(&data->cond_mutex);
 }
@@ -53,33 +156,23 @@ thread_start_worker(int n, shm_mq_handle *tuples_mq,
 void
 thread_reset_worker(int n)
 {
-	thread_data *data = &threads[n];
-	data->tuples_mq = NULL;
-	data->command = NULL;
-	data->columns = NULL;
-	data->filters = NULL;
 	reset_worker(n);
 	SetLatch(MyLatch);
 }
 
-bool
-thread_is_working(int n)
-{
-	thread_data *data = &threads[n];
-	pg_read_barrier();
-	return data->command != NULL;
-}
-
 void
 allocate_threads()
 {
 	threads = palloc0(sizeof(*threads) * HBASE_FDW_NUM_WORKERS);
+	scans = palloc0(sizeof(*scans) * HBASE_FDW_MAX_SCANS);
 	for (int i = 0; i < HBASE_FDW_NUM_WORKERS; i++)
 	{
-		threads[i].jvm_env = NULL;
+		threads[i].jni = NULL;
 		threads[i].worker_num = i;
 		threads[i].shutdown_worker = false;
-		threads[i].command = NULL;
+		threads[i].incoming = NULL;
+		threads[i].nr_scans = 0;
+		threads[i].woken = false;
 		pthread_cond_init(&threads[i].cond, NULL);
 		pthread_mutex_init(&threads[i].cond_mutex, NULL);
 		SpinLockInit(&threads[i].mutex);
@@ -87,70 +180,345 @@ allocate_threads()
 	}
 }
 
+/*
+ * Wake a thread whose scans may be able to move.  Called by the JVM when a
+ * fetch from HBase completes, from any thread.
+ */
+void
+wake_thread(int n)
+{
+	thread_data *data = &threads[n];
+
+	pthread_mutex_lock(&data->cond_mutex);
+	data->woken = true;
+	pthread_cond_signal(&data->cond);
+	pthread_mutex_unlock(&data->cond_mutex);
+}
+
+/*
+ * Called by the bgworker when its latch is set, which is how shm_mq tells it
+ * that a backend read from a tuple queue, wrote to a mutations queue, or
+ * went away, and how cancel_worker tells it about a cancelled scan.  Any
+ * thread may be serving the scan, so all of them are woken.
+ */
+void
+wake_threads(void)
+{
+	for (int i = 0; i < HBASE_FDW_NUM_WORKERS; i++)
+		wake_thread(i);
+}
+
+/*
+ * Each thread serves any number of scans.  Messages are sent without waiting,
+ * so a backend that stops reading only parks its own scan, and the thread
+ * keeps rotating through the scans that can make progress.  When none can,
+ * it sleeps until it is woken or a new scan arrives.
+ */
 static void *
 run_worker(void *data)
 {
 	thread_data *thread_data = data;
-	void *jvm_cols;
-	struct timespec time = { 5, 0 };
+	worker_scan *active = NULL;
+	bool progress = true;
 
-	pthread_mutex_lock(&thread_data->cond_mutex);
-	thread_data->jvm_env = jvm_attach_thread();
+	thread_data->jni = jvm_attach_thread(thread_data->worker_num);
+	if (thread_data->jni == NULL)
+		pg_elog(WARNING, "Worker thread %d failed to attach to the JVM",
+				thread_data->worker_num);
 
 	while (!check_for_exit(thread_data)) {
-		pthread_cond_wait(
-			&thread_data->cond,
-			&thread_data->cond_mutex);
+		worker_scan **prev;
 
-		if (thread_data->command != NULL)
+		pthread_mutex_lock(&thread_data->cond_mutex);
+		if (thread_data->incoming == NULL && !check_for_exit(thread_data) &&
+			!thread_data->woken && (active == NULL || !progress))
 		{
-			ScannerData scanner_data;
-			bool more_rows = true;
-			shm_mq_result res;
-			scanner_data = setup_scanner(
-				thread_data->jvm_env,
-				thread_data->command->table_name,
-				thread_data->columns,
-				thread_data->command->nr_columns,
-				thread_data->filters,
-				thread_data->command->nr_filters);
-
-			if (scanner_data.scanner == NULL)
-				more_rows = false;
-
-			while (more_rows)
+			set_thread_state(thread_data->worker_num, scan_state_idle);
+			if (active == NULL)
+				pthread_cond_wait(&thread_data->cond, &thread_data->cond_mutex);
+			else
 			{
-				HBaseFdwMessage end_message;
-				HBaseFdwMessage *msg;
-				int len;
-				more_rows = scan_row(thread_data->jvm_env, &scanner_data);
-
-				if (more_rows) {
-					len = *(int*)scanner_data.ptr;
-					msg = (HBaseFdwMessage*)scanner_data.ptr;
-					msg->msg_type = msg_type_tuple;
-				}
-				else
-				{
-					msg = &end_message;
-					msg->msg_type = msg_type_end_of_stream;
-					len = sizeof(*msg);
-				}
-				res = shm_mq_send(thread_data->tuples_mq, len, msg, false);
-				if (res == SHM_MQ_DETACHED)
+				struct timespec until;
+
+				clock_gettime(CLOCK_REALTIME, &until);
+				until.tv_nsec += HBASE_FDW_IDLE_WAIT_NS;
+				if (until.tv_nsec >= 1000000000L)
 				{
-					pg_elog(WARNING, "Subprocess detached");
-					break;
+					until.tv_sec++;
+					until.tv_nsec -= 1000000000L;
 				}
+				pthread_cond_timedwait(&thread_data->cond, &thread_data->cond_mutex, &until);
 			}
-			destroy_scanner(thread_data->jvm_env, &scanner_data);
-			thread_reset_worker(thread_data->worker_num);
+		}
+		thread_data->woken = false;
+		while (thread_data->incoming != NULL)
+		{
+			worker_scan *scan = thread_data->incoming;
+
+			thread_data->incoming = scan->next;
+			scan->next = active;
+			active = scan;
+		}
+		pthread_mutex_unlock(&thread_data->cond_mutex);
+
+		progress = false;
+		prev = &active;
+		while (*prev != NULL)
+		{
+			worker_scan *scan = *prev;
+			bool done;
+
+			if (thread_data->jni == NULL)
+			{
+				if (!scan->started)
+					set_error(scan, "Worker thread is not attached to the JVM");
+				scan->started = true;
+			}
+
+			done = step_scan(thread_data->jni, scan);
+			if (!scan->parked)
+				progress = true;
+
+			if (done)
+			{
+				*prev = scan->next;
+				finish_scan(thread_data, scan);
+			}
+			else
+				prev = &scan->next;
+		}
+
+		/* Start with a different scan next time round */
+		if (active != NULL && active->next != NULL)
+		{
+			worker_scan *last = active;
+
+			while (last->next != NULL)
+				last = last->next;
+			last->next = active;
+			active = active->next;
+			last->next->next = NULL;
 		}
 	}
-	jvm_detach_thread();
+
+	while (active != NULL)
+	{
+		worker_scan *scan = active;
+
+		active = scan->next;
+		finish_scan(thread_data, scan);
+	}
+	jvm_detach_thread(thread_data->jni);
 	return NULL;
 }
 
+/*
+ * Move a scan along by up to HBASE_FDW_MESSAGES_PER_TURN messages.  Returns
+ * true once the scan is over, either because its last message was delivered
+ * or because the backend cancelled it or went away.
+ */
+static bool
+step_scan(JniContext *jni, worker_scan *scan)
+{
+	/* A fetch still waiting on HBase closes the scanner once it returns */
+	if (worker_cancelled(scan->slot))
+		return true;
+
+	if (!scan->started && scan->command->operation == operation_modify)
+	{
+		scan->started = true;
+		scan->scanner_data = setup_mutator(jni, scan->command, scan->columns);
+		if (scan->scanner_data.scanner == NULL)
+			set_error(scan, "Failed to set up HBase mutator");
+	}
+	else if (!scan->started)
+	{
+		scan->started = true;
+		scan->scanner_data = setup_scanner(
+			jni,
+			scan->command,
+			scan->columns,
+			scan->filters,
+			scan->params);
+		if (scan->scanner_data.scanner == NULL)
+			set_error(scan, "Failed to set up HBase scanner");
+	}
+
+	scan->parked = false;
+	for (int i = 0; i < HBASE_FDW_MESSAGES_PER_TURN; i++)
+	{
+		shm_mq_result res;
+
+		if (scan->msg == NULL)
+		{
+			HBaseFdwMessage *msg;
+			bool applied = false;
+			int len;
+
+			set_state(scan, scan_state_hbase);
+			if (scan->command->operation == operation_modify)
+				len = next_mutation_reply(jni, scan, &applied);
+			else
+				len = poll_row(jni, &scan->scanner_data);
+			if (len == HBASE_FDW_POLL_AGAIN)
+			{
+				/* Progress, but nothing to send: give the other scans a turn */
+				return false;
+			}
+			if (len < 0)
+				return true;
+			if (len == 0)
+			{
+				/* Nothing from HBase, or the backend, yet */
+				scan->parked = i == 0 && !applied;
+				return false;
+			}
+			set_state(scan, scan_state_running);
+			msg = (HBaseFdwMessage *) scan->scanner_data.ptr;
+			if (msg->msg_type == msg_type_error)
+				scan->failed = true;
+			scan->msg = scan->scanner_data.ptr;
+			scan->msg_len = len;
+			scan->last_msg = !(msg->msg_type == msg_type_tuple ||
+							   msg->msg_type == msg_type_heap_tuple ||
+							   msg->msg_type == msg_type_tuple_chunk);
+		}
+
+		res = shm_mq_send(scan->tuples_mq, scan->msg_len, scan->msg, true);
+		if (res == SHM_MQ_WOULD_BLOCK)
+		{
+			set_state(scan, scan_state_blocked);
+			scan->parked = i == 0;
+			return false;
+		}
+		if (res == SHM_MQ_DETACHED)
+		{
+			pg_elog(WARNING, "Subprocess detached");
+			return true;
+		}
+
+		set_state(scan, scan_state_running);
+		pg_atomic_fetch_add_u64(&scan->stats->bytes, scan->msg_len);
+		if (((HBaseFdwMessage *) scan->msg)->msg_type == msg_type_tuple ||
+			((HBaseFdwMessage *) scan->msg)->msg_type == msg_type_heap_tuple)
+			pg_atomic_fetch_add_u64(&scan->stats->rows, 1);
+
+		scan->msg = NULL;
+		if (scan->last_msg)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Hand the batches of mutations the backend sent to the mutator, one at a
+ * time, and start a flush when the backend asks for one.  The writes run in
+ * the JVM, which wakes the thread when each is done.  Returns the length of
+ * the reply in the scan buffer, once a flush is done or a write failed, 0 if
+ * there is none yet, or -1 if the backend went away.
+ */
+static int
+next_mutation_reply(JniContext *jni, worker_scan *scan, bool *applied)
+{
+	for (int i = 0; i < HBASE_FDW_MESSAGES_PER_TURN; i++)
+	{
+		HBaseFdwMessage *msg;
+		Size len;
+		shm_mq_result res;
+		bool busy;
+		int reply;
+
+		reply = poll_mutator(jni, &scan->scanner_data, &busy);
+		if (reply > 0 || busy)
+			return reply;
+
+		set_state(scan, scan_state_blocked);
+		res = shm_mq_receive(scan->mutations_mq, &len, (void **) &msg, true);
+		if (res == SHM_MQ_WOULD_BLOCK)
+			return 0;
+		if (res == SHM_MQ_DETACHED)
+		{
+			pg_elog(WARNING, "Subprocess detached");
+			return -1;
+		}
+
+		set_state(scan, scan_state_hbase);
+		*applied = true;
+		pg_atomic_fetch_add_u64(&scan->stats->bytes, len);
+		if (msg->msg_type == msg_type_flush)
+			reply = start_flush(jni, &scan->scanner_data);
+		else
+			reply = apply_mutations(jni, &scan->scanner_data, msg->data, msg->data_len);
+		if (reply > 0)
+			return reply;
+	}
+	return 0;
+}
+
+static void
+finish_scan(thread_data *thread_data, worker_scan *scan)
+{
+	if (thread_data->jni != NULL)
+		destroy_scanner(thread_data->jni, &scan->scanner_data);
+	set_state(scan, scan_state_idle);
+	record_scan_finished(scan->slot, now_us() - scan->started_us,
+						 worker_cancelled(scan->slot), scan->failed);
+	thread_reset_worker(scan->slot);
+
+	pthread_mutex_lock(&thread_data->cond_mutex);
+	thread_data->nr_scans--;
+	pthread_mutex_unlock(&thread_data->cond_mutex);
+}
+
+/* Make an error message the scan's last message */
+static void
+set_error(worker_scan *scan, const char *error)
+{
+	HBaseFdwMessage *msg = &scan->error.msg;
+
+	strlcpy(msg->data, error, sizeof(scan->error) - offsetof(HBaseFdwMessage, data));
+	msg->msg_type = msg_type_error;
+	msg->data_len = strlen(msg->data);
+	scan->msg = scan->error.buf;
+	scan->msg_len = offsetof(HBaseFdwMessage, data) + msg->data_len;
+	scan->last_msg = true;
+	scan->failed = true;
+}
+
+/*
+ * Move the scan to a new state, charging the time spent in the old one to
+ * time in HBase or time blocked.  Time spent sending counts as neither.  The
+ * thread serving the scan is now doing the same, whether or not the scan's
+ * state changes.
+ */
+static void
+set_state(worker_scan *scan, HBaseScanState state)
+{
+	uint64 now;
+
+	set_thread_state(scan->thread, state);
+	if (scan->state == state)
+		return;
+
+	now = now_us();
+	if (scan->state == scan_state_hbase)
+		pg_atomic_fetch_add_u64(&scan->stats->hbase_us, now - scan->state_since_us);
+	else if (scan->state == scan_state_blocked)
+		pg_atomic_fetch_add_u64(&scan->stats->blocked_us, now - scan->state_since_us);
+	pg_atomic_write_u32(&scan->stats->state, state);
+	scan->state = state;
+	scan->state_since_us = now;
+}
+
+static uint64
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static bool
 check_for_exit(thread_data *thread_data)
 {
@@ -168,7 +536,9 @@ shutdown_threads(void)
 	{
 		threads[i].shutdown_worker = true;
 		pg_write_barrier();
+		pthread_mutex_lock(&threads[i].cond_mutex);
 		pthread_cond_signal(&threads[i].cond);
+		pthread_mutex_unlock(&threads[i].cond_mutex);
 	}
 
 	for (int i = 0; i < HBASE_FDW_NUM_WORKERS; i++)